@@ -906,10 +906,17 @@ initialize_char2bit_table (void)
 }
 
 void 
-store_likelihood_info_at_leaf (double **l, char *align, int n_pat, int n_state)
+store_likelihood_info_at_leaf (double *l, char *align, int n_pat, int n_cat, int n_state)
 {
-  int i, j; /*the calling function should check if char2bit is initialized or not... */ 
-  for (j = 0; j < n_pat; j++) for (i=0; i < n_state; i++) l[j][i] = 0.;
-  for (j = 0; j < n_pat; j++) for (i=0; i < n_state; i++)
-    if (char2bit[ (int)align[j] ][0] & (1 << i)) l[j][i] = 1.;
+  int i, j, k; /*the calling function should check if char2bit is initialized or not... */ 
+  for (j = 0; j < n_pat * n_cat * n_state; j++) l[j] = 0.;
+  for (j = 0; j < n_pat; j++) for (k = 0; k < n_cat; k++) for (i=0; i < n_state; i++) /* same info for all categories */
+    if (char2bit[ (int)align[j] ][0] & (1 << i)) l[(j * n_cat + k) * n_state + i] = 1.;
+}
+
+void 
+store_ambiguity_code_at_leaf (uint8_t *code, char *align, int n_pat)
+{
+  int j;
+  for (j = 0; j < n_pat; j++) code[j] = (uint8_t) (char2bit[ (int)align[j] ][0] & 15);
 }
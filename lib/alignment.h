@@ -72,10 +72,11 @@ void biomcmc_pairwise_score_matches (char *s1, char *s2, int nsites, double *res
 /*! \brief proportion of  unambiguous (ACGT), partially ambiguous (RW etc), and completely ambiguous (N? etc) sites */
 void biomcmc_count_sequence_acgt (char *s1, int nsites, double *result);
 
-/*! \brief transform aligned sequence into likelihood for terminal taxa (e.g. A -> 0001, C-> 0010 etc) (e.g. A -> 0001,
- * C-> 0010 etc) (e.g. A -> 0001, C-> 0010 etc) (e.g. A -> 0001, C-> 0010 etc) (e.g. A -> 0001, C-> 0010 etc) (e.g. A ->
- * 0001, C-> 0010 etc) (e.g. A -> 0001, C-> 0010 etc) (e.g. A -> 0001, C-> 0010 etc) */
-void store_likelihood_info_at_leaf (double **l, char *align, int n_pat, int n_state);
+/*! \brief transform aligned sequence into likelihood for terminal taxa (e.g. A -> 0001, C-> 0010 etc), replicated over
+ * rate categories. Vector l is pattern-major, i.e. l[(pattern * n_cat + category) * n_state + state] (see lk_vector) */
+void store_likelihood_info_at_leaf (double *l, char *align, int n_pat, int n_cat, int n_state);
+/*! \brief 4-bit code of each DNA site (A=1, C=2, G=4, T=8, and their combinations for ambiguous sites and gaps) */
+void store_ambiguity_code_at_leaf (uint8_t *code, char *align, int n_pat);
 
 #endif
 
@@ -13,9 +13,58 @@
 
 #include "bipartition.h"
 
+#ifdef BIOMCMC_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define BitStringSize 64
 uint64_t mask_onebit[BitStringSize] = {0ULL}; // mask_onebit[j] => 1 << j
 
+/* kernels over n words, used for bitstrings longer than BipartitionInlineInts (shorter ones are faster inline) */
+enum {BIP_OP_AND, BIP_OP_OR, BIP_OP_ANDNOT, BIP_OP_NOTOR, BIP_OP_XOR, BIP_OP_XORNOT, BIP_OP_N};
+static void bip_kernel_and_scalar    (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n);
+static void bip_kernel_or_scalar     (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n);
+static void bip_kernel_andnot_scalar (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n);
+static void bip_kernel_notor_scalar  (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n);
+static void bip_kernel_xor_scalar    (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n);
+static void bip_kernel_xornot_scalar (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n);
+int bip_kernel_popcount_scalar (const uint64_t *x, int n);
+int bip_kernel_last_diff_scalar (const uint64_t *b1, const uint64_t *b2, int n);
+
+/* kernels start as scalar ones, thus are always valid even while another thread is choosing faster ones */
+static void (*bip_kernel_op[BIP_OP_N]) (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n) = {
+  &bip_kernel_and_scalar, &bip_kernel_or_scalar, &bip_kernel_andnot_scalar, 
+  &bip_kernel_notor_scalar, &bip_kernel_xor_scalar, &bip_kernel_xornot_scalar};
+/*! \brief number of set bits in x[0...n) */
+static int (*bip_kernel_popcount) (const uint64_t *x, int n) = &bip_kernel_popcount_scalar;
+/*! \brief highest index i where b1[i] != b2[i], or -1 if identical (most significant word decides comparisons) */
+static int (*bip_kernel_last_diff) (const uint64_t *b1, const uint64_t *b2, int n) = &bip_kernel_last_diff_scalar;
+/*! \brief set only after all kernels (and mask_onebit[]) are assigned */
+static bool bip_kernel_is_set = false;
+/* below this number of words, vectorised popcounts are slower than hardware popcount of each word */
+#define BipPopcountVectorMin 32
+/* below this number of words (4096 leaves), AVX-512 logical operations are slower than AVX2 ones; thus AVX-512 kernels call them */
+#define BipAvx512VectorMin 64
+
+/*! \brief assign kernel function pointers, returning chosen instruction set (called by set_bipartition_kernel()) */
+int bipartition_kernel_assign (int kernel);
+/*! \brief first bipsize chooses the fastest kernels; guarded since threads may create their first bipartitions together */
+void bipartition_kernel_init (void);
+#ifdef BIOMCMC_X86_SIMD
+int bip_kernel_popcount_popcnt (const uint64_t *x, int n);
+int bip_kernel_popcount_avx2 (const uint64_t *x, int n);
+int bip_kernel_last_diff_avx2 (const uint64_t *b1, const uint64_t *b2, int n);
+int bip_kernel_popcount_avx512 (const uint64_t *x, int n);
+int bip_kernel_last_diff_avx512 (const uint64_t *b1, const uint64_t *b2, int n);
+#endif
+
+/*! \brief point bip->bs to inline storage if possible, or to newly allocated memory otherwise */
+void bipartition_alloc_bitstring (bipartition bip);
+/*! \brief free arena once all its bipartitions were deleted */
+void del_bipartition_arena (bipartition_arena arena);
+/*! \brief result = b1 (op) b2, masking last word, with count of ones if update_count (or guess, see bipartition_OR() etc.) */
+void bipartition_apply_op (bipartition result, const bipartition b1, const bipartition b2, int op, bool update_count);
+
 bipartition
 new_bipartition (int size)
 {
@@ -27,23 +76,62 @@ new_bipartition (int size)
   bip->n_ones = 0;
   bip->ref_counter = 1;
 
-  bip->bs = (uint64_t*) biomcmc_malloc (bip->n->ints * sizeof (uint64_t));
+  bipartition_alloc_bitstring (bip);
   for (i=0; i < bip->n->ints; i++) bip->bs[i] = 0LL;
 
   return bip;
 }
 
+void
+bipartition_alloc_bitstring (bipartition bip)
+{
+  bip->arena = NULL;
+  if (bip->n->ints <= BipartitionInlineInts) bip->bs = bip->inline_bs;
+  else bip->bs = (uint64_t*) biomcmc_malloc (bip->n->ints * sizeof (uint64_t));
+}
+
+bipartition_arena
+new_bipartition_arena (int n_bip, int size)
+{
+  bipartition_arena arena;
+  int i, j;
+
+  arena = (bipartition_arena) biomcmc_malloc (sizeof (struct bipartition_arena_struct));
+  arena->n = new_bipsize (size);
+  arena->ref_counter = n_bip;
+  arena->bip = (struct bipartition_struct*) biomcmc_malloc (n_bip * sizeof (struct bipartition_struct));
+  if (arena->n->ints <= BipartitionInlineInts) arena->bs = NULL;
+  else arena->bs = (uint64_t*) biomcmc_malloc_aligned ((size_t) n_bip * arena->n->ints * sizeof (uint64_t));
+
+  for (i = 0; i < n_bip; i++) {
+    arena->bip[i].n = arena->n;
+    arena->bip[i].n_ones = 0;
+    arena->bip[i].ref_counter = 1;
+    arena->bip[i].arena = arena;
+    if (arena->bs) arena->bip[i].bs = arena->bs + (size_t) i * arena->n->ints;
+    else           arena->bip[i].bs = arena->bip[i].inline_bs;
+    for (j = 0; j < arena->n->ints; j++) arena->bip[i].bs[j] = 0ULL;
+  }
+  return arena;
+}
+
+void
+del_bipartition_arena (bipartition_arena arena)
+{
+  if (--arena->ref_counter) return;
+  if (arena->bs) free (arena->bs);
+  del_bipsize (arena->n);
+  free (arena->bip);
+  free (arena);
+}
+
 bipsize
 new_bipsize (int size)
 {
   bipsize n;
   int i;
 
-  if (!mask_onebit[0]) { // initialise only once
-    assert(BitStringSize == (8 * sizeof (uint64_t))); // if not 64 then we're in trouble 
-    mask_onebit[0] = 1;  
-    for (i = 1; i < BitStringSize; ++i) mask_onebit[i] = mask_onebit[i-1] << 1ULL; 
-  }
+  bipartition_kernel_init ();
 
   n = (bipsize) biomcmc_malloc (sizeof (struct bipsize_struct));
   n->bits = n->original_size = size;
@@ -66,7 +154,7 @@ new_bipartition_copy_from (const bipartition from)
   bip->n_ones = from->n_ones;
   bip->ref_counter = 1;
 
-  bip->bs = (uint64_t*) biomcmc_malloc (bip->n->ints * sizeof (uint64_t));
+  bipartition_alloc_bitstring (bip);
   for (i=0; i < bip->n->ints; i++) bip->bs[i] = from->bs[i];
 
   return bip;
@@ -84,7 +172,7 @@ new_bipartition_from_bipsize (bipsize n)
   bip->n_ones = 0;
   bip->ref_counter = 1;
 
-  bip->bs = (uint64_t*) biomcmc_malloc (bip->n->ints * sizeof (uint64_t));
+  bipartition_alloc_bitstring (bip);
   for (i=0; i < bip->n->ints; i++) bip->bs[i] = 0LL;
 
   return bip;
@@ -95,7 +183,8 @@ del_bipartition (bipartition bip)
 {
   if (bip) {
     if (--bip->ref_counter) return;
-    if (bip->bs) free (bip->bs); 
+    if (bip->arena) { del_bipartition_arena (bip->arena); return; } /* memory is freed with arena */
+    if (bip->bs != bip->inline_bs) free (bip->bs); 
     del_bipsize (bip->n);
     free (bip); 
   }
@@ -179,61 +268,61 @@ bipartition_copy (bipartition to, const bipartition from)
 void
 bipartition_OR (bipartition result, const bipartition b1, const bipartition b2, bool update_count)
 {
-  int i;
-  for (i=0; i < result->n->ints; i++) result->bs[i] = b1->bs[i] | b2->bs[i];
-  result->bs[i-1] &= b1->n->mask; /* do not change last bits (do not belong to bipartition) */
-  if (update_count) bipartition_count_n_ones (result);
-  else result->n_ones = b1->n_ones + b2->n_ones; // works on topologies where b1 and b2 are disjoint 
+  bipartition_apply_op (result, b1, b2, BIP_OP_OR, update_count);
+  if (!update_count) result->n_ones = b1->n_ones + b2->n_ones; // works on topologies where b1 and b2 are disjoint 
 }
 
 void
 bipartition_AND (bipartition result, const bipartition b1, const bipartition b2, bool update_count)
 {
-  int i;
-  for (i=0; i < result->n->ints; i++) result->bs[i] = b1->bs[i] & b2->bs[i];
-  result->bs[i-1] &= b1->n->mask; /* do not change last bits (do not belong to bipartition) */
-  if (update_count) bipartition_count_n_ones (result);
-  else result->n_ones = 0;// update_count = false should be used only when you don't care about this value (temp var)
+  bipartition_apply_op (result, b1, b2, BIP_OP_AND, update_count);
+  if (!update_count) result->n_ones = 0;// update_count = false should be used only when you don't care about this value (temp var)
 }
 
 void
 bipartition_ANDNOT (bipartition result, const bipartition b1, const bipartition b2, bool update_count)
 {
-  int i;
-  for (i=0; i < result->n->ints; i++) result->bs[i] = b1->bs[i] & (~b2->bs[i]);
-  result->bs[i-1] &= b1->n->mask; /* do not change last bits (do not belong to bipartition) */
-  if (update_count) bipartition_count_n_ones (result);
-  else result->n_ones = 0;// update_count = false should be used only when you don't care about this value (temp var)
+  bipartition_apply_op (result, b1, b2, BIP_OP_ANDNOT, update_count);
+  if (!update_count) result->n_ones = 0;// update_count = false should be used only when you don't care about this value (temp var)
 }
 
 void 
 bipartition_NOTOR (bipartition result, const bipartition b1, const bipartition b2, bool update_count)
 { /* complement of b1 and b2, used e.g. by tripartitions  */
-  int i;
-  for (i=0; i < result->n->ints; i++) result->bs[i] = ~(b1->bs[i] | b2->bs[i]);
-  result->bs[i-1] &= b1->n->mask; /* do not change last bits (do not belong to bipartition) */
-  if (update_count) bipartition_count_n_ones (result);
-  else result->n_ones = b1->n->bits - b1->n_ones - b2->n_ones ; // works if b1 and b2 are disjoint and bitstrings are not reduced 
+  bipartition_apply_op (result, b1, b2, BIP_OP_NOTOR, update_count);
+  if (!update_count) result->n_ones = b1->n->bits - b1->n_ones - b2->n_ones ; // works if b1 and b2 are disjoint and bitstrings are not reduced 
 }
 
 void
 bipartition_XOR (bipartition result, const bipartition b1, const bipartition b2, bool update_count)
 {
-  int i;
-  for (i=0; i < result->n->ints; i++) result->bs[i] = b1->bs[i] ^ b2->bs[i];
-  result->bs[i-1] &= b1->n->mask; /* do not change last bits (do not belong to bipartition) */
-  if (update_count) bipartition_count_n_ones (result);
-  else result->n_ones = 0;// update_count = false should be used only when you don't care about this value (temp var)
+  bipartition_apply_op (result, b1, b2, BIP_OP_XOR, update_count);
+  if (!update_count) result->n_ones = 0;// update_count = false should be used only when you don't care about this value (temp var)
 }
 
 void
 bipartition_XORNOT (bipartition result, const bipartition b1, const bipartition b2, bool update_count)
 { /* equivalent to XOR followed by NOT */
-  int i;
-  for (i=0; i < result->n->ints; i++) result->bs[i] = b1->bs[i] ^ (~b2->bs[i]);
-  result->bs[i-1] &= b1->n->mask; /* do not change last bits (do not belong to bipartition) */
-  if (update_count) bipartition_count_n_ones (result);
-  else result->n_ones = 0;// update_count = false should be used only when you don't care about this value (temp var)
+  bipartition_apply_op (result, b1, b2, BIP_OP_XORNOT, update_count);
+  if (!update_count) result->n_ones = 0;// update_count = false should be used only when you don't care about this value (temp var)
+}
+
+void
+bipartition_apply_op (bipartition result, const bipartition b1, const bipartition b2, int op, bool update_count)
+{
+  int i, n = result->n->ints;
+  uint64_t *r = result->bs, *x = b1->bs, *y = b2->bs;
+  if (n > BipartitionInlineInts) bip_kernel_op[op] (r, x, y, n);
+  else switch (op) {
+    case BIP_OP_AND:    for (i = 0; i < n; i++) r[i] = x[i] & y[i];    break;
+    case BIP_OP_OR:     for (i = 0; i < n; i++) r[i] = x[i] | y[i];    break;
+    case BIP_OP_ANDNOT: for (i = 0; i < n; i++) r[i] = x[i] & (~y[i]); break;
+    case BIP_OP_NOTOR:  for (i = 0; i < n; i++) r[i] = ~(x[i] | y[i]); break;
+    case BIP_OP_XOR:    for (i = 0; i < n; i++) r[i] = x[i] ^ y[i];    break;
+    default:            for (i = 0; i < n; i++) r[i] = x[i] ^ (~y[i]); break;
+  }
+  r[n-1] &= b1->n->mask; /* do not change last bits (do not belong to bipartition) */
+  if (update_count) result->n_ones = bip_kernel_popcount (r, n);
 }
 
 void
@@ -247,8 +336,10 @@ bipartition_NOT (bipartition result, const bipartition bip)
 
 int
 bipartition_count_n_ones (const bipartition bip)
-{
-  return bipartition_count_n_ones_pop1 (bip);
+{ /* pop1() or hardware popcount, depending on CPU */
+  bip->bs[bip->n->ints-1] &= bip->n->mask; /* remove last bits (do not belong to bipartition) */
+  bip->n_ones = bip_kernel_popcount (bip->bs, bip->n->ints);
+  return bip->n_ones;
 }
 
 int
@@ -342,9 +433,11 @@ bipartition_is_equal (const bipartition b1, const bipartition b2)
   int i;
   if (b1->n_ones  != b2->n_ones)  return false;
   if (b1->n->ints != b2->n->ints) return false;
-  for (i=0; i < b1->n->ints - 1; i++) if (b1->bs[i] != b2->bs[i]) return false;
+  i = b1->n->ints - 1;
   b1->bs[i] &= b1->n->mask; b2->bs[i] &= b2->n->mask; /* apply mask before comparing last elems */
   if (b1->bs[i] != b2->bs[i]) return false; 
+  if (i >= BipartitionInlineInts) return (bip_kernel_last_diff (b1->bs, b2->bs, i) < 0);
+  for (i=0; i < b1->n->ints - 1; i++) if (b1->bs[i] != b2->bs[i]) return false;
   return true;
 }
 
@@ -370,7 +463,8 @@ compare_bipartitions_increasing (const void *a1, const void *a2)
   int i;
   if ((*b1)->n_ones > (*b2)->n_ones) return 1;
   if ((*b1)->n_ones < (*b2)->n_ones) return -1;
-  for (i = (*b1)->n->ints - 1; (i >= 0) && ((*b1)->bs[i] == (*b2)->bs[i]); i--); /* find position of distinct bipartition elem*/
+  if ((*b1)->n->ints > BipartitionInlineInts) i = bip_kernel_last_diff ((*b1)->bs, (*b2)->bs, (*b1)->n->ints);
+  else for (i = (*b1)->n->ints - 1; (i >= 0) && ((*b1)->bs[i] == (*b2)->bs[i]); i--); /* find position of distinct bipartition elem*/
   if (i < 0) return 0; /* identical bipartitions */
   if ((*b1)->bs[i] > (*b2)->bs[i]) return 1;
   else return -1;
@@ -388,7 +482,8 @@ bipartition_is_larger (const bipartition b1, const bipartition b2)
   int i;
   if (b1->n_ones > b2->n_ones) return true;
   if (b1->n_ones < b2->n_ones) return false;
-  for (i = b1->n->ints - 1; (i >= 0) && (b1->bs[i] == b2->bs[i]); i--); /* find position of distinct bipartition elem*/
+  if (b1->n->ints > BipartitionInlineInts) i = bip_kernel_last_diff (b1->bs, b2->bs, b1->n->ints);
+  else for (i = b1->n->ints - 1; (i >= 0) && (b1->bs[i] == b2->bs[i]); i--); /* find position of distinct bipartition elem*/
   if (i < 0) return false; /* identical bipartitions */
   if (b1->bs[i] > b2->bs[i]) return true;
   else return false;
@@ -479,6 +574,241 @@ bipartition_resize_vector (bipartition *bvec, int n_b)
   for (k = 0; k < n_b; k++) { bvec[k]->bs[i] &= bvec[0]->n->mask; bipartition_count_n_ones (bvec[k]); }
 }
 
+/* Kernels over vectors of words, chosen at runtime */
+
+#define BIP_KERNEL_OP_SCALAR(name, expr) \
+static void bip_kernel_##name##_scalar (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n) \
+{ int i; for (i = 0; i < n; i++) res[i] = expr; }
+
+BIP_KERNEL_OP_SCALAR(and,    b1[i] & b2[i])
+BIP_KERNEL_OP_SCALAR(or,     b1[i] | b2[i])
+BIP_KERNEL_OP_SCALAR(andnot, b1[i] & (~b2[i]))
+BIP_KERNEL_OP_SCALAR(notor,  ~(b1[i] | b2[i]))
+BIP_KERNEL_OP_SCALAR(xor,    b1[i] ^ b2[i])
+BIP_KERNEL_OP_SCALAR(xornot, b1[i] ^ (~b2[i]))
+
+int
+bip_kernel_popcount_scalar (const uint64_t *x, int n)
+{ /* same as bipartition_count_n_ones_pop1() */
+  int i, count = 0;
+  uint64_t y;
+  for (i = 0; i < n; i++) { 
+    y = x[i] - ((x[i] & 0xa * pop_m_table[8]) >> 1);
+    y = (y & 3 * pop_m_table[8]) + ((y >> 2) & 3 * pop_m_table[8]);
+    y = (y + (y >> 4)) & 0x0f * pop_m_table[7];
+    count += (y * pop_m_table[7] >> 56);
+  }
+  return count;
+}
+
+int
+bip_kernel_last_diff_scalar (const uint64_t *b1, const uint64_t *b2, int n)
+{
+  for (n--; (n >= 0) && (b1[n] == b2[n]); n--);
+  return n;
+}
+
+#ifdef BIOMCMC_X86_SIMD
+
+__attribute__((target("popcnt"))) int
+bip_kernel_popcount_popcnt (const uint64_t *x, int n)
+{
+  int i;
+  uint64_t count = 0;
+  for (i = 0; i < n; i++) count += __builtin_popcountll (x[i]);
+  return (int) count;
+}
+
+/* AVX2 and AVX-512 versions of logical operations: vectors of 4 (or 8) words, and remaining words one by one */
+#define BIP_KERNEL_OP_AVX2(name, vexpr, expr) \
+__attribute__((target("avx2"))) static void \
+bip_kernel_##name##_avx2 (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n) \
+{ \
+  int i; \
+  __m256i x, y, ones = _mm256_set1_epi64x (-1LL); \
+  (void) ones; /* used only by some operations */ \
+  for (i = 0; i + 4 <= n; i += 4) { \
+    x = _mm256_loadu_si256 ((const __m256i*) (b1 + i)); \
+    y = _mm256_loadu_si256 ((const __m256i*) (b2 + i)); \
+    _mm256_storeu_si256 ((__m256i*) (res + i), vexpr); \
+  } \
+  for (; i < n; i++) res[i] = expr; \
+}
+
+#define BIP_KERNEL_OP_AVX512(name, vexpr, expr) \
+__attribute__((target("avx512f,avx2"))) static void \
+bip_kernel_##name##_avx512 (uint64_t *res, const uint64_t *b1, const uint64_t *b2, int n) \
+{ \
+  int i; \
+  __m512i x, y, ones = _mm512_set1_epi64 (-1LL); \
+  (void) ones; \
+  if (n < BipAvx512VectorMin) { bip_kernel_##name##_avx2 (res, b1, b2, n); return; } \
+  for (i = 0; i + 8 <= n; i += 8) { \
+    x = _mm512_loadu_si512 ((const void*) (b1 + i)); \
+    y = _mm512_loadu_si512 ((const void*) (b2 + i)); \
+    _mm512_storeu_si512 ((void*) (res + i), vexpr); \
+  } \
+  for (; i < n; i++) res[i] = expr; /* masked loads and stores are slower for a few words */ \
+}
+
+BIP_KERNEL_OP_AVX2(and,    _mm256_and_si256 (x, y),    b1[i] & b2[i])
+BIP_KERNEL_OP_AVX2(or,     _mm256_or_si256 (x, y),     b1[i] | b2[i])
+BIP_KERNEL_OP_AVX2(andnot, _mm256_andnot_si256 (y, x), b1[i] & (~b2[i]))
+BIP_KERNEL_OP_AVX2(notor,  _mm256_xor_si256 (_mm256_or_si256 (x, y), ones),  ~(b1[i] | b2[i]))
+BIP_KERNEL_OP_AVX2(xor,    _mm256_xor_si256 (x, y),    b1[i] ^ b2[i])
+BIP_KERNEL_OP_AVX2(xornot, _mm256_xor_si256 (_mm256_xor_si256 (x, y), ones), b1[i] ^ (~b2[i]))
+BIP_KERNEL_OP_AVX512(and,    _mm512_and_si512 (x, y),    b1[i] & b2[i])
+BIP_KERNEL_OP_AVX512(or,     _mm512_or_si512 (x, y),     b1[i] | b2[i])
+BIP_KERNEL_OP_AVX512(andnot, _mm512_andnot_si512 (y, x), b1[i] & (~b2[i]))
+BIP_KERNEL_OP_AVX512(notor,  _mm512_xor_si512 (_mm512_or_si512 (x, y), ones),  ~(b1[i] | b2[i]))
+BIP_KERNEL_OP_AVX512(xor,    _mm512_xor_si512 (x, y),    b1[i] ^ b2[i])
+BIP_KERNEL_OP_AVX512(xornot, _mm512_xor_si512 (_mm512_xor_si512 (x, y), ones), b1[i] ^ (~b2[i]))
+
+__attribute__((target("avx2,popcnt"))) int
+bip_kernel_popcount_avx2 (const uint64_t *x, int n)
+{ /* popcount of each nibble by table lookup, summed over bytes by sad (Mula, Kurz and Lemire, Comput.J. 2018) */
+  int i, j;
+  uint64_t count = 0;
+  __m256i table = _mm256_setr_epi8 (0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  __m256i low = _mm256_set1_epi8 (0x0f), zero = _mm256_setzero_si256 (), acc = zero, bytes, v;
+
+  if (n < BipPopcountVectorMin) return bip_kernel_popcount_popcnt (x, n);
+  for (i = 0; i + 4 <= n;) {
+    bytes = zero; /* each byte counts at most 8 x 31 = 248 bits before being summed into acc */
+    for (j = 0; (j < 31) && (i + 4 <= n); j++, i += 4) {
+      v = _mm256_loadu_si256 ((const __m256i*) (x + i));
+      bytes = _mm256_add_epi8 (bytes, _mm256_shuffle_epi8 (table, _mm256_and_si256 (v, low)));
+      bytes = _mm256_add_epi8 (bytes, _mm256_shuffle_epi8 (table, _mm256_and_si256 (_mm256_srli_epi16 (v, 4), low)));
+    }
+    acc = _mm256_add_epi64 (acc, _mm256_sad_epu8 (bytes, zero));
+  }
+  count = (uint64_t) _mm256_extract_epi64 (acc, 0) + (uint64_t) _mm256_extract_epi64 (acc, 1) + 
+          (uint64_t) _mm256_extract_epi64 (acc, 2) + (uint64_t) _mm256_extract_epi64 (acc, 3);
+  for (; i < n; i++) count += __builtin_popcountll (x[i]);
+  return (int) count;
+}
+
+__attribute__((target("avx2"))) int
+bip_kernel_last_diff_avx2 (const uint64_t *b1, const uint64_t *b2, int n)
+{ /* from most significant words, 4 at a time */
+  int equal;
+  __m256i x, y;
+  for (; n >= 4; n -= 4) {
+    x = _mm256_loadu_si256 ((const __m256i*) (b1 + n - 4));
+    y = _mm256_loadu_si256 ((const __m256i*) (b2 + n - 4));
+    equal = _mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpeq_epi64 (x, y)));
+    if (equal != 0xf) return n - 4 + 31 - __builtin_clz ((unsigned int) (~equal & 0xf));
+  }
+  for (n--; (n >= 0) && (b1[n] == b2[n]); n--);
+  return n;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt"))) int
+bip_kernel_popcount_avx512 (const uint64_t *x, int n)
+{
+  int i;
+  uint64_t count;
+  __m512i acc = _mm512_setzero_si512 ();
+  if (n < BipPopcountVectorMin) return bip_kernel_popcount_popcnt (x, n);
+  for (i = 0; i + 8 <= n; i += 8) acc = _mm512_add_epi64 (acc, _mm512_popcnt_epi64 (_mm512_loadu_si512 ((const void*) (x + i))));
+  for (count = (uint64_t) _mm512_reduce_add_epi64 (acc); i < n; i++) count += __builtin_popcountll (x[i]);
+  return (int) count;
+}
+
+__attribute__((target("avx512f"))) int
+bip_kernel_last_diff_avx512 (const uint64_t *b1, const uint64_t *b2, int n)
+{ /* from most significant words, 8 at a time */
+  __mmask8 differ;
+  for (; n >= 8; n -= 8) {
+    differ = _mm512_cmpneq_epi64_mask (_mm512_loadu_si512 ((const void*) (b1 + n - 8)), _mm512_loadu_si512 ((const void*) (b2 + n - 8)));
+    if (differ) return n - 8 + 31 - __builtin_clz ((unsigned int) differ);
+  }
+  for (n--; (n >= 0) && (b1[n] == b2[n]); n--);
+  return n;
+}
+
+#endif /* BIOMCMC_X86_SIMD */
+
+void
+bipartition_kernel_init (void)
+{
+  bool is_set;
+#ifdef _OPENMP
+#pragma omp atomic read seq_cst
+#endif
+  is_set = bip_kernel_is_set;
+  if (is_set) return;
+#ifdef _OPENMP
+#pragma omp critical (bipartition_kernel_init)
+#endif
+  {
+    if (!bip_kernel_is_set) set_bipartition_kernel (BIP_KERNEL_avx512);
+  } // omp critical
+}
+
+int
+set_bipartition_kernel (int kernel)
+{
+  int i;
+  if (!mask_onebit[0]) { // initialise only once
+    assert(BitStringSize == (8 * sizeof (uint64_t))); // if not 64 then we're in trouble 
+    for (i = BitStringSize - 1; i > 0; --i) mask_onebit[i] = 1ULL << i; 
+    mask_onebit[0] = 1;  // last, since it tells that mask_onebit[] is ready
+  }
+  kernel = bipartition_kernel_assign (kernel);
+#ifdef _OPENMP
+#pragma omp atomic write seq_cst
+#endif
+  bip_kernel_is_set = true; /* only after all pointers were assigned */
+  return kernel;
+}
+
+int
+bipartition_kernel_assign (int kernel)
+{
+  uint32_t cpu = biomcmc_cpu_features ();
+  bip_kernel_op[BIP_OP_AND]    = &bip_kernel_and_scalar;
+  bip_kernel_op[BIP_OP_OR]     = &bip_kernel_or_scalar;
+  bip_kernel_op[BIP_OP_ANDNOT] = &bip_kernel_andnot_scalar;
+  bip_kernel_op[BIP_OP_NOTOR]  = &bip_kernel_notor_scalar;
+  bip_kernel_op[BIP_OP_XOR]    = &bip_kernel_xor_scalar;
+  bip_kernel_op[BIP_OP_XORNOT] = &bip_kernel_xornot_scalar;
+  bip_kernel_popcount  = &bip_kernel_popcount_scalar;
+  bip_kernel_last_diff = &bip_kernel_last_diff_scalar;
+#ifdef BIOMCMC_X86_SIMD
+  if ((kernel >= BIP_KERNEL_avx512) && (cpu & BIOMCMC_CPU_AVX512F) && (cpu & BIOMCMC_CPU_AVX512POPCNT) && 
+      (cpu & BIOMCMC_CPU_AVX2)) { /* short bitstrings use AVX2 operations */
+    bip_kernel_op[BIP_OP_AND]    = &bip_kernel_and_avx512;
+    bip_kernel_op[BIP_OP_OR]     = &bip_kernel_or_avx512;
+    bip_kernel_op[BIP_OP_ANDNOT] = &bip_kernel_andnot_avx512;
+    bip_kernel_op[BIP_OP_NOTOR]  = &bip_kernel_notor_avx512;
+    bip_kernel_op[BIP_OP_XOR]    = &bip_kernel_xor_avx512;
+    bip_kernel_op[BIP_OP_XORNOT] = &bip_kernel_xornot_avx512;
+    bip_kernel_popcount  = &bip_kernel_popcount_avx512;
+    bip_kernel_last_diff = &bip_kernel_last_diff_avx512;
+    return BIP_KERNEL_avx512;
+  }
+  if ((kernel >= BIP_KERNEL_avx2) && (cpu & BIOMCMC_CPU_AVX2) && (cpu & BIOMCMC_CPU_POPCNT)) {
+    bip_kernel_op[BIP_OP_AND]    = &bip_kernel_and_avx2;
+    bip_kernel_op[BIP_OP_OR]     = &bip_kernel_or_avx2;
+    bip_kernel_op[BIP_OP_ANDNOT] = &bip_kernel_andnot_avx2;
+    bip_kernel_op[BIP_OP_NOTOR]  = &bip_kernel_notor_avx2;
+    bip_kernel_op[BIP_OP_XOR]    = &bip_kernel_xor_avx2;
+    bip_kernel_op[BIP_OP_XORNOT] = &bip_kernel_xornot_avx2;
+    bip_kernel_popcount  = &bip_kernel_popcount_avx2;
+    bip_kernel_last_diff = &bip_kernel_last_diff_avx2;
+    return BIP_KERNEL_avx2;
+  }
+  if ((kernel >= BIP_KERNEL_popcnt) && (cpu & BIOMCMC_CPU_POPCNT)) {
+    bip_kernel_popcount  = &bip_kernel_popcount_popcnt;
+    return BIP_KERNEL_popcnt;
+  }
+#else
+  (void) kernel; (void) cpu;
+#endif
+  return BIP_KERNEL_scalar;
+}
+
 /* Functions that work with tripartitions (associated to nodes instead of edges) */
 
 tripartition
@@ -22,8 +22,16 @@
 
 #include "lowlevel.h" 
 
+/*! \brief instruction sets of bipartition kernels (word-wise logical operations, popcount and comparisons), from slowest
+ * to fastest: popcnt is the hardware popcount of single words, and avx512 needs the VPOPCNTDQ extension */
+enum {BIP_KERNEL_scalar, BIP_KERNEL_popcnt, BIP_KERNEL_avx2, BIP_KERNEL_avx512};
+
+/*! \brief bitstrings of up to this many words (up to 191 bits, see bipsize_struct::ints) are stored within the struct */
+#define BipartitionInlineInts 3
+
 typedef struct bipartition_struct* bipartition;
 typedef struct bipsize_struct* bipsize;
+typedef struct bipartition_arena_struct* bipartition_arena;
 typedef bipartition* tripartition; /* just a vector of size 3 */
 
 /*! \brief Bit-string representation of splits. */
@@ -37,6 +45,24 @@ struct bipartition_struct
   bipsize n;
   /*! \brief How many times this struct is being referenced */
   int ref_counter;
+  /*! \brief arena where this struct and its bitstring are stored, or NULL if allocated individually */
+  bipartition_arena arena;
+  /*! \brief storage of short bitstrings (bs points here), avoiding a separate allocation */
+  uint64_t inline_bs[BipartitionInlineInts];
+};
+
+/*! \brief Contiguous storage of bipartitions of same size, like all splits of a topology: one allocation for all structs
+ * and (if they don't fit within the structs) another for all bitstrings. */
+struct bipartition_arena_struct
+{
+  /*! \brief vector of bipartitions, used as (arena->bip + i) */
+  struct bipartition_struct *bip;
+  /*! \brief bitstrings of all bipartitions, contiguous (NULL if stored within each bipartition) */
+  uint64_t *bs;
+  /*! \brief shared by all bipartitions */
+  bipsize n;
+  /*! \brief number of bipartitions not yet deleted (each bipartition may in turn be referenced several times) */
+  int ref_counter;
 };
 
 struct bipsize_struct
@@ -49,6 +75,9 @@ struct bipsize_struct
   int ref_counter;
 };
 
+/*! \brief use bipartition kernels up to given instruction set (BIP_KERNEL_*), if supported by the CPU; returns the chosen
+ * one. Otherwise the fastest is chosen when the first bipartition is created. Results are the same for all kernels */
+int set_bipartition_kernel (int kernel);
 /*! \brief create a new bipartition (bitstring) capable of storing an arbitrary number of bits and initialize it to zero
  * \param[in] size number of bits of desired bipartition
  * \returns bipartition (opaquely a vector of long long ints) */
@@ -59,6 +88,9 @@ bipsize new_bipsize (int size);
 bipartition new_bipartition_copy_from (const bipartition from);
 /*! \brief create new bipartition that will share bipsize -- useful for bipartition vectors */
 bipartition new_bipartition_from_bipsize (bipsize n);
+/*! \brief create n_bip bipartitions of size bits each (initialized to zero), in contiguous memory. Bipartitions are used
+ * (and shared) as usual, and the arena is freed once all of them are deleted with del_bipartition() */
+bipartition_arena new_bipartition_arena (int n_bip, int size);
 /*! \brief free memory allocated by bipartition */
 void del_bipartition (bipartition bip);
 /*! \brief free memory allocated by bipsize */
@@ -211,6 +211,15 @@ bipartition_hash (bipartition bip)
   return a;
 }
 
+uint64_t 
+bipartition_hash64 (bipartition bip) 
+{ // assumes bipartition is flipped to smaller set, if unrooted
+  int i; 
+  uint64_t a = biomcmc_hashint64_salted ((uint64_t) bip->n_ones, /*salt*/ 3);
+  for (i=0; i < bip->n->ints; i++) a = biomcmc_hashint64_salted (a ^ bip->bs[i], /*salt*/ 4); // xxhash avalanche
+  return a ? a : 1ULL; // zero is reserved for empty slots
+}
+
 /*** functions using constant_random_lists.h values ***/
 
 uint32_t
@@ -30,6 +30,8 @@ uint32_t biomcmc_hashint_64to32_seed (uint64_t x, unsigned int seed);
 uint32_t biomcmc_hashint_64to32 (uint64_t key);
 /*! \brief 32bits hash value for bipartition */
 uint32_t bipartition_hash (bipartition bip);
+/*! \brief 64bits hash value for bipartition, never zero (used as fingerprint) */
+uint64_t bipartition_hash64 (bipartition bip);
 
 /** \brief invert order of bits (endianness), to increase randomness usually */
 void biomcmc_invert_bits32_by_address (uint32_t *n);
@@ -17,9 +17,28 @@
 uint32_t hash (const char* str);
 inline uint32_t hash1 (hashtable ht, uint32_t h);
 inline uint32_t hash2 (hashtable ht, uint32_t h);
-/* Aux functions for hashtable of bipartitions  THESE are not thread safe (see functions above) */
-inline uint32_t biphash1 (bip_hashtable ht);
-inline uint32_t biphash2 (bip_hashtable ht);
+
+/*! \brief Open-addressing (linear probing) table of one segment, with its own lock and size */
+struct bip_hashsegment_struct {
+  struct bip_hashitem_struct *item; /*! \brief slots, stored inline; doubles in size when 3/4 full */
+  uint32_t size, n_items; /*! \brief number of slots (power of two) and of distinct bipartitions */
+#ifdef _OPENMP
+  omp_lock_t lock; /*! \brief segment lock, thus threads inserting into distinct segments do not wait */
+#endif
+};
+
+/* Aux functions for hashtable of bipartitions: each segment has its own lock (see bip_hashtable_struct) */
+void bip_hashsegment_init (bip_hashsegment seg, uint32_t size);
+void bip_hashsegment_grow (bip_hashsegment seg);
+/*! \brief slot of key in segment (empty slot if absent); segment must be locked */
+uint32_t bip_hashsegment_find (bip_hashsegment seg, bipartition key, uint64_t fingerprint);
+
+/*! \brief highest bits of fingerprint choose the segment, lowest bits choose the slot within segment */
+static inline bip_hashsegment
+bip_hashtable_segment (bip_hashtable ht, uint64_t fingerprint)
+{
+  return ht->segment + (fingerprint >> (64 - BipHashtableSegmentBits));
+}
 
 
 hashtable 
@@ -180,34 +199,16 @@ bip_hashtable
 new_bip_hashtable (int size)
 {
   int i; 
-  double x;
+  uint32_t seg_size = 8;
   bip_hashtable ht;
   
   ht = (bip_hashtable) biomcmc_malloc (sizeof (struct bip_hashtable_struct));
-
-  /* Setting hashtable to be size of power of 2. This is required so that proper open addressing can occur, i.e. 
-   * eventually every entry in the table is considered.  */
-  x = ceil (log (size) / log (2));
-  size = pow (2, x+1);
-  ht->size = size;
-  
-  /* allocate memory for table */
-  ht->table = (bip_hashitem*) biomcmc_malloc(ht->size * sizeof (bip_hashitem)); 
-  /* initialize to NULLS */
-  for(i = 0; i < ht->size; i++) ht->table[i] = NULL; 
-  ht->P = 2147483647; /* initialize P (large prime)*/
-  ht->probelength = 0;
-  ht->maxfreq = 1; // will store count of most frequent bipartition, to normalize frequency 
-  
-  /*initialize hash1 and hash2 variables*/
-  srand (time(0)); /* the GSL library would be overkill... */
-  ht->a1 = rand() * (ht->P - 1) + 1;
-  ht->a2 = rand() * (ht->P - 1) + 1;
-  ht->b1 = rand() * ht->P;
-  ht->b2 = rand() * ht->P;
-
+  ht->segment = (bip_hashsegment) biomcmc_malloc ((1 << BipHashtableSegmentBits) * sizeof (struct bip_hashsegment_struct));
+  /* segment sizes must be power of 2 (probing uses a mask), and tables are at most 3/4 full */
+  while ((uint64_t) 3 * seg_size < (uint64_t) 4 * size / (1 << BipHashtableSegmentBits)) seg_size <<= 1;
+  for (i = 0; i < (1 << BipHashtableSegmentBits); i++) bip_hashsegment_init (ht->segment + i, seg_size);
   ht->ref_counter = 1; /* at least one place (the calling structure/function) is using this hashtable */
-
+  ht->maxfreq = 1; // will store count of most frequent bipartition, to normalize frequency 
   return ht;
 }
 
@@ -216,62 +217,140 @@ del_bip_hashtable (bip_hashtable ht)
 {
   if (ht) {
     int i;
+    uint32_t j;
     if (--ht->ref_counter) return; /* some other place is using this hashtable, we cannot delete it yet */
-    for(i=ht->size-1; i>=0; i--) if (ht->table[i]) { 
-      if(ht->table[i]->key) del_bipartition (ht->table[i]->key); 
-      free (ht->table[i]); 
+    for (i = (1 << BipHashtableSegmentBits) - 1; i >= 0; i--) {
+      for (j = 0; j < ht->segment[i].size; j++) if (ht->segment[i].item[j].key) del_bipartition (ht->segment[i].item[j].key); 
+      if (ht->segment[i].item) free (ht->segment[i].item);
+#ifdef _OPENMP
+      omp_destroy_lock (&(ht->segment[i].lock));
+#endif
     }
-    if (ht->table) free (ht->table);
+    free (ht->segment);
     free (ht);
   }
 }
 
-uint32_t biphash1 (bip_hashtable ht) { return ((((ht->a1 * ht->h) + ht->b1) % ht->P) % ht->size) ; }
+void
+bip_hashsegment_init (bip_hashsegment seg, uint32_t size)
+{
+  uint32_t i;
+  seg->item = (struct bip_hashitem_struct*) biomcmc_malloc (size * sizeof (struct bip_hashitem_struct));
+  for (i = 0; i < size; i++) { seg->item[i].fingerprint = 0ULL; seg->item[i].key = NULL; seg->item[i].count = 0; }
+  seg->size = size;
+  seg->n_items = 0;
+#ifdef _OPENMP
+  omp_init_lock (&(seg->lock));
+#endif
+}
 
-uint32_t biphash2 (bip_hashtable ht) { return ((((ht->a2 * ht->h + ht->b2) % ht->P) % (ht->size - 3)) | 1); }
+void
+bip_hashsegment_grow (bip_hashsegment seg)
+{ /* fingerprints are stored, thus bipartitions are not hashed again */
+  struct bip_hashitem_struct *old = seg->item;
+  uint32_t i, j, old_size = seg->size;
+
+  seg->size *= 2;
+  seg->item = (struct bip_hashitem_struct*) biomcmc_malloc (seg->size * sizeof (struct bip_hashitem_struct));
+  for (i = 0; i < seg->size; i++) { seg->item[i].fingerprint = 0ULL; seg->item[i].key = NULL; seg->item[i].count = 0; }
+  for (i = 0; i < old_size; i++) if (old[i].fingerprint) {
+    for (j = old[i].fingerprint & (seg->size - 1); seg->item[j].fingerprint; j = (j + 1) & (seg->size - 1));
+    seg->item[j] = old[i];
+  }
+  free (old);
+}
+
+uint32_t
+bip_hashsegment_find (bip_hashsegment seg, bipartition key, uint64_t fingerprint)
+{
+  uint32_t i;
+  for (i = fingerprint & (seg->size - 1); seg->item[i].fingerprint; i = (i + 1) & (seg->size - 1))
+    if ((seg->item[i].fingerprint == fingerprint) && bipartition_is_equal (seg->item[i].key, key)) return i;
+  return i;
+}
 
 void 
 bip_hashtable_insert (bip_hashtable ht, bipartition key) 
 {
-  uint32_t i;
-  int h1, h2;
-  
-  ht->h = bipartition_hash (key) % ht->P; /*P_ is a large prime*/
-  h1 = biphash1 (ht);
-  h2 = biphash2 (ht);
+  uint64_t fingerprint = bipartition_hash64 (key); /* computed outside lock */
+  bip_hashsegment seg = bip_hashtable_segment (ht, fingerprint);
+  bip_hashitem item;
+  int count, maxfreq;
 
-  ht->probelength = 0;
-  
-  for (i = h1; ht->table[i]; i = (i + h2) % ht->size) {
-    ht->probelength++;
-    if (bipartition_is_equal (ht->table[i]->key, key)) {  // already observed
-      if (ht->maxfreq < ++ht->table[i]->count) ht->maxfreq = ht->table[i]->count; // notice the 'count++' doing main work 
-      return; 
+#ifdef _OPENMP
+  omp_set_lock (&(seg->lock));
+#endif
+  item = seg->item + bip_hashsegment_find (seg, key, fingerprint);
+  if (!item->fingerprint) { /* alloc space for new key */
+    item->fingerprint = fingerprint;
+    item->key = new_bipartition_copy_from (key); 
+    seg->n_items++;
+  }
+  count = ++item->count; // notice the 'count++' doing main work 
+  if (4 * seg->n_items > 3 * seg->size) bip_hashsegment_grow (seg);
+#ifdef _OPENMP
+  omp_unset_lock (&(seg->lock));
+#endif
+  /* table-wide maximum: critical section only when it must increase (no 'atomic compare' before OpenMP 5.1) */
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+  maxfreq = ht->maxfreq;
+  if (count <= maxfreq) return;
+#ifdef _OPENMP
+#pragma omp critical (bip_hashtable_maxfreq)
+#endif
+  { 
+    if (ht->maxfreq < count) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+      ht->maxfreq = count;
     }
   }
-  /* alloc space for new key */
-  ht->table[i] = biomcmc_malloc (sizeof (struct hashtable_item_struct));
-  ht->table[i]->key = new_bipartition_copy_from (key); 
-  ht->table[i]->count = 1;
   return;
 }
 
+int
+bip_hashtable_get_count (bip_hashtable ht, bipartition key) 
+{
+  uint64_t fingerprint = bipartition_hash64 (key);
+  bip_hashsegment seg = bip_hashtable_segment (ht, fingerprint);
+  int count;
+
+#ifdef _OPENMP
+  omp_set_lock (&(seg->lock));
+#endif
+  count = seg->item[ bip_hashsegment_find (seg, key, fingerprint) ].count; /* zero if slot is empty */
+#ifdef _OPENMP
+  omp_unset_lock (&(seg->lock));
+#endif
+  return count;
+}
+
 double
 bip_hashtable_get_frequency (bip_hashtable ht, bipartition key) 
 {
-  uint32_t i;
-  int h1, h2;
-  
-  ht->h = bipartition_hash (key) % ht->P; /*P_ is a large prime*/
-  h1 = biphash1 (ht);
-  h2 = biphash2 (ht);
-  
-  ht->probelength = 0;
+  int maxfreq;
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+  maxfreq = ht->maxfreq;
+  return (double) bip_hashtable_get_count (ht, key) / (double) maxfreq;
+}
 
-  for (i = h1; ht->table[i]; i = (i + h2) % ht->size) {
-    ht->probelength++;
-    if (!(ht->table[i])) return 0.;
-    else if ( (ht->table[i]) && (bipartition_is_equal (ht->table[i]->key, key)) ) return (double)(ht->table[i]->count)/(double)(ht->maxfreq);
+int
+bip_hashtable_n_items (bip_hashtable ht)
+{
+  int i, n_items = 0;
+  for (i = 0; i < (1 << BipHashtableSegmentBits); i++) {
+#ifdef _OPENMP
+    omp_set_lock (&(ht->segment[i].lock));
+#endif
+    n_items += ht->segment[i].n_items;
+#ifdef _OPENMP
+    omp_unset_lock (&(ht->segment[i].lock));
+#endif
   }
-  return -1.;
+  return n_items;
 }
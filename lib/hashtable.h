@@ -29,6 +29,10 @@ typedef struct hashtable_struct*      hashtable;
 typedef struct hashtable_item_struct* hashtable_item;
 typedef struct bip_hashtable_struct* bip_hashtable;
 typedef struct bip_hashitem_struct*  bip_hashitem;
+typedef struct bip_hashsegment_struct* bip_hashsegment;
+
+/*! \brief bipartition hashtable is divided into 2^BipHashtableSegmentBits segments, chosen by highest fingerprint bits */
+#define BipHashtableSegmentBits 6
 
 /*! \brief key/value pair for hash table */
 struct hashtable_item_struct {
@@ -56,24 +60,24 @@ struct hashtable_struct
   int ref_counter;
 };
 
-/*! \brief Hash table of bipartitions (see hashtable.h for original version, with string keys and integer values) */
-struct bip_hashtable_struct 
-{ 
-  int size; /*! \brief Table size. */
-  int probelength;  /*! \brief Number of collisions before empty slot is found. */
-  int maxfreq; /*! \brief frequency (integer) of most frequent bipartition */
-  uint32_t h; /*! \brief Value set by hash(). Used in hash1() and hash2() to avoid calling hash() again. */
-  uint32_t a1, a2, b1, b2, P; /*!< \brief Random values used in hash functions. */
-  bip_hashitem* table; /*! \brief Vector with key/value pairs. */
-  int ref_counter;  /*! \brief Counter of how many external references (structures sharing this hashtable) to avoid deletion */
-};
-
 /*! \brief key (bipartition) and value (frequency) pair for hash table of bipartitions */
 struct bip_hashitem_struct {
-  bipartition key; /*! \brief pointer to bipartition (must update ref_counter) */
+  uint64_t fingerprint; /*! \brief 64 bits hash of key, compared before the key itself (zero for empty slots) */
+  bipartition key; /*! \brief copy of inserted bipartition */
   int count;  /*! \brief frequency of bipartition (counter, but can be scaled to max count so far) */
 };
 
+/*! \brief Hash table of bipartitions (see hashtable.h for original version, with string keys and integer values).
+ *
+ * Thread safe and growable: the table is split into independent segments (striped locks), each with inline 64 bits
+ * fingerprints, such that several threads can count splits into the same table. */
+struct bip_hashtable_struct 
+{ 
+  int ref_counter;  /*! \brief Counter of how many external references (structures sharing this hashtable) to avoid deletion */
+  int maxfreq; /*! \brief frequency (integer) of most frequent bipartition, updated atomically by insertions */
+  bip_hashsegment segment; /*! \brief 2^BipHashtableSegmentBits segments, chosen by fingerprint (opaque, since layout depends on OpenMP) */
+};
+
 /*! \brief Insert key/value pair into hashtable. */
 void insert_hashtable (hashtable ht, const char* key, int value);
 /*! \brief Return location (value) of corresponding key (string) or negative value if not found. */
@@ -83,13 +87,17 @@ hashtable new_hashtable (int size);
 /*! \brief Free hashtable space. */
 void del_hashtable (hashtable ht);
 
-/*! \brief Create new hashtable of size bipartitions. */
+/*! \brief Create new hashtable for (initially) size bipartitions; table grows as needed. */
 bip_hashtable new_bip_hashtable (int size);
 /*! \brief Free bipartition hashtable space. */
 void  del_bip_hashtable (bip_hashtable ht);
-/*! \brief Insert key (bipartition) into bipartition hashtable, adding one to its count (freq). */
+/*! \brief Insert key (bipartition) into bipartition hashtable, adding one to its count (freq). Thread safe. */
 void bip_hashtable_insert (bip_hashtable ht, bipartition key);
+/*! \brief Return number of times bipartition was inserted, or zero if not found. */
+int bip_hashtable_get_count (bip_hashtable ht, bipartition key);
 /*! \brief Return frequency of bipartition (count/maxfreq) or zero if not found. */
 double bip_hashtable_get_frequency (bip_hashtable ht, bipartition key);
+/*! \brief Return number of distinct bipartitions in hashtable. */
+int bip_hashtable_n_items (bip_hashtable ht);
 
 #endif
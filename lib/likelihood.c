@@ -17,10 +17,157 @@
 
 #include "likelihood.h"
 
-const int LikScaleFrequency = 20;
+const double LikBranchLengthMin = 1e-8, LikBranchLengthMax = 100.;
+/* RELL replicates summed together by a thread (a multiple of SIMD vector lengths) */
+#define RellReplicateBlock 64
+
+/* partial likelihoods of node are stored over all patterns (otherwise recalculated over each block; leaves are always stored) */
+static inline bool
+phylogeny_node_is_stored (phylogeny phy, int id) { return (!phy->checkpoint || phy->checkpoint[id]); }
 
 /*! \brief main function that calculates log(likelihood) for changed nodes (called by high-level functions */
 void calculate_ln_likelihood_proposal (phylogeny phy, topology tre);
+/*! \brief sum of block_lnLk() over all blocks of patterns, where each thread works always on the same slice of patterns */
+double ln_likelihood_over_pattern_slices (phylogeny phy, topology tre, double (*block_lnLk) (phylogeny, topology, int, int));
+/*! \brief ln(likelihood) of patterns in [first, last), updating all internal nodes */
+double ln_likelihood_block_all_nodes (phylogeny phy, topology tre, int first, int last);
+/*! \brief ln(likelihood) of patterns in [first, last), updating only nodes that changed (topology_struct::undone) */
+double ln_likelihood_block_undone_nodes (phylogeny phy, topology tre, int first, int last);
+/*! \brief one side of a partial likelihood calculation (a child, or the rest of the tree if upstream): its vector, its
+ * site repeat classes, ambiguity codes (leaves only, for tip kernels), transition matrix and its lookup table for leaves */
+typedef struct
+{
+  lk_vector v;
+  uint8_t *classes, *tip;
+  double *Q, *T;
+} lk_operand;
+
+/*! \brief partial likelihood res of internal node from its children's left and right, for block of patterns [first, last),
+ * calculated only once for each distinct subtree pattern (if phylogeny_struct::site_repeats) */
+void lk_vector_from_children (phylogeny phy, topol_node node, lk_vector res, lk_vector left, lk_vector right, int first, int last);
+/*! \brief as lk_vector_from_children(), where vectors start at pattern offset (a block), and [first, last) is relative to it */
+void lk_vector_from_children_offset (phylogeny phy, topol_node node, lk_vector res, lk_vector left, lk_vector right, int offset, int first, int last);
+/*! \brief partial likelihood res = (Q x left) * (Q x right) for block of patterns [first, last), over distinct patterns */
+void lk_vector_from_operands (phylogeny phy, lk_vector res, lk_operand *left, lk_operand *right, int first, int last);
+/*! \brief partial likelihood res from left and right operands, for all patterns in [first, last), with scaling */
+void lk_vector_from_operands_range (phylogeny phy, lk_vector res, lk_operand *left, lk_operand *right, int first, int last);
+/*! \brief partial likelihood res from left and right operands, only for patterns pat[0...n), where operands store
+ * them at lpat[] and rpat[] (site repeats), with scaling */
+void lk_vector_from_operands_indexed (phylogeny phy, lk_vector res, lk_operand *left, lk_operand *right, 
+                                      int *pat, int *lpat, int *rpat, int n);
+/*! \brief site repeats of a block of n_pat patterns from children's (subtree patterns are equal iff both children's are), 
+ * returning the number of distinct ones (and their offsets in pat[]) */
+int site_repeats_from_children (uint8_t *rep, uint8_t *left, uint8_t *right, int n_pat, int *pat);
+/*! \brief operand of partial likelihood calculation for vector v at node (which must not be upstream, if leaf) */
+lk_operand lk_operand_of_node (phylogeny phy, topol_node node, lk_vector v);
+/*! \brief multiply partial likelihoods x[] of one element by powers of two if all are too small, updating its exponent */
+void scale_partial_likelihood (double *x, int *scale, int n_state, int exponent);
+/*! \brief number of elements in x[] (with n_state values each) needing scaling, i.e. with all values below threshold */
+int n_partial_likelihoods_below_threshold (double *x, int n_elem, int n_state, int exponent);
+/*! \brief ambiguity codes of a leaf node (for tip kernels), or NULL if internal */
+#define leaf_tip_codes(phy,node) (((phy)->tip && !(node)->internal) ? (phy)->tip[(node)->id] : NULL)
+/*! \brief updates pat_lnLk for patterns in [first, last) from vectors left and right connected by transition matrix Qv, 
+ * returning their sum weighted by pattern frequencies */
+double ln_likelihood_at_root (phylogeny phy, double *Qv, lk_vector left, lk_vector right, double *pat_lnLk, int first, int last);
+/*! \brief as ln_likelihood_at_root(), where vectors start at pattern offset, and [first, last) is relative to it */
+double ln_likelihood_at_root_offset (phylogeny phy, double *Qv, lk_vector left, lk_vector right, double *pat_lnLk, int offset, int first, int last);
+/*! \brief transition matrix between root's children */
+#define root_pmatrix(phy,root) ((phy)->pmat ? (phy)->pmat->P[(root)->id] : (phy)->model->Qv)
+
+/*! \brief one step in the evaluation of SPR candidates: partial likelihood res from left and right operands (if res is 
+ * not NULL) and, if cand >= 0, the ln(likelihood) of this candidate where subtree regraft is connected to res (or, if res
+ * is NULL, of the current topology) */
+typedef struct
+{
+  lk_vector res, regraft;
+  lk_operand left, right;
+  int cand;
+} spr_candidate_op;
+
+/*! \brief sequence of partial likelihood calculations for a list of SPR candidates, over a topology without the pruned 
+ * subtree (given by node ids), s.t. upstream vectors are calculated only once for all candidates sharing a prune node */
+typedef struct
+{
+  phylogeny phy;
+  topology tre;
+  int *up, *left, *right, root; /*! \brief topology without pruned subtree, where root is superfluous */
+  int *stamp, group;            /*! \brief upstream vector of node was already planned for this group of candidates */
+  lk_operand *down, *upstream;  /*! \brief downstream and upstream vectors of each node (upstream excludes node's subtree) */
+  spr_candidate_op *op;
+  int n_op, n_op_alloc;
+} spr_plan;
+
+/*! \brief operations (added to plan) for candidates cand[0...n) sharing the same prune node, with regraft nodes all inside
+ * (lca) or all outside its subtree */
+void spr_plan_prune_group (spr_plan *plan, int prune, int *regraft, int *cand, int n, bool lca);
+/*! \brief start a new group of candidates: plan's topology is reset to the current one */
+void spr_plan_reset_topology (spr_plan *plan);
+/*! \brief upstream operand of node v (partial likelihood of all but subtree v, at its parent), planned recursively */
+lk_operand* spr_plan_upstream (spr_plan *plan, int v);
+/*! \brief add calculation of res from left and right operands (and of candidate's ln(likelihood) if cand >= 0) to plan */
+spr_candidate_op* spr_plan_add_op (spr_plan *plan, lk_vector res, lk_operand *left, lk_operand *right, int cand);
+/*! \brief ln(likelihood) of each SPR applying it to topology, calculating all nodes and undoing it */ 
+void ln_likelihood_spr_candidates_one_by_one (phylogeny phy, topology tre, int *prune, int *regraft, int n, double *lnLk);
+
+/*! \brief memory-bounded or single precision modes: ln(likelihood) of all nodes (or of changed ones, and what they need) from checkpoints */
+void ln_likelihood_checkpoints (phylogeny phy, topology tre, bool all_nodes);
+/*! \brief memory-bounded or single precision modes: ln(likelihood) of patterns in [first, last), updating nodes in phylogeny_struct::recompute */
+double ln_likelihood_block_checkpoints (phylogeny phy, topology tre, int first, int last);
+/*! \brief memory-bounded or single precision modes: vector of node for block [first, last), starting at pattern first: 
+ * block buffer of thread, or stored vector seen from this pattern on (converted from single precision storage if node is 
+ * not recalculated) */
+lk_vector lk_vector_at_block (phylogeny phy, topol_node node, int thread, int first, int last);
+/*! \brief single precision mode: store block [first, last) of node, rounding its buffer (view, starting at pattern first) 
+ * to the stored values */
+void lk_vector_store_block (phylogeny phy, topol_node node, lk_vector view, int first, int last);
+/*! \brief memory-bounded mode: mark as checkpoints the nodes with more than threshold nodes to recalculate below them, 
+ * where n_below[] is the number of nodes recalculated from each node (zero at checkpoints); returns number of checkpoints */
+int select_checkpoints (topology tre, int threshold, bool *checkpoint, int *n_below);
+/*! \brief bytes of lk_vector with n_pat patterns, in single or double precision */
+size_t lk_vector_bytes (phylogeny phy, int n_pat, bool single);
+/*! \brief ln(likelihood) of all partitions by function lnLk (full or moved branches): larger partitions one at a time (each
+ * by all threads), then smaller ones concurrently (each by one thread) */
+void ln_likelihood_over_partitions (partitioned_phylogeny pp, topology tre, void (*lnLk) (phylogeny, topology));
+/*! \brief branch length optimisation, shared by all threads (each working on its own blocks of patterns, in the same
+ * parallel region, and all taking the same decisions from the sums in fixed order) */
+typedef struct
+{
+  phylogeny phy;
+  topology tre;
+  double *S;         /*! \brief products of upstream and downstream vectors in the eigenvector basis, S[(pat * n_cat + cat) * n_state + k] */
+  double *lnmax;     /*! \brief common scaling factor (log) of S for each pattern, from the integer exponents */
+  double *block_sum; /*! \brief ln(likelihood) and its first and second derivatives for each block of patterns */
+} blength_opt;
+
+/*! \brief loop over blocks b of patterns of this thread, inside a parallel region (see ln_likelihood_over_pattern_slices() ) */
+#define for_each_block_of_thread(phy,slice,stride,b) \
+  for (int _s = (slice); _s < (phy)->n_threads; _s += (stride)) for ((b) = (phy)->slice[_s]; (b) < (phy)->slice[_s + 1]; (b)++)
+
+/*! \brief optimise branch lengths of node's subtree in preorder, where above is the upstream vector of node through node's
+ * branch (or through root branch, if node is root's child, in which case its own branch is not optimised here) */
+void blength_optimise_subtree (blength_opt *opt, topol_node node, lk_operand *above, bool optimise_branch, int slice, int stride);
+/*! \brief optimise branch length of node (or root branch, if node is root) given its upstream and downstream vectors */
+void blength_optimise_branch (blength_opt *opt, topol_node node, lk_vector up, lk_vector down, int slice, int stride);
+/*! \brief Newton-Raphson maximisation of ln(likelihood) over branch length, starting from t, from current sum table */
+double blength_newton_raphson (blength_opt *opt, double t, int slice, int stride);
+/*! \brief ln(likelihood) and its first and second derivatives for branch length t (over all threads) */
+double blength_derivatives (blength_opt *opt, double t, double *d1, double *d2, int slice, int stride);
+/*! \brief sum table for patterns in [first, last), where up is at the parent and down at the child */
+void blength_sumtable_block (blength_opt *opt, lk_vector up, lk_vector down, int first, int last);
+/*! \brief ln(likelihood), first and second derivatives over patterns in [first, last), given exponentials of eigenvalues */
+void blength_derivatives_block (blength_opt *opt, double *expo, int first, int last, double *sum);
+/*! \brief partial likelihood res from left and right, over all blocks of this thread */
+void blength_vector_from_operands (blength_opt *opt, lk_vector res, lk_operand *left, lk_operand *right, int slice, int stride);
+/*! \brief downstream operand of node, through the transition matrix of its branch */
+lk_operand blength_operand_of_node (blength_opt *opt, topol_node node);
+/*! \brief upstream operand through the transition matrix of node's branch (or the root's, if up is at root's child) */
+lk_operand blength_operand_of_upstream (blength_opt *opt, topol_node node, lk_vector up, uint8_t *classes);
+/*! \brief ln(likelihood) over all threads, from the downstream vectors of root's children */
+double blength_ln_likelihood (blength_opt *opt, int slice, int stride);
+/*! \brief new length of node's branch (or root branch, keeping the proportion between root's children), updating its matrix */
+void set_branch_length (phylogeny phy, topology tre, topol_node node, double t);
+/*! \brief sum table and block sums for branch length optimisation */
+void blength_opt_init (blength_opt *opt, phylogeny phy, topology tre);
 
 /* real calculation (posterior distribution, using data) */
 /*! \brief ln(likelihood) of topology, updating all internal nodes */ 
@@ -30,11 +177,14 @@ void ln_likelihood_moved_branches_real (phylogeny phy, topology tre);
 /*! \brief ln(likelihood) of topology, based on changed nodes by statically updating lk_vector (under calling 
  * function control) */
 void ln_likelihood_moved_branches_at_lk_vector_real (phylogeny phy, topology tre, int idx);
+/*! \brief ln(likelihood) of each SPR neighbour of topology, without changing it */
+void ln_likelihood_spr_candidates_real (phylogeny phy, topology tre, int *prune, int *regraft, int n, double *lnLk);
 
 /* pointer to real or dummy likelihood calculation (defined in likelihood.h as external) */
 void (*ln_likelihood) (phylogeny phy, topology tre) = &ln_likelihood_real;
 void (*ln_likelihood_moved_branches) (phylogeny phy, topology tre) = &ln_likelihood_moved_branches_real;
 void (*ln_likelihood_moved_branches_at_lk_vector) (phylogeny phy, topology tre, int idx) = &ln_likelihood_moved_branches_at_lk_vector_real;
+void (*ln_likelihood_spr_candidates) (phylogeny phy, topology tre, int *prune, int *regraft, int n, double *lnLk) = &ln_likelihood_spr_candidates_real;
 
 /* dummy likelihood calculations (prior distribution, always zero) */
 void
@@ -46,6 +196,9 @@ ln_likelihood_moved_branches_dummy (phylogeny phy, topology tre)
 void
 ln_likelihood_moved_branches_at_lk_vector_dummy (phylogeny phy, topology tre, int idx) 
 { phy->lk_proposal = 0.; (void) tre; (void) idx; }
+void
+ln_likelihood_spr_candidates_dummy (phylogeny phy, topology tre, int *prune, int *regraft, int n, double *lnLk)
+{ (void) phy; (void) tre; (void) prune; (void) regraft; for (; n > 0; n--) lnLk[n-1] = 0.; }
 
 void
 set_likelihood_to_prior (void)
@@ -53,6 +206,7 @@ set_likelihood_to_prior (void)
   ln_likelihood = &ln_likelihood_dummy;
   ln_likelihood_moved_branches = &ln_likelihood_moved_branches_dummy;
   ln_likelihood_moved_branches_at_lk_vector = &ln_likelihood_moved_branches_at_lk_vector_dummy;
+  ln_likelihood_spr_candidates = &ln_likelihood_spr_candidates_dummy;
 }
 
 void
@@ -61,80 +215,62 @@ set_likelihood_to_posterior (void)
   ln_likelihood = &ln_likelihood_real;
   ln_likelihood_moved_branches = &ln_likelihood_moved_branches_real;
   ln_likelihood_moved_branches_at_lk_vector = &ln_likelihood_moved_branches_at_lk_vector_real;
+  ln_likelihood_spr_candidates = &ln_likelihood_spr_candidates_real;
 }
 
 void
 ln_likelihood_real (phylogeny phy, topology tre)
 { /* current --> proposal (=current->next) --> current */
-  int i, cat, pat, s1, s2;
-  double LikSite, lkMax, lkl, lkr, *left, *right, sum_of_lnLk = 0.;
-  bool scale;
+  double sum_of_lnLk;
 
   if (!tre->traversal_updated) update_topology_traversal (tre);
+  if (phy->checkpoint || phy->single_precision) { ln_likelihood_checkpoints (phy, tre, true); return; }
+  if (phy->pmat) update_branch_pmatrix_from_topology (phy, tre);
 
-  /*  "collapse(2)" only avail in openMP3.0 -- it collapses two for loops into one */
-#ifdef _OPENMP
-#pragma omp parallel for shared(phy,tre) \
-  private(pat,cat,i,s1,s2,lkl,lkr,left,right,LikSite,lkMax,scale) reduction (+:sum_of_lnLk)
-#endif
-  for (pat = 0; pat < phy->npat; pat++) { 
-    for (cat = 0; cat < phy->model->nrates; cat++) {
-      for (i = 0; i < tre->nleaves - 2; i++) { /* skip postorder[nleaves-2] which is root node */
-        scale = !(tre->postorder[i]->level % LikScaleFrequency); 
-        lkMax = 0.; /* maximum partial likelihood for this node/category/pattern */
-
-        left  = phy->l[tre->postorder[i]->left->id ]->d_current->next->lk[cat][pat];
-        right = phy->l[tre->postorder[i]->right->id]->d_current->next->lk[cat][pat];
-          
-        phy->l[tre->postorder[i]->id]->d_current->next->lnmax[cat][pat] = 
-        (phy->l[tre->postorder[i]->left->id ]->d_current->next->lnmax[cat][pat] +
-         phy->l[tre->postorder[i]->right->id]->d_current->next->lnmax[cat][pat]);
-
-        for (s1 = 0; s1 < 4; s1++) {
-          lkl = lkr = 0.0;
-          for (s2 = 0; s2 < 4; s2++) {
-            lkl += phy->model->Q[cat][s1][s2] * left[s2];
-            lkr += phy->model->Q[cat][s1][s2] * right[s2];
-          }
-          LikSite = phy->l[tre->postorder[i]->id]->d_current->next->lk[cat][pat][s1] = lkr * lkl;
-          if (scale && (LikSite > lkMax)) lkMax = LikSite; /* may slow down since compared many times, most of them "false" */
-        }
-          
-        if (scale) {
-          /* scale the partial likelihoods to avoid underflow: unlike Yang's suggestion (JMolEvol.2000.423) we scale
-           * each pattern, while he suggested over all patterns/sites. Each rate category is treated independently. */
-          if (lkMax <= 0.) biomcmc_error ("underflow: all partial likelihoods are <= 0.");
-
-          /* reescale only a few times since it is computationally expensive. Note that 
-           * left->split->n_ones >= right->split->n_ones always (by design of update_topology_traversal() ) */
-          phy->l[tre->postorder[i]->id]->d_current->next->lnmax[cat][pat] += log (lkMax);
-          for (s1 = 0; s1 < 4; s1++) phy->l[tre->postorder[i]->id]->d_current->next->lk[cat][pat][s1] /= lkMax;
-        }
-
-      } // for (i < tre->nleaves) 
-
-      /* root node is superfluous: the site likelihood is calculated between root->left and root->right */
-      LikSite = 0.;
-      left  = phy->l[tre->root->left->id ]->d_current->next->lk[cat][pat];
-      right = phy->l[tre->root->right->id]->d_current->next->lk[cat][pat];
-      /* lkMax will contain the sum of all scaling factors in log scale */
-      lkMax = (phy->l[tre->root->left->id ]->d_current->next->lnmax[cat][pat] + 
-               phy->l[tre->root->right->id]->d_current->next->lnmax[cat][pat]);
-
-      for (s1 = 0; s1 < 4; s1++) for (s2 = 0; s2 < 4; s2++) /* likelihood at root for pattern */
-        LikSite += phy->model->pi[s1] * left[s1] * phy->model->Q[cat][s1][s2] * right[s2];
+  sum_of_lnLk = ln_likelihood_over_pattern_slices (phy, tre, &ln_likelihood_block_all_nodes);
+  /* log (phy->model->nrates) is irreleveant in MCMC since it is a constant. It's here for completeness */
+  phy->lk_proposal = sum_of_lnLk - ((double) (phy->nsites) * log ((double) phy->model->nrates));
+}
 
-      /* log likelihood of pattern, averaged over discretized rates */
-      if (!cat) phy->pat_lnLk[pat] = log (LikSite) + lkMax; /* logspace_add(A,B) = log(exp(A)+exp(B)) below */
-      else      phy->pat_lnLk[pat] = biomcmc_logspace_add (phy->pat_lnLk[pat], log (LikSite) + lkMax);
-    } // for (category)
+double
+ln_likelihood_block_all_nodes (phylogeny phy, topology tre, int first, int last)
+{
+  int i;
+  topol_node node;
+  for (i = 0; i < tre->nleaves - 2; i++) { /* skip postorder[nleaves-2] which is root node */
+    node = tre->postorder[i];
+    lk_vector_from_children (phy, node, phy->l[node->id]->d_current->next, phy->l[node->left->id]->d_current->next, 
+                             phy->l[node->right->id]->d_current->next, first, last);
+  }
+  /* root node is superfluous: the site likelihood is calculated between root->left and root->right */
+  return ln_likelihood_at_root (phy, root_pmatrix (phy, tre->root), phy->l[tre->root->left->id]->d_current->next, 
+                                phy->l[tre->root->right->id]->d_current->next, phy->pat_lnLk, first, last);
+}
 
-    /* phylogenetic log likelihood over sites (weighted patterns), summed through parallel reduction */
-    sum_of_lnLk += phy->pat_lnLk[pat] * phy->weight[pat];
-  } // for (pattern) 
+double
+ln_likelihood_over_pattern_slices (phylogeny phy, topology tre, double (*block_lnLk) (phylogeny, topology, int, int))
+{
+  int blk, n_blk = (phy->npat + LikPatternBlock - 1) / LikPatternBlock;
+  double sum_of_lnLk = 0.;
 
-  /* log (phy->model->nrates) is irreleveant in MCMC since it is a constant. It's here for completeness */
-  phy->lk_proposal = sum_of_lnLk - ((double) (phy->nsites) * log ((double) phy->model->nrates));
+  /* each thread works on its own contiguous slice of patterns (see phylogeny_set_threads()), over all nodes, such that 
+   * partial likelihoods of children are usually still in cache, no cache line is shared between threads, and memory
+   * is local to the thread. OpenMP keeps the threads alive between calls; one thread doesn't need a parallel region */
+#ifdef _OPENMP
+#pragma omp parallel num_threads(phy->n_threads) proc_bind(close) if(phy->n_threads > 1) shared(phy,tre,block_lnLk)
+#endif
+  {
+    int b, slice = 0, stride = 1;
+#ifdef _OPENMP
+    slice  = omp_get_thread_num ();
+    stride = omp_get_num_threads (); /* may be lower than n_threads, in which case a thread works on several slices */
+#endif
+    for (; slice < phy->n_threads; slice += stride) for (b = phy->slice[slice]; b < phy->slice[slice + 1]; b++) 
+      phy->block_lnLk[b] = block_lnLk (phy, tre, b * LikPatternBlock, BIOMCMC_MIN ((b + 1) * LikPatternBlock, phy->npat));
+  }
+  /* instead of an OpenMP reduction, sum in a fixed order: result doesn't depend on the number of threads */
+  for (blk = 0; blk < n_blk; blk++) sum_of_lnLk += phy->block_lnLk[blk];
+  return sum_of_lnLk;
 }
 
 void 
@@ -145,7 +281,7 @@ accept_likelihood (phylogeny phy, topology tre)
 
   phy->lk_current = phy->lk_proposal;
 
-  for (i=tre->nleaves; i < tre->nnodes; i++) { /* topology and phylogeny share same ids */
+  for (i=tre->nleaves; i < tre->nnodes; i++) if (phy->l[i]->n_cycle) { /* topology and phylogeny share same ids */
     phy->l[i]->d_current = phy->l[i]->d_current->next; /* update lk ring */
   }
 }	
@@ -157,6 +293,7 @@ ln_likelihood_moved_branches_real (phylogeny phy, topology tre)
 
   if (!tre->traversal_updated) update_topology_traversal (tre);
   if ((!tre->n_undone) && tre->root->left->d_done && tre->root->right->d_done) return; 
+  if (phy->checkpoint || phy->single_precision) { ln_likelihood_checkpoints (phy, tre, false); return; }
 
   for (i = 0; i < tre->n_undone; i++) { /* scan all nodes with d_done = false, but updating only children */ 
     if (tre->undone[i]->left->d_done) phy->l[ tre->undone[i]->left->id  ]->d_proposal = phy->l[ tre->undone[i]->left->id  ]->d_current;
@@ -191,6 +328,8 @@ ln_likelihood_moved_branches_at_lk_vector_real (phylogeny phy, topology tre, int
 
   if (!tre->traversal_updated) update_topology_traversal (tre);
   if (!idx) biomcmc_error ("proposal likelihood will overwrite accepted (not your fault, it's a bug)");
+  if (phy->checkpoint || phy->single_precision) 
+    biomcmc_error ("likelihood at lk_vector index is not available in memory-bounded or single precision modes");
 
   for (i = 0; i < tre->n_undone; i++) { /* scan all nodes with d_done = false, but updating only children */ 
     if (tre->undone[i]->left->d_done) phy->l[ tre->undone[i]->left->id  ]->d_proposal = phy->l[ tre->undone[i]->left->id  ]->d[0];
@@ -220,80 +359,1059 @@ accept_likelihood_moved_branches_at_lk_vector (phylogeny phy, topology tre, int
 
 
 void
-calculate_ln_likelihood_proposal (phylogeny phy, topology tre)
-{ 
-  int i, cat, pat, s1, s2;
-  double LikSite, lkMax, lkl, lkr, *left, *right, sum_of_lnLk = 0.;
-  bool scale;
+ln_likelihood_spr_candidates_real (phylogeny phy, topology tre, int *prune, int *regraft, int n, double *lnLk)
+{ /* Each candidate is scored at the branch where the pruned subtree is regrafted: since the likelihood doesn't depend on the
+   * root, it is given by the three vectors around the new node -- the downstream vector of the regraft node, the upstream 
+   * vector above it (of the topology without the pruned subtree) and the pruned subtree's vector. Upstream vectors are
+   * planned once for all candidates with the same prune node, and each candidate then needs only one partial likelihood */
+  int i, j, k, n_sub, n_blk = (phy->npat + LikPatternBlock - 1) / LikPatternBlock, *start, *order, *sub_cand, *sub_regraft;
+  double *cand_lnLk, *pat_lnLk;
+  topol_node p, r;
+  spr_plan plan;
+
+  for (i = 0; i < n; i++) {
+    p = tre->nodelist[prune[i]];
+    r = tre->nodelist[regraft[i]];
+    if ((r == p) || (r->up == p) || ((p != tre->root) && ((r == p->up) || (r == p->sister)))) 
+      biomcmc_error ("invalid SPR candidate (prune %d, regraft %d): regraft can't be prune node or its neighbour", p->id, r->id);
+  }
+  if (!n) return;
+  if (phy->checkpoint || phy->single_precision) biomcmc_error ("SPR candidates are not available in memory-bounded or single precision modes");
+  if (phy->pmat) { /* matrices depend on (and move with) the nodes, thus we apply the move */
+    ln_likelihood_spr_candidates_one_by_one (phy, tre, prune, regraft, n, lnLk);
+    return;
+  }
+  if (!tre->traversal_updated) update_topology_traversal (tre);
+
+  /* candidates sorted by prune node (counting sort) */
+  start = (int*) biomcmc_malloc ((tre->nnodes + 1) * sizeof (int));
+  order = (int*) biomcmc_malloc (3 * n * sizeof (int));
+  sub_cand = order + n;
+  sub_regraft = order + 2 * n;
+  for (i = 0; i <= tre->nnodes; i++) start[i] = 0;
+  for (i = 0; i < n; i++) start[prune[i] + 1]++;
+  for (i = 0; i < tre->nnodes; i++) start[i+1] += start[i];
+  for (i = 0; i < n; i++) order[start[prune[i]]++] = i;
+  for (i = tre->nnodes; i > 0; i--) start[i] = start[i-1]; /* start[] was shifted by one node */
+  start[0] = 0;
+
+  plan.phy = phy;
+  plan.tre = tre;
+  plan.up       = (int*) biomcmc_malloc (4 * tre->nnodes * sizeof (int));
+  plan.left     = plan.up + tre->nnodes;
+  plan.right    = plan.up + 2 * tre->nnodes;
+  plan.stamp    = plan.up + 3 * tre->nnodes;
+  plan.down     = (lk_operand*) biomcmc_malloc (2 * tre->nnodes * sizeof (lk_operand));
+  plan.upstream = plan.down + tre->nnodes;
+  for (i = 0; i < tre->nnodes; i++) plan.stamp[i] = -1;
+  plan.group = 0;
+  plan.n_op = 0;
+  plan.n_op_alloc = n + 2 * tre->nnodes;
+  plan.op = (spr_candidate_op*) biomcmc_malloc (plan.n_op_alloc * sizeof (spr_candidate_op));
+
+  for (i = 0; i < tre->nnodes; i++) if (start[i] < start[i+1]) {
+    for (k = 0; k < 2; k++) { /* candidates with regraft outside (k = 0) and inside (k = 1) prune subtree */
+      for (n_sub = 0, j = start[i]; j < start[i+1]; j++) 
+        if (node1_is_child_of_node2 (tre->nodelist[regraft[order[j]]], tre->nodelist[i]) == (k == 1)) {
+          sub_cand[n_sub] = order[j];
+          sub_regraft[n_sub++] = regraft[order[j]];
+        }
+      if (n_sub) spr_plan_prune_group (&plan, i, sub_regraft, sub_cand, n_sub, (k == 1));
+    }
+  }
 
+  /* same work division as ln_likelihood_over_pattern_slices(): each thread runs the whole plan over its own patterns */
+  cand_lnLk = (double*) biomcmc_malloc (n * n_blk * sizeof (double));
+  pat_lnLk  = (double*) biomcmc_malloc (phy->npat * sizeof (double));
 #ifdef _OPENMP
-#pragma omp parallel for  shared(phy,tre) \
-  private(pat,cat,i,s1,s2,lkl,lkr,left,right,LikSite,lkMax,scale) reduction (+:sum_of_lnLk)
+#pragma omp parallel num_threads(phy->n_threads) proc_bind(close) if(phy->n_threads > 1) shared(phy,plan,cand_lnLk,pat_lnLk,n_blk)
 #endif
-  for (pat = 0; pat < phy->npat; pat++) {
-    for (cat = 0; cat < phy->model->nrates; cat++) {
-      for (i = 0; i < tre->n_undone - 1; i++) { /* only nodes nodes that changed minus the root (n_undone -1)  */
-        scale = !(tre->undone[i]->level % LikScaleFrequency); /* crude choice (the best would be distance from leaves) */ 
-
-        left  = phy->l[ tre->undone[i]->left->id  ]->d_proposal->lk[cat][pat];
-        right = phy->l[ tre->undone[i]->right->id ]->d_proposal->lk[cat][pat];
-
-        phy->l[ tre->undone[i]->id        ]->d_proposal->lnmax[cat][pat] = 
-        phy->l[ tre->undone[i]->left->id  ]->d_proposal->lnmax[cat][pat] +
-        phy->l[ tre->undone[i]->right->id ]->d_proposal->lnmax[cat][pat];
-
-        /* reescale only a few times since it is computationally expensive. Note that 
-         * left->split->n_ones >= right->split->n_ones always (by design of update_topology_traversal() ) */
-        if (scale) { /* reescaling is necessary */ 
-          lkMax = 0.; /* maximum partial likelihood for this node/category/pattern */
-          for (s1 = 0; s1 < 4; s1++) {
-            lkl = lkr = 0.0;
-            for (s2 = 0; s2 < 4; s2++) {
-              lkl += phy->model->Q[cat][s1][s2] * left[s2];
-              lkr += phy->model->Q[cat][s1][s2] * right[s2];
-            }
-            LikSite = phy->l[tre->undone[i]->id]->d_proposal->lk[cat][pat][s1] = lkr * lkl;
-            if (LikSite > lkMax) lkMax = LikSite;
-          }
-
-          if (lkMax <= 0.) biomcmc_error ("underflow: all partial likelihoods are <= 0.");
-          phy->l[tre->undone[i]->id]->d_proposal->lnmax[cat][pat] += log (lkMax);
-          for (s1 = 0; s1 < 4; s1++)
-            phy->l[tre->undone[i]->id]->d_proposal->lk[cat][pat][s1] /= lkMax;
-        } 
-
-        else { /* do not reescale: economize four comparisons (search for maximum) */
-          for (s1 = 0; s1 < 4; s1++) {
-            lkl = lkr = 0.0;
-            for (s2 = 0; s2 < 4; s2++) {
-              lkl += phy->model->Q[cat][s1][s2] * left[s2];
-              lkr += phy->model->Q[cat][s1][s2] * right[s2];
-            }
-            phy->l[tre->undone[i]->id]->d_proposal->lk[cat][pat][s1] = lkr * lkl;
-          }
-        }
-      } // for (i < tre->n_undone) 
+  {
+    int b, o, first, last, slice = 0, stride = 1;
+    spr_candidate_op *op;
+#ifdef _OPENMP
+    slice  = omp_get_thread_num ();
+    stride = omp_get_num_threads ();
+#endif
+    for (; slice < phy->n_threads; slice += stride) for (b = phy->slice[slice]; b < phy->slice[slice + 1]; b++) {
+      first = b * LikPatternBlock;
+      last = BIOMCMC_MIN ((b + 1) * LikPatternBlock, phy->npat);
+      for (o = 0; o < plan.n_op; o++) {
+        op = plan.op + o;
+        if (op->res) lk_vector_from_operands (phy, op->res, &op->left, &op->right, first, last);
+        if (op->cand < 0) continue;
+        if (op->res) cand_lnLk[op->cand * n_blk + b] = ln_likelihood_at_root (phy, phy->model->Qv, op->res, op->regraft, pat_lnLk, first, last);
+        else cand_lnLk[op->cand * n_blk + b] = ln_likelihood_at_root (phy, phy->model->Qv, op->left.v, op->right.v, pat_lnLk, first, last);
+      }
+    }
+  }
+  for (i = 0; i < n; i++) { /* fixed order, as in ln_likelihood_over_pattern_slices() */
+    for (lnLk[i] = 0., j = 0; j < n_blk; j++) lnLk[i] += cand_lnLk[i * n_blk + j];
+    lnLk[i] -= ((double) (phy->nsites) * log ((double) phy->model->nrates));
+  }
+
+  free (pat_lnLk);
+  free (cand_lnLk);
+  free (plan.op);
+  free (plan.down);
+  free (plan.up);
+  free (order);
+  free (start);
+}
+
+void
+spr_plan_prune_group (spr_plan *plan, int prune, int *regraft, int *cand, int n, bool lca)
+{
+  int i, v;
+  topology tre = plan->tre;
+  topol_node p = tre->nodelist[prune];
+  lk_operand pruned, *up;
+  lk_vector tmp;
+  spr_candidate_op *op;
+
+  spr_plan_reset_topology (plan);
+  if (lca && (p == tre->root)) { /* regraft inside root's subtree: it's only a reroot */
+    for (i = 0; i < n; i++) 
+      spr_plan_add_op (plan, NULL, plan->down + tre->root->left->id, plan->down + tre->root->right->id, cand[i]);
+    return;
+  }
+
+  if (lca) { /* the rest of the tree (upstream of prune node) is moved into the prune subtree, where prune is the root */
+    pruned = *spr_plan_upstream (plan, prune);
+    plan->root = prune;
+    tmp = plan->phy->l[prune]->u[1]; /* prune node is not in pruned topology, thus its vectors are free */
+  }
+  else { /* prune node's parent is removed, and its sister takes its place */
+    pruned = plan->down[prune];
+    v = p->up->id;
+    tmp = plan->phy->l[v]->u[0];
+    if (p->up == tre->root) plan->root = p->sister->id;
+    else {
+      plan->up[p->sister->id] = plan->up[v];
+      if (plan->left[plan->up[v]] == v) plan->left[plan->up[v]]  = p->sister->id;
+      else                              plan->right[plan->up[v]] = p->sister->id;
+      for (v = plan->up[v]; v != plan->root; v = plan->up[v]) { /* downstream vectors of ancestors lose pruned subtree */
+        spr_plan_add_op (plan, plan->phy->l[v]->u[1], plan->down + plan->left[v], plan->down + plan->right[v], -1);
+        plan->down[v] = lk_operand_of_node (plan->phy, tre->nodelist[v], plan->phy->l[v]->u[1]);
+      }
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    v = regraft[i];
+    if (v == plan->root) v = plan->left[v]; /* new root: root's children are connected by one branch */
+    up = spr_plan_upstream (plan, v);
+    op = spr_plan_add_op (plan, tmp, plan->down + v, up, cand[i]);
+    op->regraft = pruned.v;
+  }
+}
+
+void
+spr_plan_reset_topology (spr_plan *plan)
+{
+  int i;
+  topology tre = plan->tre;
+  for (i = 0; i < tre->nnodes; i++) {
+    plan->up[i]    = (tre->nodelist[i]->up ? tre->nodelist[i]->up->id : -1);
+    plan->left[i]  = (tre->nodelist[i]->internal ? tre->nodelist[i]->left->id  : -1);
+    plan->right[i] = (tre->nodelist[i]->internal ? tre->nodelist[i]->right->id : -1);
+    plan->down[i]  = lk_operand_of_node (plan->phy, tre->nodelist[i], plan->phy->l[i]->d_current);
+  }
+  plan->root = tre->root->id;
+  plan->group++; /* invalidates all upstream vectors */
+}
 
-      /* root node is superfluous: the site likelihood is calculated between root->left and root->right.
-       * By design the heavier node (more nodes) is on the left */
-      LikSite = 0.;
-      
-      left  = phy->l[ tre->root->left->id  ]->d_proposal->lk[cat][pat];
-      right = phy->l[ tre->root->right->id ]->d_proposal->lk[cat][pat];
+lk_operand*
+spr_plan_upstream (spr_plan *plan, int v)
+{
+  int w = plan->up[v], sister = (plan->left[w] == v) ? plan->right[w] : plan->left[w];
+  lk_operand *above;
 
-      lkMax = (phy->l[ tre->root->left->id  ]->d_proposal->lnmax[cat][pat] + 
-               phy->l[ tre->root->right->id ]->d_proposal->lnmax[cat][pat]);
+  if (plan->stamp[v] == plan->group) return plan->upstream + v;
+  plan->stamp[v] = plan->group;
+  if (w == plan->root) { /* root is superfluous: upstream of root's child is its sister */
+    plan->upstream[v] = plan->down[sister];
+    return plan->upstream + v;
+  }
+  above = spr_plan_upstream (plan, w);
+  spr_plan_add_op (plan, plan->phy->l[v]->u[0], above, plan->down + sister, -1);
+  plan->upstream[v] = lk_operand_of_node (plan->phy, plan->tre->nodelist[v], plan->phy->l[v]->u[0]);
+  plan->upstream[v].classes = plan->phy->l[v]->u[0]->rep; /* not a leaf vector, even at leaves */
+  plan->upstream[v].tip = NULL;
+  return plan->upstream + v;
+}
+
+spr_candidate_op*
+spr_plan_add_op (spr_plan *plan, lk_vector res, lk_operand *left, lk_operand *right, int cand)
+{
+  spr_candidate_op *op;
+  if (plan->n_op == plan->n_op_alloc) {
+    plan->n_op_alloc *= 2;
+    plan->op = (spr_candidate_op*) biomcmc_realloc ((spr_candidate_op*) plan->op, plan->n_op_alloc * sizeof (spr_candidate_op));
+  }
+  op = plan->op + plan->n_op++;
+  op->res = res;
+  op->regraft = NULL;
+  op->left = *left;
+  op->right = *right;
+  op->cand = cand;
+  return op;
+}
 
-      for (s1 = 0; s1 < 4; s1++) for (s2 = 0; s2 < 4; s2++)
-        LikSite += phy->model->pi[s1] * left[s1] * phy->model->Q[cat][s1][s2] * right[s2];
+void
+ln_likelihood_spr_candidates_one_by_one (phylogeny phy, topology tre, int *prune, int *regraft, int n, double *lnLk)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    apply_spr_at_nodes (tre, tre->nodelist[prune[i]], tre->nodelist[regraft[i]], false);
+    update_topology_traversal (tre);
+    ln_likelihood_real (phy, tre); /* only proposal vectors are overwritten */
+    lnLk[i] = phy->lk_proposal;
+    topology_undo_random_move (tre, false);
+    update_topology_traversal (tre);
+  }
+}
 
-      if (!cat) phy->pat_lnLk[pat] = log (LikSite) + lkMax; /* logspace_add(A,B) = log(exp(A)+exp(B)) below */
-      else      phy->pat_lnLk[pat] = biomcmc_logspace_add (phy->pat_lnLk[pat], log (LikSite) + lkMax);
-    } // for (category)
+void
+calculate_ln_likelihood_proposal (phylogeny phy, topology tre)
+{ 
+  double sum_of_lnLk;
 
-    sum_of_lnLk += phy->pat_lnLk[pat] * phy->weight[pat];
-  } // for (pattern) 
+  if (phy->pmat) update_branch_pmatrix_from_topology (phy, tre);
 
+  sum_of_lnLk = ln_likelihood_over_pattern_slices (phy, tre, &ln_likelihood_block_undone_nodes);
   /* log (phy->model->nrates) is irreleveant in MCMC since it is a constant. It's here for completeness */
   phy->lk_proposal = sum_of_lnLk - ((double) (phy->nsites) * log ((double) phy->model->nrates));
 }
+
+double
+ln_likelihood_block_undone_nodes (phylogeny phy, topology tre, int first, int last)
+{
+  int i;
+  topol_node node;
+  for (i = 0; i < tre->n_undone - 1; i++) { /* only nodes nodes that changed minus the root (n_undone -1)  */
+    node = tre->undone[i];
+    lk_vector_from_children (phy, node, phy->l[node->id]->d_proposal, phy->l[node->left->id]->d_proposal, 
+                             phy->l[node->right->id]->d_proposal, first, last);
+  }
+  /* root node is superfluous: the site likelihood is calculated between root->left and root->right.
+   * By design the heavier node (more nodes) is on the left */
+  return ln_likelihood_at_root (phy, root_pmatrix (phy, tre->root), phy->l[tre->root->left->id]->d_proposal, 
+                                phy->l[tre->root->right->id]->d_proposal, phy->pat_lnLk, first, last);
+}
+
+void
+ln_likelihood_partitions (partitioned_phylogeny pp, topology tre)
+{
+  ln_likelihood_over_partitions (pp, tre, ln_likelihood);
+}
+
+void
+ln_likelihood_moved_branches_partitions (partitioned_phylogeny pp, topology tre)
+{
+  ln_likelihood_over_partitions (pp, tre, ln_likelihood_moved_branches);
+}
+
+void
+ln_likelihood_over_partitions (partitioned_phylogeny pp, topology tre, void (*lnLk) (phylogeny, topology))
+{
+  int i;
+  if (!tre->traversal_updated) update_topology_traversal (tre); /* topology is shared by all threads */
+  for (i = 0; i < pp->n_part; i++) if (pp->owner[i] < 0) lnLk (pp->part[i], tre);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(pp->n_threads) if(pp->n_threads > 1) shared(pp,tre,lnLk) private(i)
+#endif
+  {
+    int j, thread = 0, stride = 1;
+#ifdef _OPENMP
+    thread = omp_get_thread_num ();
+    stride = omp_get_num_threads (); /* may be lower than n_threads, in which case a thread works for several */
+#endif
+    for (i = 0; i < pp->n_part; i++) {
+      j = pp->order[i];
+      if ((pp->owner[j] >= 0) && (pp->owner[j] % stride == thread)) lnLk (pp->part[j], tre);
+    }
+  }
+  /* sum in fixed order: result doesn't depend on the number of threads */
+  for (pp->lk_proposal = 0., i = 0; i < pp->n_part; i++) pp->lk_proposal += pp->part[i]->lk_proposal;
+}
+
+void
+accept_likelihood_partitions (partitioned_phylogeny pp, topology tre)
+{
+  int i;
+  for (i = 0; i < pp->n_part; i++) accept_likelihood (pp->part[i], tre);
+  pp->lk_current = pp->lk_proposal;
+}
+
+void
+accept_likelihood_moved_branches_partitions (partitioned_phylogeny pp, topology tre)
+{ /* each partition updates the same nodes (from topology_struct::undone, not from their flags) */
+  int i;
+  for (i = 0; i < pp->n_part; i++) accept_likelihood_moved_branches (pp->part[i], tre);
+  pp->lk_current = pp->lk_proposal;
+}
+
+size_t
+phylogeny_set_memory_budget (phylogeny phy, topology tre, size_t max_bytes, double *recompute_cost)
+{
+  int i, j, lo, hi, n_keep, n_internal = tre->nleaves - 2, *n_below; /* root vectors are never used */
+  size_t leaf_bytes, stored_bytes, block_bytes, total;
+  bool *keep;
+  double cost = 0., depth = 0., *path_cost, *path_depth;
+  topol_node v;
+
+  if (!tre->traversal_updated) update_topology_traversal (tre);
+  leaf_bytes   = 2 * phy->ntax * lk_vector_bytes (phy, phy->npat, false);
+  stored_bytes = 2 * phy->n_cycle * lk_vector_bytes (phy, phy->npat, phy->single_precision); /* up and down vectors */
+  block_bytes  = phy->n_threads * lk_vector_bytes (phy, LikPatternBlock, false);
+  if (phy->single_precision) stored_bytes += block_bytes; /* stored vectors are also calculated in a block buffer */
+  /* number of checkpoints s.t. n_keep x stored + (others) x block <= max_bytes */
+  if ((!max_bytes) || (max_bytes >= leaf_bytes + (n_internal + 1) * stored_bytes)) n_keep = n_internal + 1;
+  else if (max_bytes <= leaf_bytes + (n_internal + 1) * block_bytes) n_keep = 0;
+  else n_keep = BIOMCMC_MIN (n_internal, (int) ((max_bytes - leaf_bytes - (n_internal + 1) * block_bytes) / (stored_bytes - block_bytes)));
+
+  keep = (bool*) biomcmc_malloc (phy->nnodes * sizeof (bool));
+  n_below = (int*) biomcmc_malloc (phy->nnodes * sizeof (int));
+  for (i = 0; i < phy->nnodes; i++) { keep[i] = (n_keep > n_internal); n_below[i] = 0; }
+  if (n_keep <= n_internal) { /* smallest threshold (most even spread of checkpoints) with at most n_keep checkpoints */
+    for (lo = 0, hi = tre->nleaves; lo < hi;) {
+      j = (lo + hi) / 2;
+      if (select_checkpoints (tre, j, keep, n_below) > n_keep) lo = j + 1;
+      else hi = j;
+    }
+    select_checkpoints (tre, lo, keep, n_below);
+  }
+
+  if (n_keep > n_internal) { free (keep); keep = NULL; } /* all vectors are stored */
+  phylogeny_set_checkpoints (phy, keep);
+
+  if (recompute_cost) { /* a change at v recalculates v and its ancestors, and what's below them down to checkpoints */
+    path_cost  = (double*) biomcmc_malloc (2 * phy->nnodes * sizeof (double));
+    path_depth = path_cost + phy->nnodes;
+    path_cost[tre->root->id] = path_depth[tre->root->id] = 0.;
+    for (i = tre->nleaves - 3; i >= 0; i--) {
+      v = tre->postorder[i];
+      path_cost[v->id]  = path_cost[v->up->id] + 1. + (double) n_below[v->sister->id];
+      path_depth[v->id] = path_depth[v->up->id] + 1.;
+      cost  += path_cost[v->id] + (double) (n_below[v->left->id] + n_below[v->right->id]);
+      depth += path_depth[v->id];
+    }
+    *recompute_cost = (depth > 0.) ? cost / depth : 1.;
+    free (path_cost);
+  }
+  free (n_below);
+
+  for (total = leaf_bytes, i = phy->ntax; i < phy->nnodes; i++) total += (phy->l[i]->n_cycle ? stored_bytes : block_bytes);
+  return total;
+}
+
+int
+select_checkpoints (topology tre, int threshold, bool *checkpoint, int *n_below)
+{
+  int i, n = 0;
+  topol_node v;
+  for (i = 0; i < tre->nleaves - 2; i++) { /* skip root */
+    v = tre->postorder[i];
+    n_below[v->id] = 1 + n_below[v->left->id] + n_below[v->right->id]; /* zero at leaves */
+    if ((checkpoint[v->id] = (n_below[v->id] > threshold))) { n_below[v->id] = 0; n++; }
+  }
+  checkpoint[tre->root->id] = false;
+  return n;
+}
+
+size_t
+lk_vector_bytes (phylogeny phy, int n_pat, bool single)
+{ /* see new_lk_vector() */
+  size_t lk = (size_t) n_pat * phy->model->nrates * phy->model->n_state * (single ? sizeof (float) : sizeof (double)), scale = (size_t) n_pat * phy->model->nrates * sizeof (int);
+  lk    = ((lk + BIOMCMC_ALIGNMENT - 1) / BIOMCMC_ALIGNMENT) * BIOMCMC_ALIGNMENT;
+  scale = ((scale + BIOMCMC_ALIGNMENT - 1) / BIOMCMC_ALIGNMENT) * BIOMCMC_ALIGNMENT;
+  return lk + scale + n_pat * sizeof (uint8_t) + sizeof (struct lk_vector_struct);
+}
+
+void
+ln_likelihood_checkpoints (phylogeny phy, topology tre, bool all_nodes)
+{
+  int i;
+  bool *calc = phy->recalculate;
+  topol_node v;
+
+  if (phy->pmat) update_branch_pmatrix_from_topology (phy, tre);
+  /* preorder: other nodes are needed (and recalculated) only if their parents are recalculated, or are root's children */
+  for (i = tre->nleaves - 3; i >= 0; i--) {
+    v = tre->postorder[i];
+    if (all_nodes || !v->d_done) calc[v->id] = true;
+    else calc[v->id] = (!phylogeny_node_is_stored (phy, v->id)) && ((v->up == tre->root) || calc[v->up->id]);
+  }
+  for (phy->n_recompute = 0, i = 0; i < tre->nleaves - 2; i++) {
+    v = tre->postorder[i];
+    if (!calc[v->id]) continue;
+    phy->recompute[phy->n_recompute++] = v->id;
+  }
+  /* checkpoints store the proposal at the next vector, as ln_likelihood() and ln_likelihood_moved_branches() */
+  for (i = 0; i < tre->nleaves - 2; i++) if (phylogeny_node_is_stored (phy, (v = tre->postorder[i])->id)) 
+    phy->l[v->id]->d_proposal = (calc[v->id] ? phy->l[v->id]->d_current->next : phy->l[v->id]->d_current);
+
+  phy->lk_proposal = ln_likelihood_over_pattern_slices (phy, tre, &ln_likelihood_block_checkpoints);
+  phy->lk_proposal -= ((double) (phy->nsites) * log ((double) phy->model->nrates));
+}
+
+double
+ln_likelihood_block_checkpoints (phylogeny phy, topology tre, int first, int last)
+{ /* block buffers hold only this block, thus all vectors are seen from pattern first on (patterns 0...n are relative) */
+  int i, thread = 0, n = last - first;
+  topol_node node;
+  lk_vector res;
+#ifdef _OPENMP
+  if (phy->n_threads > 1) thread = omp_get_thread_num (); /* single-threaded phylogeny may be inside another parallel region */
+#endif
+  for (i = 0; i < phy->n_recompute; i++) {
+    node = tre->nodelist[phy->recompute[i]];
+    res = lk_vector_at_block (phy, node, thread, first, last);
+    lk_vector_from_children_offset (phy, node, res, lk_vector_at_block (phy, node->left, thread, first, last), 
+                                    lk_vector_at_block (phy, node->right, thread, first, last), first, 0, n);
+    if (phy->single_precision && phylogeny_node_is_stored (phy, node->id)) lk_vector_store_block (phy, node, res, first, last);
+  }
+  return ln_likelihood_at_root_offset (phy, root_pmatrix (phy, tre->root), lk_vector_at_block (phy, tre->root->left, thread, first, last), 
+                                       lk_vector_at_block (phy, tre->root->right, thread, first, last), phy->pat_lnLk, first, 0, n);
+}
+
+lk_vector
+lk_vector_at_block (phylogeny phy, topol_node node, int thread, int first, int last)
+{ /* pointers are only moved forward (into stored vectors), since block buffers already start at pattern first */
+  int i = thread * phy->nnodes + node->id;
+  size_t j, size = phy->model->nrates * phy->model->n_state, start = (size_t) first * size, n = (size_t) (last - first) * size;
+  lk_vector view = phy->block_view + i, stored;
+  if (node->internal && !phylogeny_node_is_stored (phy, node->id)) return phy->block_buffer[i];
+  stored = (node->internal ? phy->l[node->id]->d_proposal : phy->l[node->id]->d_current);
+  view->scale = stored->scale + (size_t) first * phy->model->nrates;
+  view->rep   = stored->rep + first;
+  if (!node->internal || !phy->single_precision) { 
+    view->lk = stored->lk + start; 
+    return view; 
+  }
+  /* single precision: only the values are in the buffer, scale and repeats are stored as usual */
+  view->lk = phy->block_buffer[i]->lk;
+  /* a node recalculated in this evaluation is already in the buffer (calculated earlier in postorder for this block) */
+  if (stored == phy->l[node->id]->d_current) for (j = 0; j < n; j++) view->lk[j] = (double) stored->lk32[start + j];
+  return view;
+}
+
+void
+lk_vector_store_block (phylogeny phy, topol_node node, lk_vector view, int first, int last)
+{ /* buffer is rounded s.t. the values used by the parent are the same as when later read from storage */
+  size_t j, size = phy->model->nrates * phy->model->n_state, n = (size_t) (last - first) * size;
+  float *x = phy->l[node->id]->d_proposal->lk32 + (size_t) first * size;
+  for (j = 0; j < n; j++) view->lk[j] = (double) (x[j] = (float) view->lk[j]);
+}
+
+double
+ln_likelihood_optimise_branch_length (phylogeny phy, topology tre, topol_node node)
+{
+  int n_path = 0;
+  topol_node *path;
+  blength_opt opt;
+
+  blength_opt_init (&opt, phy, tre);
+  path = (topol_node*) biomcmc_malloc (tre->nnodes * sizeof (topol_node));
+  if (node != tre->root) for (path[n_path++] = node; path[n_path-1]->up != tre->root; n_path++) path[n_path] = path[n_path-1]->up;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(phy->n_threads) proc_bind(close) if(phy->n_threads > 1) shared(opt,phy,tre,path,n_path,node)
+#endif
+  {
+    int j, slice = 0, stride = 1;
+    lk_operand above, sister;
+#ifdef _OPENMP
+    slice  = omp_get_thread_num ();
+    stride = omp_get_num_threads ();
+#endif
+    if (n_path < 2) blength_optimise_branch (&opt, tre->root, phy->l[tre->root->left->id]->d_current, 
+                                             phy->l[tre->root->right->id]->d_current, slice, stride);
+    else {
+      /* upstream vectors from root down to node (path[] is in reverse order, path[n_path-1] is root's child) */
+      above = blength_operand_of_upstream (&opt, path[n_path-1], phy->l[path[n_path-1]->sister->id]->d_current, 
+                                           (path[n_path-1]->sister->internal ? NULL : phy->leaf_rep[path[n_path-1]->sister->id]));
+      for (j = n_path - 2; j >= 0; j--) {
+        sister = blength_operand_of_node (&opt, path[j]->sister);
+        blength_vector_from_operands (&opt, phy->l[path[j]->id]->u_current, &above, &sister, slice, stride);
+        above = blength_operand_of_upstream (&opt, path[j], phy->l[path[j]->id]->u_current, NULL);
+      }
+      blength_optimise_branch (&opt, node, phy->l[node->id]->u_current, phy->l[node->id]->d_current, slice, stride);
+      /* downstream vectors of ancestors, which depend on the new branch length */
+      for (j = 1; j < n_path; j++) {
+        above  = blength_operand_of_node (&opt, path[j]->left);
+        sister = blength_operand_of_node (&opt, path[j]->right);
+        blength_vector_from_operands (&opt, phy->l[path[j]->id]->d_current, &above, &sister, slice, stride);
+      }
+    }
+    blength_ln_likelihood (&opt, slice, stride);
+  }
+  free (path);
+  free (opt.S);
+  free (opt.lnmax);
+  free (opt.block_sum);
+  return phy->lk_current;
+}
+
+double
+ln_likelihood_optimise_branch_lengths (phylogeny phy, topology tre, int n_sweeps, double tolerance)
+{
+  blength_opt opt;
+
+  blength_opt_init (&opt, phy, tre);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(phy->n_threads) proc_bind(close) if(phy->n_threads > 1) shared(opt,phy,tre,n_sweeps,tolerance)
+#endif
+  {
+    int sweep, slice = 0, stride = 1;
+    double lnL, previous = -DBL_MAX;
+    topol_node left = tre->root->left, right = tre->root->right;
+    lk_operand above;
+#ifdef _OPENMP
+    slice  = omp_get_thread_num ();
+    stride = omp_get_num_threads ();
+#endif
+    for (sweep = 0; sweep < n_sweeps; sweep++) { /* all threads follow the same path, since they see the same sums */
+      blength_optimise_branch (&opt, tre->root, phy->l[left->id]->d_current, phy->l[right->id]->d_current, slice, stride);
+      above = blength_operand_of_upstream (&opt, left, phy->l[right->id]->d_current, (right->internal ? NULL : phy->leaf_rep[right->id]));
+      blength_optimise_subtree (&opt, left, &above, false, slice, stride);
+      above = blength_operand_of_upstream (&opt, right, phy->l[left->id]->d_current, (left->internal ? NULL : phy->leaf_rep[left->id]));
+      blength_optimise_subtree (&opt, right, &above, false, slice, stride);
+      lnL = blength_ln_likelihood (&opt, slice, stride);
+      if (lnL - previous < tolerance) break;
+      previous = lnL;
+    }
+  }
+  free (opt.S);
+  free (opt.lnmax);
+  free (opt.block_sum);
+  return phy->lk_current;
+}
+
+void
+blength_opt_init (blength_opt *opt, phylogeny phy, topology tre)
+{
+  int n_blk = (phy->npat + LikPatternBlock - 1) / LikPatternBlock;
+  if (!phy->pmat) biomcmc_error ("branch lengths are integrated out: optimisation needs phylogeny_use_branch_lengths()");
+  if (phy->checkpoint || phy->single_precision) 
+    biomcmc_error ("branch length optimisation is not available in memory-bounded or single precision modes");
+  if (!tre->traversal_updated) update_topology_traversal (tre);
+  update_branch_pmatrix_from_topology (phy, tre);
+  opt->phy = phy;
+  opt->tre = tre;
+  /* first written by the thread owning the patterns, as lk vectors (see phylogeny_first_touch_lk_vectors() ) */
+  opt->S = (double*) biomcmc_malloc_aligned (phy->npat * phy->model->nrates * phy->model->n_state * sizeof (double));
+  opt->lnmax = (double*) biomcmc_malloc_aligned (phy->npat * sizeof (double));
+  opt->block_sum = (double*) biomcmc_malloc (3 * n_blk * sizeof (double));
+}
+
+void
+blength_optimise_subtree (blength_opt *opt, topol_node node, lk_operand *above, bool optimise_branch, int slice, int stride)
+{ /* the upstream vector of a child is at this node, and all its branches except the child's (coordinate ascent) */
+  phylogeny phy = opt->phy;
+  lk_operand child, sister;
+  topol_node c[2];
+  int i;
+
+  if (optimise_branch) blength_optimise_branch (opt, node, above->v, phy->l[node->id]->d_current, slice, stride);
+  if (!node->internal) return;
+
+  c[0] = node->left; c[1] = node->right;
+  for (i = 0; i < 2; i++) {
+    sister = blength_operand_of_node (opt, c[1-i]); /* downstream of left is already updated when right is visited */
+    blength_vector_from_operands (opt, phy->l[c[i]->id]->u_current, above, &sister, slice, stride);
+    child = blength_operand_of_upstream (opt, c[i], phy->l[c[i]->id]->u_current, NULL);
+    blength_optimise_subtree (opt, c[i], &child, true, slice, stride);
+  }
+  /* downstream vector of node, with new branch lengths below it, overwrites current one */
+  child  = blength_operand_of_node (opt, c[0]);
+  sister = blength_operand_of_node (opt, c[1]);
+  blength_vector_from_operands (opt, phy->l[node->id]->d_current, &child, &sister, slice, stride);
+}
+
+void
+blength_optimise_branch (blength_opt *opt, topol_node node, lk_vector up, lk_vector down, int slice, int stride)
+{
+  int b;
+  double t;
+  topology tre = opt->tre;
+
+  for_each_block_of_thread (opt->phy, slice, stride, b) 
+    blength_sumtable_block (opt, up, down, b * LikPatternBlock, BIOMCMC_MIN ((b + 1) * LikPatternBlock, opt->phy->npat));
+  /* no barrier: each thread reads only its own blocks of the sum table */
+  if ((node == tre->root) || (node->up == tre->root)) t = tre->blength[tre->root->left->id] + tre->blength[tre->root->right->id];
+  else t = tre->blength[node->id];
+  t = blength_newton_raphson (opt, t, slice, stride);
+#ifdef _OPENMP
+#pragma omp single
+#endif
+  set_branch_length (opt->phy, tre, node, t); /* implicit barrier: all threads see the new matrix */
+}
+
+double
+blength_newton_raphson (blength_opt *opt, double t, int slice, int stride)
+{ /* safeguards: stays within bracket of the maximum (given by sign of first derivative) and within bounds, bisecting 
+     (in log scale) when Newton's step falls outside; if not concave, moves uphill by a factor of two */
+  int iter;
+  bool converged = false;
+  double lo = LikBranchLengthMin, hi = LikBranchLengthMax, f, d1, d2, t_new, best_t, best_f = -DBL_MAX;
+
+  t = BIOMCMC_MIN (BIOMCMC_MAX (t, lo), hi);
+  best_t = t;
+  for (iter = 0; (iter < 100) && (!converged); iter++) {
+    f = blength_derivatives (opt, t, &d1, &d2, slice, stride);
+    if (f > best_f) { best_f = f; best_t = t; }
+    if (d1 > 0.) lo = t;
+    else hi = t;
+    if ((hi - lo) < 1e-8 * (1. + t)) break;
+    if (d2 < 0.) t_new = t - d1 / d2;
+    else t_new = (d1 > 0.) ? 2. * t : 0.5 * t;
+    if ((t_new <= lo) || (t_new >= hi)) t_new = sqrt (lo * hi);
+    converged = (fabs (t_new - t) < 1e-8 * (1. + t)) || (fabs (d1) < 1e-8);
+    t = t_new;
+  }
+  return best_t;
+}
+
+double
+blength_derivatives (blength_opt *opt, double t, double *d1, double *d2, int slice, int stride)
+{
+  int b, cat, k, n_state = opt->phy->model->n_state, n_cat = opt->phy->model->nrates, n_blk = (opt->phy->npat + LikPatternBlock - 1) / LikPatternBlock;
+  double f = 0., x, expo[3 * n_cat * n_state];
+  evolution_model m = opt->phy->model;
+
+  for (cat = 0; cat < n_cat; cat++) for (k = 0; k < n_state; k++) { /* P(t) = sum_k z1[k] z2[k] exp(-psi[k] rate t) */
+    x = - m->psi[k] * m->rate[cat];
+    expo[3 * (cat * n_state + k)]     = exp (x * t);
+    expo[3 * (cat * n_state + k) + 1] = x * expo[3 * (cat * n_state + k)];
+    expo[3 * (cat * n_state + k) + 2] = x * x * expo[3 * (cat * n_state + k)];
+  }
+  for_each_block_of_thread (opt->phy, slice, stride, b) 
+    blength_derivatives_block (opt, expo, b * LikPatternBlock, BIOMCMC_MIN ((b + 1) * LikPatternBlock, opt->phy->npat), opt->block_sum + 3 * b);
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+  for (*d1 = *d2 = 0., b = 0; b < n_blk; b++) { /* fixed order, thus same in all threads */
+    f   += opt->block_sum[3 * b];
+    *d1 += opt->block_sum[3 * b + 1];
+    *d2 += opt->block_sum[3 * b + 2];
+  }
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+  return f;
+}
+
+void
+blength_sumtable_block (blength_opt *opt, lk_vector up, lk_vector down, int first, int last)
+{ /* L(t) = sum_{s1,s2} pi[s1] up[s1] P[s1][s2](t) down[s2] = sum_k (sum_s1 pi[s1] up[s1] z2[k][s1]) (sum_s2 z1[k][s2] down[s2]) exp(-psi[k] rate t) */
+  int pat, cat, k, s, uidx, didx, n_state = opt->phy->model->n_state, n_cat = opt->phy->model->nrates;
+  int scale[n_cat], max_scale;
+  double a, b, *u, *d, *S;
+  evolution_model m = opt->phy->model;
+
+  for (pat = first; pat < last; pat++) {
+    for (cat = 0; cat < n_cat; cat++) {
+      uidx = (first + up->rep[pat])   * n_cat + cat;
+      didx = (first + down->rep[pat]) * n_cat + cat;
+      u = up->lk   + uidx * n_state;
+      d = down->lk + didx * n_state;
+      S = opt->S + (pat * n_cat + cat) * n_state;
+      scale[cat] = up->scale[uidx] + down->scale[didx];
+      for (k = 0; k < n_state; k++) {
+        for (a = 0., s = 0; s < n_state; s++) a += m->pi[s] * u[s] * m->z2[k][s];
+        for (b = 0., s = 0; s < n_state; s++) b += m->z1[k][s] * d[s];
+        S[k] = a * b;
+      }
+    }
+    /* categories may have different scaling factors: one common factor per pattern */
+    for (max_scale = scale[0], cat = 1; cat < n_cat; cat++) if (scale[cat] > max_scale) max_scale = scale[cat];
+    for (cat = 0; cat < n_cat; cat++) if (scale[cat] < max_scale) 
+      for (k = 0; k < n_state; k++) opt->S[(pat * n_cat + cat) * n_state + k] = ldexp (opt->S[(pat * n_cat + cat) * n_state + k], scale[cat] - max_scale);
+    opt->lnmax[pat] = (double) max_scale * M_LN2;
+  }
+}
+
+void
+blength_derivatives_block (blength_opt *opt, double *expo, int first, int last, double *sum)
+{
+  int pat, i, n = opt->phy->model->n_state * opt->phy->model->nrates;
+  double L, dL, d2L, *S;
+
+  sum[0] = sum[1] = sum[2] = 0.;
+  for (pat = first; pat < last; pat++) {
+    S = opt->S + pat * n;
+    for (L = dL = d2L = 0., i = 0; i < n; i++) {
+      L   += S[i] * expo[3 * i];
+      dL  += S[i] * expo[3 * i + 1];
+      d2L += S[i] * expo[3 * i + 2];
+    }
+    dL /= L;
+    d2L /= L;
+    sum[0] += (log (L) + opt->lnmax[pat]) * opt->phy->weight[pat];
+    sum[1] += dL * opt->phy->weight[pat];
+    sum[2] += (d2L - dL * dL) * opt->phy->weight[pat];
+  }
+}
+
+void
+blength_vector_from_operands (blength_opt *opt, lk_vector res, lk_operand *left, lk_operand *right, int slice, int stride)
+{
+  int b;
+  for_each_block_of_thread (opt->phy, slice, stride, b)
+    lk_vector_from_operands (opt->phy, res, left, right, b * LikPatternBlock, BIOMCMC_MIN ((b + 1) * LikPatternBlock, opt->phy->npat));
+}
+
+lk_operand
+blength_operand_of_node (blength_opt *opt, topol_node node)
+{
+  lk_operand op = lk_operand_of_node (opt->phy, node, opt->phy->l[node->id]->d_current);
+  op.Q = opt->phy->pmat->P[node->id];
+  if (!node->internal) op.T = opt->phy->pmat->Ptip[node->id];
+  return op;
+}
+
+lk_operand
+blength_operand_of_upstream (blength_opt *opt, topol_node node, lk_vector up, uint8_t *classes)
+{ /* root's children are connected by the root's matrix; up may be the downstream vector of a leaf (without tip codes) */
+  lk_operand op;
+  op.v = up;
+  op.classes = (classes ? classes : up->rep);
+  op.tip = NULL;
+  op.Q = opt->phy->pmat->P[(node->up == opt->tre->root) ? opt->tre->root->id : node->id];
+  op.T = NULL;
+  return op;
+}
+
+double
+blength_ln_likelihood (blength_opt *opt, int slice, int stride)
+{
+  int b, n_blk = (opt->phy->npat + LikPatternBlock - 1) / LikPatternBlock;
+  double lnL = 0.;
+  phylogeny phy = opt->phy;
+  topology tre = opt->tre;
+
+  for_each_block_of_thread (phy, slice, stride, b)
+    phy->block_lnLk[b] = ln_likelihood_at_root (phy, phy->pmat->P[tre->root->id], phy->l[tre->root->left->id]->d_current, 
+                                                phy->l[tre->root->right->id]->d_current, phy->pat_lnLk, 
+                                                b * LikPatternBlock, BIOMCMC_MIN ((b + 1) * LikPatternBlock, phy->npat));
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+  for (b = 0; b < n_blk; b++) lnL += phy->block_lnLk[b];
+  lnL -= ((double) (phy->nsites) * log ((double) phy->model->nrates));
+#ifdef _OPENMP
+#pragma omp single
+#endif
+  phy->lk_current = phy->lk_proposal = lnL; /* implicit barrier: block_lnLk[] can be overwritten afterwards */
+  return lnL;
+}
+
+void
+set_branch_length (phylogeny phy, topology tre, topol_node node, double t)
+{
+  double t_root;
+  if ((node == tre->root) || (node->up == tre->root)) { /* only the sum of root's children branch lengths matters */
+    t_root = tre->blength[tre->root->left->id] + tre->blength[tre->root->right->id];
+    if (t_root > 0.) {
+      tre->blength[tre->root->left->id]  *= t / t_root;
+      tre->blength[tre->root->right->id] *= t / t_root;
+    }
+    else tre->blength[tre->root->left->id] = tre->blength[tre->root->right->id] = t / 2.;
+  }
+  else tre->blength[node->id] = t;
+  update_branch_pmatrix_from_topology (phy, tre); /* only this branch's matrix is recalculated */
+}
+
+void
+update_branch_pmatrix_from_topology (phylogeny phy, topology tre)
+{
+  int i;
+  double t;
+  branch_pmatrix pm = phy->pmat;
+
+  if (!pm) return;
+  if (!tre->blength) biomcmc_error ("phylogeny uses branch lengths, but topology doesn't have them");
+  for (i = 0; i < tre->nnodes; i++) {
+    if (tre->nodelist[i]->up == tre->root) continue; /* root's children are connected through root's matrix */
+    if (tre->nodelist[i] == tre->root) t = tre->blength[tre->root->left->id] + tre->blength[tre->root->right->id];
+    else t = tre->blength[i];
+    if ((t == pm->t[i]) && (pm->version[i] == phy->model->version)) continue; /* cached matrix is still valid */ 
+    update_pmatrix_from_branch_length (phy->model, t, pm->P[i], (i < pm->ntax) ? pm->Ptip[i] : NULL, pm->expo);
+    pm->t[i] = t;
+    pm->version[i] = phy->model->version;
+  }
+}
+
+void
+lk_vector_from_children (phylogeny phy, topol_node node, lk_vector res, lk_vector left, lk_vector right, int first, int last)
+{
+  lk_vector_from_children_offset (phy, node, res, left, right, 0, first, last);
+}
+
+void
+lk_vector_from_children_offset (phylogeny phy, topol_node node, lk_vector res, lk_vector left, lk_vector right, int offset, int first, int last)
+{ /* vectors (also their site repeats) already start at offset, but leaf classes and ambiguity codes are of all patterns */
+  lk_operand l = lk_operand_of_node (phy, node->left, left), r = lk_operand_of_node (phy, node->right, right);
+  if (!node->left->internal)  { l.classes += offset; if (l.tip) l.tip += offset; }
+  if (!node->right->internal) { r.classes += offset; if (r.tip) r.tip += offset; }
+  if (phy->pmat) { /* one transition matrix per branch, instead of same Q (integrated over branch lengths) */
+    l.Q = phy->pmat->P[node->left->id];
+    r.Q = phy->pmat->P[node->right->id];
+    if (!node->left->internal)  l.T = phy->pmat->Ptip[node->left->id];
+    if (!node->right->internal) r.T = phy->pmat->Ptip[node->right->id];
+  }
+  lk_vector_from_operands (phy, res, &l, &r, first, last);
+}
+
+lk_operand
+lk_operand_of_node (phylogeny phy, topol_node node, lk_vector v)
+{
+  lk_operand op;
+  op.v = v;
+  op.classes = (node->internal ? v->rep : phy->leaf_rep[node->id]);
+  op.tip = leaf_tip_codes (phy, node);
+  op.Q = phy->model->Qv;
+  op.T = phy->model->Qtip;
+  return op;
+}
+
+void
+lk_vector_from_operands (phylogeny phy, lk_vector res, lk_operand *left, lk_operand *right, int first, int last)
+{
+  int i, n, n_pat = last - first, pat[256], lpat[256], rpat[256];
+  bool contiguous;
+
+  if (phy->site_repeats) n = site_repeats_from_children (res->rep + first, left->classes + first, right->classes + first, n_pat, pat);
+  else for (n = 0; n < n_pat; n++) { res->rep[first + n] = n; pat[n] = n; }
+
+  contiguous = (n == n_pat);
+  for (i = 0; i < n; i++) { /* distinct subtree patterns, and where children store them */
+    lpat[i] = first + left->v->rep[first + pat[i]];
+    rpat[i] = first + right->v->rep[first + pat[i]];
+    pat[i] += first;
+    contiguous = contiguous && (lpat[i] == pat[i]) && (rpat[i] == pat[i]);
+  }
+  if (contiguous) lk_vector_from_operands_range (phy, res, left, right, first, last);
+  else lk_vector_from_operands_indexed (phy, res, left, right, pat, lpat, rpat, n);
+}
+
+int
+site_repeats_from_children (uint8_t *rep, uint8_t *left, uint8_t *right, int n_pat, int *pat)
+{ /* a pattern is new if it's new for any child; otherwise a table indexed by the pair of children's classes tells */
+  int i, n = 0;
+  uint8_t first[n_pat * n_pat]; /* first pattern of each pair of classes */
+
+  for (i = 0; (i < n_pat) && (left[i] == i); i++) pat[i] = rep[i] = i; /* e.g. large subtrees, where all patterns are distinct */
+  if (i == n_pat) return n_pat;
+  memset (first, 0xff, n_pat * n_pat * sizeof (uint8_t));
+  for (i = 0; i < n_pat; i++) {
+    if ((left[i] == i) || (right[i] == i) || (first[left[i] * n_pat + right[i]] == 0xff)) { 
+      first[left[i] * n_pat + right[i]] = rep[i] = (uint8_t) i;
+      pat[n++] = i;
+    }
+    else rep[i] = first[left[i] * n_pat + right[i]];
+  }
+  return n;
+}
+
+void
+scale_partial_likelihood (double *x, int *scale, int n_state, int exponent)
+{ /* scale the partial likelihoods to avoid underflow: unlike Yang's suggestion (JMolEvol.2000.423) we scale
+   * each pattern, while he suggested over all patterns/sites. Each rate category is treated independently. 
+   * Since the factor is a power of two, scaling is exact and the log is taken only once per pattern, at the root. */
+  int s1;
+  double lkMax, threshold = ldexp (1., -exponent), factor = ldexp (1., exponent);
+  for (lkMax = 0., s1 = 0; s1 < n_state; s1++) if (x[s1] > lkMax) lkMax = x[s1];
+  if (lkMax <= 0.) biomcmc_error ("underflow: all partial likelihoods are zero (data incompatible with model?)");
+  for (; lkMax < threshold; lkMax *= factor) {
+    for (s1 = 0; s1 < n_state; s1++) x[s1] *= factor;
+    *scale -= exponent;
+  }
+}
+
+int
+n_partial_likelihoods_below_threshold (double *x, int n_elem, int n_state, int exponent)
+{ /* branchless (thus vectorisable) check at every node, since rescaling itself is rare */
+  int i, s1, n_below = 0;
+  double lkMax, threshold = ldexp (1., -exponent);
+  if (n_state == 4) for (i = 0; i < n_elem; i++, x += 4) {
+    lkMax = (x[0] > x[1]) ? x[0] : x[1];
+    lkMax = (x[2] > lkMax) ? x[2] : lkMax;
+    lkMax = (x[3] > lkMax) ? x[3] : lkMax;
+    n_below += (lkMax < threshold);
+  }
+  else for (i = 0; i < n_elem; i++, x += n_state) {
+    for (lkMax = x[0], s1 = 1; s1 < n_state; s1++) lkMax = (x[s1] > lkMax) ? x[s1] : lkMax;
+    n_below += (lkMax < threshold);
+  }
+  return n_below;
+}
+
+void
+lk_vector_from_operands_range (phylogeny phy, lk_vector res, lk_operand *left, lk_operand *right, int first, int last)
+{
+  int idx, n_state = phy->model->n_state, n_cat = phy->model->nrates;
+  double *l = left->v->lk, *r = right->v->lk, *Ql = left->Q, *Qr = right->Q;
+
+  /* vectorised (Q x left) * (Q x right) over all elements idx = pattern * n_cat + category, contiguous in memory; 
+   * leaves have only 16 possible vectors, for which Q x leaf is precalculated (cherries need only lookups) */
+  if (left->tip && right->tip) 
+    lk_kernel_partial_4state_tip_tip (res->lk, left->tip, left->T, right->tip, right->T, n_cat, first * n_cat, last * n_cat);
+  else if (left->tip)  
+    lk_kernel_partial_4state_tip_inner (res->lk, left->tip, left->T, r, Qr, n_cat, first * n_cat, last * n_cat);
+  else if (right->tip) 
+    lk_kernel_partial_4state_tip_inner (res->lk, right->tip, right->T, l, Ql, n_cat, first * n_cat, last * n_cat);
+  else if (n_state == 4)
+    lk_kernel_partial_4state (res->lk, l, Ql, r, Qr, n_cat, first * n_cat, last * n_cat);
+  else if (n_state == 20)
+    lk_kernel_partial_20state (res->lk, l, Ql, r, Qr, n_cat, first * n_cat, last * n_cat);
+  else if (n_state == 61)
+    lk_kernel_partial_61state (res->lk, l, Ql, r, Qr, n_cat, first * n_cat, last * n_cat);
+  else
+    lk_kernel_partial_nstate (res->lk, l, Ql, r, Qr, n_state, n_cat, first * n_cat, last * n_cat);
+
+  for (idx = first * n_cat; idx < last * n_cat; idx++) res->scale[idx] = left->v->scale[idx] + right->v->scale[idx];
+  if (n_partial_likelihoods_below_threshold (res->lk + first * n_cat * n_state, (last - first) * n_cat, n_state, phy->scale_exponent))
+    for (idx = first * n_cat; idx < last * n_cat; idx++) 
+      scale_partial_likelihood (res->lk + idx * n_state, res->scale + idx, n_state, phy->scale_exponent);
+}
+
+void
+lk_vector_from_operands_indexed (phylogeny phy, lk_vector res, lk_operand *left, lk_operand *right, 
+                                 int *pat, int *lpat, int *rpat, int n)
+{
+  int j, cat, idx, n_state = phy->model->n_state, n_cat = phy->model->nrates;
+  double *l = left->v->lk, *r = right->v->lk, *Ql = left->Q, *Qr = right->Q;
+
+  if (left->tip && right->tip) 
+    lk_kernel_partial_4state_tip_tip_indexed (res->lk, left->tip, left->T, right->tip, right->T, n_cat, pat, n);
+  else if (left->tip)  
+    lk_kernel_partial_4state_tip_inner_indexed (res->lk, left->tip, left->T, r, Qr, n_cat, pat, rpat, n);
+  else if (right->tip) 
+    lk_kernel_partial_4state_tip_inner_indexed (res->lk, right->tip, right->T, l, Ql, n_cat, pat, lpat, n);
+  else if (n_state == 4)
+    lk_kernel_partial_4state_indexed (res->lk, l, Ql, r, Qr, n_cat, pat, lpat, rpat, n);
+  else if (n_state == 20)
+    lk_kernel_partial_20state_indexed (res->lk, l, Ql, r, Qr, n_cat, pat, lpat, rpat, n);
+  else if (n_state == 61)
+    lk_kernel_partial_61state_indexed (res->lk, l, Ql, r, Qr, n_cat, pat, lpat, rpat, n);
+  else
+    lk_kernel_partial_nstate_indexed (res->lk, l, Ql, r, Qr, n_state, n_cat, pat, lpat, rpat, n);
+
+  for (j = 0; j < n; j++) for (cat = 0; cat < n_cat; cat++) {
+    idx = pat[j] * n_cat + cat;
+    res->scale[idx] = left->v->scale[lpat[j] * n_cat + cat] + right->v->scale[rpat[j] * n_cat + cat];
+    scale_partial_likelihood (res->lk + idx * n_state, res->scale + idx, n_state, phy->scale_exponent);
+  }
+}
+
+double
+ln_likelihood_at_root (phylogeny phy, double *Qv, lk_vector left, lk_vector right, double *pat_lnLk, int first, int last)
+{
+  return ln_likelihood_at_root_offset (phy, Qv, left, right, pat_lnLk, 0, first, last);
+}
+
+double
+ln_likelihood_at_root_offset (phylogeny phy, double *Qv, lk_vector left, lk_vector right, double *pat_lnLk, int offset, int first, int last)
+{ /* Q[s1][s2] = Qv[(cat * n + s2) * 2n + s1] */
+  int pat, cat, lidx, ridx, s1, s2, n_state = phy->model->n_state, n_cat = phy->model->nrates, scale[n_cat], max_scale;
+  double LikSite[n_cat], lk, *l, *r, *Q, sum_of_lnLk = 0.;
+
+  for (pat = first; pat < last; pat++) { 
+    for (max_scale = 0, cat = 0; cat < n_cat; cat++) {
+      lidx = (first + left->rep[pat])  * n_cat + cat; /* site repeats are stored only once */
+      ridx = (first + right->rep[pat]) * n_cat + cat;
+      l = left->lk  + lidx * n_state;
+      r = right->lk + ridx * n_state;
+      Q = Qv + cat * 2 * n_state * n_state;
+      scale[cat] = left->scale[lidx] + right->scale[ridx]; /* product of all scaling factors is 2^scale */
+      if (!cat || (scale[cat] > max_scale)) max_scale = scale[cat];
+
+      LikSite[cat] = 0.;
+      for (s1 = 0; s1 < n_state; s1++) for (s2 = 0; s2 < n_state; s2++) /* likelihood at root for pattern */
+        LikSite[cat] += phy->model->pi[s1] * l[s1] * Q[2 * n_state * s2 + s1] * r[s2];
+    }
+    /* log likelihood of pattern, summed over discretized rates (with a common scaling factor): only log() of pattern */
+    for (lk = 0., cat = 0; cat < n_cat; cat++) 
+      lk += (scale[cat] == max_scale) ? LikSite[cat] : ldexp (LikSite[cat], scale[cat] - max_scale);
+    pat_lnLk[offset + pat] = log (lk) + (double) max_scale * M_LN2;
+    /* phylogenetic log likelihood over sites (weighted patterns) */
+    sum_of_lnLk += pat_lnLk[offset + pat] * phy->weight[offset + pat];
+  }
+  return sum_of_lnLk;
+}
+
+rell_bootstrap
+new_rell_bootstrap (phylogeny phy, int n_rep)
+{
+  int i, j, rep, n_sites = 0, *site_pattern;
+  rell_bootstrap rell = (rell_bootstrap) biomcmc_malloc (sizeof (struct rell_bootstrap_struct));
+
+  rell->n_rep = n_rep;
+  rell->npat = phy->npat;
+  rell->n_cand = 0;
+  rell->n_cand_max = 8;
+  rell->lnLk = (double*) biomcmc_malloc (rell->n_cand_max * n_rep * sizeof (double));
+  rell->weight = (float*) biomcmc_malloc (phy->npat * n_rep * sizeof (float));
+  for (i = 0; i < phy->npat * n_rep; i++) rell->weight[i] = 0.f;
+
+  for (i = 0; i < phy->npat; i++) n_sites += (int) (phy->weight[i] + 0.5);
+  site_pattern = (int*) biomcmc_malloc (n_sites * sizeof (int));
+  for (n_sites = 0, i = 0; i < phy->npat; i++) for (j = (int) (phy->weight[i] + 0.5); j > 0; j--) site_pattern[n_sites++] = i;
+  for (rep = 0; rep < n_rep; rep++) for (i = 0; i < n_sites; i++) 
+    rell->weight[site_pattern[ biomcmc_rng_unif_int (n_sites) ] * n_rep + rep] += 1.f;
+  free (site_pattern);
+  return rell;
+}
+
+void
+del_rell_bootstrap (rell_bootstrap rell)
+{
+  if (!rell) return;
+  if (rell->weight) free (rell->weight);
+  if (rell->lnLk)   free (rell->lnLk);
+  free (rell);
+}
+
+int
+rell_bootstrap_add_candidate (rell_bootstrap rell, double *pat_lnLk)
+{
+  int r0, n_rep = rell->n_rep;
+  double *lnLk;
+
+  if (rell->n_cand == rell->n_cand_max) {
+    rell->n_cand_max *= 2;
+    rell->lnLk = (double*) biomcmc_realloc ((double*) rell->lnLk, rell->n_cand_max * n_rep * sizeof (double));
+  }
+  lnLk = rell->lnLk + rell->n_cand * n_rep;
+  /* matrix-vector product: each thread sums over all patterns, for its replicates (thus independent of n_threads) */
+#ifdef _OPENMP
+#pragma omp parallel for shared(rell, pat_lnLk, lnLk, n_rep) schedule(static)
+#endif
+  for (r0 = 0; r0 < n_rep; r0 += RellReplicateBlock) {
+    int pat, rep, n = (r0 + RellReplicateBlock < n_rep) ? RellReplicateBlock : n_rep - r0;
+    double sum[RellReplicateBlock];
+    float *w;
+    for (rep = 0; rep < n; rep++) sum[rep] = 0.;
+    for (pat = 0; pat < rell->npat; pat++) { 
+      w = rell->weight + pat * n_rep + r0;
+      for (rep = 0; rep < n; rep++) sum[rep] += (double) w[rep] * pat_lnLk[pat]; /* vectorisable */
+    }
+    for (rep = 0; rep < n; rep++) lnLk[r0 + rep] = sum[rep];
+  }
+  return rell->n_cand++;
+}
+
+void
+rell_bootstrap_support (rell_bootstrap rell, double *support)
+{
+  int c, rep, best;
+  for (c = 0; c < rell->n_cand; c++) support[c] = 0.;
+  for (rep = 0; rep < rell->n_rep; rep++) {
+    for (best = 0, c = 1; c < rell->n_cand; c++) if (rell->lnLk[c * rell->n_rep + rep] > rell->lnLk[best * rell->n_rep + rep]) best = c;
+    support[best] += 1.;
+  }
+  for (c = 0; c < rell->n_cand; c++) support[c] /= (double) rell->n_rep;
+}
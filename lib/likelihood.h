@@ -35,6 +35,67 @@ void accept_likelihood_moved_branches (phylogeny phy, topology tre);
 extern void (*ln_likelihood_moved_branches_at_lk_vector) (phylogeny phy, topology tre, int idx);
 void accept_likelihood_moved_branches_at_lk_vector (phylogeny phy, topology tre, int idx, double likelihood);
 
+/*! \brief ln(likelihood) lnLk[i] of each SPR neighbour (prune[i], regraft[i]) of topology, given by node ids as in 
+ * apply_spr_at_nodes(), all in one pass without changing the topology. Partial likelihoods of the current topology must 
+ * be up to date (e.g. after accept_likelihood() ) */
+extern void (*ln_likelihood_spr_candidates) (phylogeny phy, topology tre, int *prune, int *regraft, int n, double *lnLk);
+
+/*! \brief recalculate transition matrices of branches with new lengths (only if phylogeny uses branch lengths, see
+ * phylogeny_use_branch_lengths()); called by likelihood functions, but can be called in advance (e.g. for
+ * derivatives) */
+void update_branch_pmatrix_from_topology (phylogeny phy, topology tre);
+
+/*! \brief optimise the length of the branch above node (or between root's children, if node is root or its child) by 
+ * Newton-Raphson with analytical derivatives, returning the new ln(likelihood). Needs per-branch transition matrices 
+ * (see phylogeny_use_branch_lengths() ) and partial likelihoods of the current topology up to date (e.g. after 
+ * accept_likelihood() ), which are kept up to date */
+double ln_likelihood_optimise_branch_length (phylogeny phy, topology tre, topol_node node);
+/*! \brief optimise all branch lengths, one at a time in preorder, for up to n_sweeps over the tree or until the 
+ * ln(likelihood) improves less than tolerance; same requirements as ln_likelihood_optimise_branch_length() */
+double ln_likelihood_optimise_branch_lengths (phylogeny phy, topology tre, int n_sweeps, double tolerance);
+
+/*! \brief ln(likelihood) of topology summed over all partitions, updating all internal nodes */
+void ln_likelihood_partitions (partitioned_phylogeny pp, topology tre);
+void accept_likelihood_partitions (partitioned_phylogeny pp, topology tre);
+/*! \brief ln(likelihood) of topology summed over all partitions, based on changed nodes */
+void ln_likelihood_moved_branches_partitions (partitioned_phylogeny pp, topology tre);
+void accept_likelihood_moved_branches_partitions (partitioned_phylogeny pp, topology tre);
+
+/*! \brief memory-bounded mode: partial likelihoods are stored only at checkpoint nodes, chosen over topology s.t. all
+ * vectors fit in max_bytes, while others are recalculated for each block of patterns (in cache) whenever needed. A full 
+ * ln_likelihood() costs the same, but ln_likelihood_moved_branches() must also recalculate the nodes between the changed 
+ * ones and the checkpoints below them: recompute_cost (if not NULL) is its average cost relative to full storage, over 
+ * changes at each node. Returns the memory used by partial likelihoods. If max_bytes is enough for all vectors, or zero, 
+ * all are stored (default). Stored vectors are lost, thus ln_likelihood() and accept_likelihood() must be called 
+ * afterwards; checkpoints can be chosen again later, as the topology changes. SPR candidates, branch length 
+ * optimisation and ln_likelihood_moved_branches_at_lk_vector() are not available in memory-bounded mode */
+size_t phylogeny_set_memory_budget (phylogeny phy, topology tre, size_t max_bytes, double *recompute_cost);
+
+/*! \brief RELL bootstrap (resampling estimated log-likelihoods, Kishino, Miyata and Hasegawa 1990): the ln(likelihood) of 
+ * candidate trees in each replicate is the sum of its pattern ln(likelihoods), weighted by resampled pattern counts */
+typedef struct rell_bootstrap_struct* rell_bootstrap;
+
+struct rell_bootstrap_struct
+{
+  int n_rep,     /*! \brief number of bootstrap replicates */
+      npat,      /*! \brief number of patterns, as phylogeny_struct::npat */
+      n_cand,    /*! \brief number of candidate trees scored so far */
+      n_cand_max;/*! \brief allocated size of lnLk[] (in candidates) */
+  /*! \brief pattern counts of each replicate (multinomial over sites), pattern-major s.t. replicates of a pattern are 
+   * in consecutive SIMD lanes: weight[pat * n_rep + rep]. Counts are integers (thus exact as floats) */
+  float *weight;
+  double *lnLk;  /*! \brief ln(likelihood) of candidate in replicate, at lnLk[cand * n_rep + rep] */
+};
+
+/*! \brief n_rep bootstrap replicates, resampling sites from the pattern frequencies (phylogeny_struct::weight) */
+rell_bootstrap new_rell_bootstrap (phylogeny phy, int n_rep);
+void del_rell_bootstrap (rell_bootstrap rell);
+/*! \brief add candidate tree from its pattern ln(likelihoods) (e.g. phylogeny_struct::pat_lnLk after ln_likelihood() ),
+ * scoring it in all replicates at once; returns its index */
+int rell_bootstrap_add_candidate (rell_bootstrap rell, double *pat_lnLk);
+/*! \brief fraction of replicates in which each candidate has the highest ln(likelihood) (with ties to earliest one) */
+void rell_bootstrap_support (rell_bootstrap rell, double *support);
+
 /*! \brief set likelihood functions to neglect alignment data, constant at one (ln = 0) [Bayesian prior] */
 void set_likelihood_to_prior (void);
 /*! \brief explicitly tell program that we must calculate likelihoods (simulating posterior distribution); set by default */
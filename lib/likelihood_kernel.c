@@ -0,0 +1,493 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of biomcmc-lib, a low-level library for phylogenomic analysis.
+ * Copyright (C) 2019-today  Leonardo de Oliveira Martins [ leomrtns at gmail.com;  http://www.leomartins.org ]
+ *
+ * biomcmc is free software; you can redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied 
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more 
+ * details (file "COPYING" or http://www.gnu.org/copyleft/gpl.html).
+ */
+
+/*! \file 
+ *  \brief inner loops of the likelihood calculation (partial likelihood products), with SIMD versions chosen at runtime 
+ */
+
+#include "likelihood_kernel.h"
+
+#ifdef BIOMCMC_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* a*b+c must be rounded twice in all kernels, otherwise scalar and SIMD versions would differ */
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+void lk_kernel_partial_4state_scalar (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_20state_scalar (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_61state_scalar (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_4state_indexed_scalar (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+void lk_kernel_partial_20state_indexed_scalar (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+void lk_kernel_partial_61state_indexed_scalar (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+void lk_kernel_partial_4state_tip_tip_indexed_scalar (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, const int *pat, int n);
+void lk_kernel_partial_4state_tip_inner_indexed_scalar (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, const int *pat, const int *ipat, int n);
+void lk_kernel_partial_4state_tip_tip_scalar (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, int first, int last);
+void lk_kernel_partial_4state_tip_inner_scalar (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, int first, int last);
+#ifdef BIOMCMC_X86_SIMD
+void lk_kernel_partial_4state_sse2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_4state_avx2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_4state_avx512 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_20state_avx2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_61state_avx2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_20state_avx512 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_61state_avx512 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+void lk_kernel_partial_4state_indexed_avx2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+void lk_kernel_partial_20state_indexed_avx2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+void lk_kernel_partial_61state_indexed_avx2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+void lk_kernel_partial_20state_indexed_avx512 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+void lk_kernel_partial_61state_indexed_avx512 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+void lk_kernel_partial_4state_tip_tip_indexed_avx2 (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, const int *pat, int n);
+void lk_kernel_partial_4state_tip_inner_indexed_avx2 (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, const int *pat, const int *ipat, int n);
+void lk_kernel_partial_4state_tip_tip_avx2 (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, int first, int last);
+void lk_kernel_partial_4state_tip_inner_avx2 (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, int first, int last);
+#endif
+
+/* Kernels for a fixed number of states N are generated from the same body, where N is a compile-time constant s.t. the
+ * loops over states are fully unrolled and vectorised by the compiler (for each instruction set given by the target
+ * attribute). The loop over s2 is outside, but each state s1 receives the same operations in the same order as in the
+ * hand-written 4-state kernels, thus all versions are still identical. Rows of Q have 2N values (see 
+ * evolution_model_struct::Qv). */
+#define LK_KERNEL_PARTIAL_ELEMENT(N,x,l,Ql,r,Qr) \
+  for (s1 = 0; s1 < (N); s1++) { lkl[s1] = (Ql)[s1] * (l)[0]; lkr[s1] = (Qr)[s1] * (r)[0]; } \
+  for (s2 = 1; s2 < (N); s2++) for (s1 = 0; s1 < (N); s1++) { \
+    lkl[s1] += (Ql)[2 * (N) * s2 + s1] * (l)[s2]; \
+    lkr[s1] += (Qr)[2 * (N) * s2 + s1] * (r)[s2]; \
+  } \
+  for (s1 = 0; s1 < (N); s1++) (x)[s1] = lkr[s1] * lkl[s1];
+
+#define LK_KERNEL_PARTIAL_BODY(N) \
+  int e, s1, s2; \
+  double lkl[N], lkr[N]; \
+  for (e = first; e < last; e++) { \
+    LK_KERNEL_PARTIAL_ELEMENT(N, res + (N) * e, left + (N) * e, Qleft + (e % n_cat) * 2 * (N) * (N), \
+                              right + (N) * e, Qright + (e % n_cat) * 2 * (N) * (N)) \
+  }
+
+#define LK_KERNEL_PARTIAL_INDEXED_BODY(N) \
+  int j, c, s1, s2; \
+  double lkl[N], lkr[N]; \
+  for (j = 0; j < n; j++) for (c = 0; c < n_cat; c++) { \
+    LK_KERNEL_PARTIAL_ELEMENT(N, res + (pat[j] * n_cat + c) * (N), left + (lpat[j] * n_cat + c) * (N), Qleft + c * 2 * (N) * (N), \
+                              right + (rpat[j] * n_cat + c) * (N), Qright + c * 2 * (N) * (N)) \
+  }
+
+/*! \brief defines lk_kernel_partial_<N>state_<isa>() and lk_kernel_partial_<N>state_indexed_<isa>(), compiled with 
+ * function attribute <target> */
+#define LK_KERNEL_PARTIAL_NSTATE(N,isa,target) \
+  target void lk_kernel_partial_##N##state_##isa (double *res, const double *left, const double *Qleft, \
+                                                  const double *right, const double *Qright, int n_cat, int first, int last) \
+  { LK_KERNEL_PARTIAL_BODY(N) } \
+  target void lk_kernel_partial_##N##state_indexed_##isa (double *res, const double *left, const double *Qleft, const double *right, \
+                                                          const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n) \
+  { LK_KERNEL_PARTIAL_INDEXED_BODY(N) }
+
+void (*lk_kernel_partial_4state) (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last) = 
+  &lk_kernel_partial_4state_scalar;
+void (*lk_kernel_partial_20state) (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last) = 
+  &lk_kernel_partial_20state_scalar;
+void (*lk_kernel_partial_61state) (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last) = 
+  &lk_kernel_partial_61state_scalar;
+void (*lk_kernel_partial_4state_tip_tip) (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, int first, int last) = 
+  &lk_kernel_partial_4state_tip_tip_scalar;
+void (*lk_kernel_partial_4state_tip_inner) (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, int first, int last) = 
+  &lk_kernel_partial_4state_tip_inner_scalar;
+
+void (*lk_kernel_partial_4state_indexed) (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n) = 
+  &lk_kernel_partial_4state_indexed_scalar;
+void (*lk_kernel_partial_20state_indexed) (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n) = 
+  &lk_kernel_partial_20state_indexed_scalar;
+void (*lk_kernel_partial_61state_indexed) (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n) = 
+  &lk_kernel_partial_61state_indexed_scalar;
+void (*lk_kernel_partial_4state_tip_tip_indexed) (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, const int *pat, int n) = 
+  &lk_kernel_partial_4state_tip_tip_indexed_scalar;
+void (*lk_kernel_partial_4state_tip_inner_indexed) (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, const int *pat, const int *ipat, int n) = 
+  &lk_kernel_partial_4state_tip_inner_indexed_scalar;
+
+static bool lk_kernel_is_set = false;
+
+/*! \brief complete set of kernels, filled before any of the global pointers is changed */
+typedef struct
+{
+  void (*partial[3]) (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last);
+  void (*indexed[3]) (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+  void (*tip_tip) (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, int first, int last);
+  void (*tip_inner) (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, int first, int last);
+  void (*tip_tip_indexed) (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, const int *pat, int n);
+  void (*tip_inner_indexed) (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, const int *pat, const int *ipat, int n);
+} lk_kernel_table;
+
+/*! \brief fill table with kernels up to given instruction set, returning chosen one */
+int likelihood_kernel_choose (int kernel, lk_kernel_table *k);
+/*! \brief publish kernels and then set lk_kernel_is_set; must be called within omp critical (likelihood_kernel_init) */
+int likelihood_kernel_assign (int kernel);
+
+void
+likelihood_kernel_init (void)
+{
+  bool is_set;
+#ifdef _OPENMP
+#pragma omp atomic read seq_cst
+#endif
+  is_set = lk_kernel_is_set;
+  if (is_set) return;
+#ifdef _OPENMP
+#pragma omp critical (likelihood_kernel_init)
+#endif
+  {
+    if (!lk_kernel_is_set) likelihood_kernel_assign (LK_KERNEL_avx512);
+  } // omp critical
+}
+
+int
+set_likelihood_kernel (int kernel)
+{
+#ifdef _OPENMP
+#pragma omp critical (likelihood_kernel_init)
+#endif
+  {
+    kernel = likelihood_kernel_assign (kernel);
+  } // omp critical
+  return kernel;
+}
+
+int
+likelihood_kernel_assign (int kernel)
+{ /* each pointer is written once, with its final value: threads already running see either old or new kernel, and all 
+     versions give the same results */
+  lk_kernel_table k;
+  kernel = likelihood_kernel_choose (kernel, &k);
+  lk_kernel_partial_4state  = k.partial[0];
+  lk_kernel_partial_20state = k.partial[1];
+  lk_kernel_partial_61state = k.partial[2];
+  lk_kernel_partial_4state_indexed  = k.indexed[0];
+  lk_kernel_partial_20state_indexed = k.indexed[1];
+  lk_kernel_partial_61state_indexed = k.indexed[2];
+  lk_kernel_partial_4state_tip_tip   = k.tip_tip;
+  lk_kernel_partial_4state_tip_inner = k.tip_inner;
+  lk_kernel_partial_4state_tip_tip_indexed   = k.tip_tip_indexed;
+  lk_kernel_partial_4state_tip_inner_indexed = k.tip_inner_indexed;
+#ifdef _OPENMP
+#pragma omp atomic write seq_cst
+#endif
+  lk_kernel_is_set = true; /* only after all pointers were assigned */
+  return kernel;
+}
+
+int
+likelihood_kernel_choose (int kernel, lk_kernel_table *k)
+{
+  uint32_t cpu = biomcmc_cpu_features ();
+  k->tip_tip   = &lk_kernel_partial_4state_tip_tip_scalar;
+  k->tip_inner = &lk_kernel_partial_4state_tip_inner_scalar;
+  k->partial[0] = &lk_kernel_partial_4state_scalar;
+  k->partial[1] = &lk_kernel_partial_20state_scalar;
+  k->partial[2] = &lk_kernel_partial_61state_scalar;
+  k->indexed[0] = &lk_kernel_partial_4state_indexed_scalar;
+  k->indexed[1] = &lk_kernel_partial_20state_indexed_scalar;
+  k->indexed[2] = &lk_kernel_partial_61state_indexed_scalar;
+  k->tip_tip_indexed   = &lk_kernel_partial_4state_tip_tip_indexed_scalar;
+  k->tip_inner_indexed = &lk_kernel_partial_4state_tip_inner_indexed_scalar;
+#ifdef BIOMCMC_X86_SIMD
+  if ((kernel >= LK_KERNEL_avx2) && (cpu & BIOMCMC_CPU_AVX2)) { /* lookup tables don't benefit from wider registers */
+    k->tip_tip   = &lk_kernel_partial_4state_tip_tip_avx2;
+    k->tip_inner = &lk_kernel_partial_4state_tip_inner_avx2;
+    k->partial[1] = &lk_kernel_partial_20state_avx2;
+    k->partial[2] = &lk_kernel_partial_61state_avx2;
+    /* scattered elements (site repeats) can't be paired in AVX-512 registers */
+    k->indexed[0] = &lk_kernel_partial_4state_indexed_avx2;
+    k->indexed[1] = &lk_kernel_partial_20state_indexed_avx2;
+    k->indexed[2] = &lk_kernel_partial_61state_indexed_avx2;
+    k->tip_tip_indexed   = &lk_kernel_partial_4state_tip_tip_indexed_avx2;
+    k->tip_inner_indexed = &lk_kernel_partial_4state_tip_inner_indexed_avx2;
+  }
+  if ((kernel >= LK_KERNEL_avx512) && (cpu & BIOMCMC_CPU_AVX512F) && (cpu & BIOMCMC_CPU_AVX2)) {
+    k->partial[1] = &lk_kernel_partial_20state_avx512;
+    k->partial[2] = &lk_kernel_partial_61state_avx512;
+    k->indexed[1] = &lk_kernel_partial_20state_indexed_avx512;
+    k->indexed[2] = &lk_kernel_partial_61state_indexed_avx512;
+    k->partial[0] = &lk_kernel_partial_4state_avx512;
+    return LK_KERNEL_avx512;
+  }
+  if ((kernel >= LK_KERNEL_avx2) && (cpu & BIOMCMC_CPU_AVX2)) {
+    k->partial[0] = &lk_kernel_partial_4state_avx2;
+    return LK_KERNEL_avx2;
+  }
+  if ((kernel >= LK_KERNEL_sse2) && (cpu & BIOMCMC_CPU_SSE2)) {
+    k->partial[0] = &lk_kernel_partial_4state_sse2;
+    return LK_KERNEL_sse2;
+  }
+#else
+  (void) kernel; (void) cpu;
+#endif
+  return LK_KERNEL_scalar;
+}
+
+LK_KERNEL_PARTIAL_NSTATE(4,  scalar, )
+LK_KERNEL_PARTIAL_NSTATE(20, scalar, )
+LK_KERNEL_PARTIAL_NSTATE(61, scalar, )
+
+void
+lk_kernel_partial_nstate (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_state, int n_cat, int first, int last)
+{ /* generic version, for other numbers of states */
+  LK_KERNEL_PARTIAL_BODY(n_state)
+}
+
+void
+lk_kernel_partial_nstate_indexed (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_state, int n_cat, const int *pat, const int *lpat, const int *rpat, int n)
+{
+  LK_KERNEL_PARTIAL_INDEXED_BODY(n_state)
+}
+
+void
+lk_kernel_partial_4state_tip_tip_indexed_scalar (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, const int *pat, int n)
+{ /* ambiguity codes are the same for all patterns of a site repeat */
+  int j, c, s1;
+  const double *l, *r;
+  double *x;
+
+  for (j = 0; j < n; j++) for (c = 0; c < n_cat; c++) {
+    l = Tleft  + (c * 16 + tip_left[pat[j]])  * 4;
+    r = Tright + (c * 16 + tip_right[pat[j]]) * 4;
+    x = res + (pat[j] * n_cat + c) * 4;
+    for (s1 = 0; s1 < 4; s1++) x[s1] = r[s1] * l[s1];
+  }
+}
+
+void
+lk_kernel_partial_4state_tip_inner_indexed_scalar (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, const int *pat, const int *ipat, int n)
+{
+  int j, c, s1, s2;
+  double lkr;
+  const double *Q, *l, *r;
+
+  for (j = 0; j < n; j++) for (c = 0; c < n_cat; c++) {
+    Q = Qinner + c * 32;
+    l = Ttip + (c * 16 + tip[pat[j]]) * 4;
+    r = inner + (ipat[j] * n_cat + c) * 4;
+    for (s1 = 0; s1 < 4; s1++) {
+      lkr = Q[s1] * r[0];
+      for (s2 = 1; s2 < 4; s2++) lkr += Q[8 * s2 + s1] * r[s2];
+      res[(pat[j] * n_cat + c) * 4 + s1] = lkr * l[s1];
+    }
+  }
+}
+
+void
+lk_kernel_partial_4state_tip_tip_scalar (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, int first, int last)
+{
+  int e, s1, pat = first / n_cat, cat = first % n_cat;
+  const double *l, *r;
+
+  for (e = first; e < last; e++) {
+    l = Tleft  + (cat * 16 + tip_left[pat])  * 4;
+    r = Tright + (cat * 16 + tip_right[pat]) * 4;
+    for (s1 = 0; s1 < 4; s1++) res[4 * e + s1] = r[s1] * l[s1];
+    if (++cat == n_cat) { cat = 0; pat++; }
+  }
+}
+
+void
+lk_kernel_partial_4state_tip_inner_scalar (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, int first, int last)
+{
+  int e, s1, s2, pat = first / n_cat, cat = first % n_cat;
+  double lkr;
+  const double *Q, *l, *r;
+
+  for (e = first; e < last; e++) {
+    Q = Qinner + cat * 32;
+    l = Ttip + (cat * 16 + tip[pat]) * 4;
+    r = inner + 4 * e;
+    for (s1 = 0; s1 < 4; s1++) {
+      lkr = Q[s1] * r[0];
+      for (s2 = 1; s2 < 4; s2++) lkr += Q[8 * s2 + s1] * r[s2];
+      res[4 * e + s1] = lkr * l[s1];
+    }
+    if (++cat == n_cat) { cat = 0; pat++; }
+  }
+}
+
+#ifdef BIOMCMC_X86_SIMD
+
+__attribute__((target("sse2"))) void
+lk_kernel_partial_4state_sse2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last)
+{ /* states (s1) 0,1 and 2,3 in two registers */ 
+  int e, s2;
+  __m128d l0, l1, r0, r1, q0, q1, b;
+  const double *Ql, *Qr;
+
+  for (e = first; e < last; e++) {
+    Ql = Qleft  + (e % n_cat) * 32;
+    Qr = Qright + (e % n_cat) * 32;
+    b = _mm_load1_pd (left + 4 * e);
+    l0 = _mm_mul_pd (_mm_load_pd (Ql), b);
+    l1 = _mm_mul_pd (_mm_load_pd (Ql + 2), b);
+    b = _mm_load1_pd (right + 4 * e);
+    r0 = _mm_mul_pd (_mm_load_pd (Qr), b);
+    r1 = _mm_mul_pd (_mm_load_pd (Qr + 2), b);
+    for (s2 = 1; s2 < 4; s2++) {
+      q0 = _mm_load_pd (Ql + 8 * s2);
+      q1 = _mm_load_pd (Ql + 8 * s2 + 2);
+      b = _mm_load1_pd (left + 4 * e + s2);
+      l0 = _mm_add_pd (l0, _mm_mul_pd (q0, b));
+      l1 = _mm_add_pd (l1, _mm_mul_pd (q1, b));
+      q0 = _mm_load_pd (Qr + 8 * s2);
+      q1 = _mm_load_pd (Qr + 8 * s2 + 2);
+      b = _mm_load1_pd (right + 4 * e + s2);
+      r0 = _mm_add_pd (r0, _mm_mul_pd (q0, b));
+      r1 = _mm_add_pd (r1, _mm_mul_pd (q1, b));
+    }
+    _mm_storeu_pd (res + 4 * e,     _mm_mul_pd (r0, l0));
+    _mm_storeu_pd (res + 4 * e + 2, _mm_mul_pd (r1, l1));
+  }
+}
+
+__attribute__((target("avx2"))) void
+lk_kernel_partial_4state_avx2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last)
+{ /* one (pattern, category) element per register */
+  int e, s2;
+  __m256d lkl, lkr;
+  const double *Ql, *Qr;
+
+  for (e = first; e < last; e++) {
+    Ql = Qleft  + (e % n_cat) * 32;
+    Qr = Qright + (e % n_cat) * 32;
+    lkl = _mm256_mul_pd (_mm256_load_pd (Ql), _mm256_broadcast_sd (left + 4 * e));
+    lkr = _mm256_mul_pd (_mm256_load_pd (Qr), _mm256_broadcast_sd (right + 4 * e));
+    for (s2 = 1; s2 < 4; s2++) {
+      lkl = _mm256_add_pd (lkl, _mm256_mul_pd (_mm256_load_pd (Ql + 8 * s2), _mm256_broadcast_sd (left + 4 * e + s2)));
+      lkr = _mm256_add_pd (lkr, _mm256_mul_pd (_mm256_load_pd (Qr + 8 * s2), _mm256_broadcast_sd (right + 4 * e + s2)));
+    }
+    _mm256_storeu_pd (res + 4 * e, _mm256_mul_pd (lkr, lkl));
+  }
+}
+
+__attribute__((target("avx512f"))) void
+lk_kernel_partial_4state_avx512 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, int first, int last)
+{ /* two consecutive elements (i.e. next category or next pattern) per register; Qv rows have both Q matrices */
+  int e, s2;
+  __m512d lkl, lkr, vl, vr;
+  __m512i idx[4];
+  const double *Ql, *Qr;
+
+  for (s2 = 0; s2 < 4; s2++) idx[s2] = _mm512_set_epi64 (4 + s2, 4 + s2, 4 + s2, 4 + s2, s2, s2, s2, s2);
+
+  for (e = first; e + 1 < last; e += 2) {
+    Ql = Qleft  + (e % n_cat) * 32;
+    Qr = Qright + (e % n_cat) * 32;
+    vl = _mm512_loadu_pd (left + 4 * e);
+    vr = _mm512_loadu_pd (right + 4 * e);
+    lkl = _mm512_mul_pd (_mm512_load_pd (Ql), _mm512_permutexvar_pd (idx[0], vl));
+    lkr = _mm512_mul_pd (_mm512_load_pd (Qr), _mm512_permutexvar_pd (idx[0], vr));
+    for (s2 = 1; s2 < 4; s2++) {
+      lkl = _mm512_add_pd (lkl, _mm512_mul_pd (_mm512_load_pd (Ql + 8 * s2), _mm512_permutexvar_pd (idx[s2], vl)));
+      lkr = _mm512_add_pd (lkr, _mm512_mul_pd (_mm512_load_pd (Qr + 8 * s2), _mm512_permutexvar_pd (idx[s2], vr)));
+    }
+    _mm512_storeu_pd (res + 4 * e, _mm512_mul_pd (lkr, lkl));
+  }
+  if (e < last) lk_kernel_partial_4state_avx2 (res, left, Qleft, right, Qright, n_cat, e, last); /* odd number of elements */
+}
+
+__attribute__((target("avx2"))) void
+lk_kernel_partial_4state_tip_tip_avx2 (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, int first, int last)
+{
+  int e, pat = first / n_cat, cat = first % n_cat;
+  __m256d l, r;
+
+  for (e = first; e < last; e++) {
+    l = _mm256_load_pd (Tleft  + (cat * 16 + tip_left[pat])  * 4);
+    r = _mm256_load_pd (Tright + (cat * 16 + tip_right[pat]) * 4);
+    _mm256_storeu_pd (res + 4 * e, _mm256_mul_pd (r, l));
+    if (++cat == n_cat) { cat = 0; pat++; }
+  }
+}
+
+__attribute__((target("avx2"))) void
+lk_kernel_partial_4state_tip_inner_avx2 (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, int first, int last)
+{
+  int e, s2, pat = first / n_cat, cat = first % n_cat;
+  __m256d lkr;
+  const double *Q;
+
+  for (e = first; e < last; e++) {
+    Q = Qinner + cat * 32;
+    lkr = _mm256_mul_pd (_mm256_load_pd (Q), _mm256_broadcast_sd (inner + 4 * e));
+    for (s2 = 1; s2 < 4; s2++) 
+      lkr = _mm256_add_pd (lkr, _mm256_mul_pd (_mm256_load_pd (Q + 8 * s2), _mm256_broadcast_sd (inner + 4 * e + s2)));
+    _mm256_storeu_pd (res + 4 * e, _mm256_mul_pd (lkr, _mm256_load_pd (Ttip + (cat * 16 + tip[pat]) * 4)));
+    if (++cat == n_cat) { cat = 0; pat++; }
+  }
+}
+
+__attribute__((target("avx2"))) void
+lk_kernel_partial_4state_indexed_avx2 (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n)
+{
+  int j, c, s2;
+  __m256d lkl, lkr;
+  const double *Ql, *Qr, *l, *r;
+
+  for (j = 0; j < n; j++) for (c = 0; c < n_cat; c++) {
+    Ql = Qleft  + c * 32;
+    Qr = Qright + c * 32;
+    l = left  + (lpat[j] * n_cat + c) * 4;
+    r = right + (rpat[j] * n_cat + c) * 4;
+    lkl = _mm256_mul_pd (_mm256_load_pd (Ql), _mm256_broadcast_sd (l));
+    lkr = _mm256_mul_pd (_mm256_load_pd (Qr), _mm256_broadcast_sd (r));
+    for (s2 = 1; s2 < 4; s2++) {
+      lkl = _mm256_add_pd (lkl, _mm256_mul_pd (_mm256_load_pd (Ql + 8 * s2), _mm256_broadcast_sd (l + s2)));
+      lkr = _mm256_add_pd (lkr, _mm256_mul_pd (_mm256_load_pd (Qr + 8 * s2), _mm256_broadcast_sd (r + s2)));
+    }
+    _mm256_store_pd (res + (pat[j] * n_cat + c) * 4, _mm256_mul_pd (lkr, lkl));
+  }
+}
+
+__attribute__((target("avx2"))) void
+lk_kernel_partial_4state_tip_tip_indexed_avx2 (double *res, const uint8_t *tip_left, const double *Tleft, const uint8_t *tip_right, const double *Tright, int n_cat, const int *pat, int n)
+{
+  int j, c;
+  __m256d l, r;
+
+  for (j = 0; j < n; j++) for (c = 0; c < n_cat; c++) {
+    l = _mm256_load_pd (Tleft  + (c * 16 + tip_left[pat[j]])  * 4);
+    r = _mm256_load_pd (Tright + (c * 16 + tip_right[pat[j]]) * 4);
+    _mm256_store_pd (res + (pat[j] * n_cat + c) * 4, _mm256_mul_pd (r, l));
+  }
+}
+
+__attribute__((target("avx2"))) void
+lk_kernel_partial_4state_tip_inner_indexed_avx2 (double *res, const uint8_t *tip, const double *Ttip, const double *inner, const double *Qinner, int n_cat, const int *pat, const int *ipat, int n)
+{
+  int j, c, s2;
+  __m256d lkr;
+  const double *Q, *r;
+
+  for (j = 0; j < n; j++) for (c = 0; c < n_cat; c++) {
+    Q = Qinner + c * 32;
+    r = inner + (ipat[j] * n_cat + c) * 4;
+    lkr = _mm256_mul_pd (_mm256_load_pd (Q), _mm256_broadcast_sd (r));
+    for (s2 = 1; s2 < 4; s2++) lkr = _mm256_add_pd (lkr, _mm256_mul_pd (_mm256_load_pd (Q + 8 * s2), _mm256_broadcast_sd (r + s2)));
+    _mm256_store_pd (res + (pat[j] * n_cat + c) * 4, _mm256_mul_pd (lkr, _mm256_load_pd (Ttip + (c * 16 + tip[pat[j]]) * 4)));
+  }
+}
+
+LK_KERNEL_PARTIAL_NSTATE(20, avx2,   __attribute__((target("avx2"))))
+LK_KERNEL_PARTIAL_NSTATE(61, avx2,   __attribute__((target("avx2"))))
+LK_KERNEL_PARTIAL_NSTATE(20, avx512, __attribute__((target("avx512f"))))
+LK_KERNEL_PARTIAL_NSTATE(61, avx512, __attribute__((target("avx512f"))))
+
+#endif /* BIOMCMC_X86_SIMD */
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of biomcmc-lib, a low-level library for phylogenomic analysis.
+ * Copyright (C) 2019-today  Leonardo de Oliveira Martins [ leomrtns at gmail.com;  http://www.leomartins.org ]
+ *
+ * biomcmc is free software; you can redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied 
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more 
+ * details (file "COPYING" or http://www.gnu.org/copyleft/gpl.html).
+ */
+
+/*! \file 
+ *  \brief inner loops of the likelihood calculation (partial likelihood products), with SIMD versions chosen at runtime 
+ *
+ *  All versions of a kernel give bit-for-bit identical results: they perform the same multiplications and additions, 
+ *  in the same order, over several states at once (and fused multiply-add is never used). Vectors follow the 
+ *  pattern-major layout of lk_vector_struct, and Q matrices the layout of evolution_model_struct::Qv.
+ *
+ *  DNA kernels are written by hand with intrinsics, while kernels for amino acids (20 states) and codons (61 states)
+ *  are generated by a macro with the number of states fixed at compile time, once per instruction set. 
+ */
+
+#ifndef _biomcmc_likelihood_kernel_h_
+#define _biomcmc_likelihood_kernel_h_
+
+#include "lowlevel.h"
+
+/*! \brief instruction sets of likelihood kernels, from slowest to fastest */
+enum {LK_KERNEL_scalar, LK_KERNEL_sse2, LK_KERNEL_avx2, LK_KERNEL_avx512};
+
+/*! \brief partial likelihoods for 4 states, res = (Qleft x left) * (Qright x right), for elements first <= e < last where 
+ * e = pattern * n_cat + category (that is, vectors start at res[4 * e], left[4 * e] etc.). Matrices can be the same 
+ * (e.g. evolution_model::Qv) or be specific to each branch (branch_pmatrix::P). */
+extern void (*lk_kernel_partial_4state) (double *res, const double *left, const double *Qleft, const double *right, 
+                                         const double *Qright, int n_cat, int first, int last);
+
+/*! \brief partial likelihoods for 20 states (amino acids), with same layout and arguments as lk_kernel_partial_4state */
+extern void (*lk_kernel_partial_20state) (double *res, const double *left, const double *Qleft, const double *right, 
+                                          const double *Qright, int n_cat, int first, int last);
+/*! \brief partial likelihoods for 61 states (codons), with same layout and arguments as lk_kernel_partial_4state */
+extern void (*lk_kernel_partial_61state) (double *res, const double *left, const double *Qleft, const double *right, 
+                                          const double *Qright, int n_cat, int first, int last);
+/*! \brief partial likelihoods for any number of states (slower fallback, since loops can't be unrolled at compile time) */
+void lk_kernel_partial_nstate (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, 
+                               int n_state, int n_cat, int first, int last);
+
+/*! \brief partial likelihoods for 4 states when both children are leaves, described by their ambiguity codes (one per
+ * pattern, see phylogeny_struct::tip) and lookup tables T = Q x (leaf vector) (see evolution_model_struct::Qtip) */
+extern void (*lk_kernel_partial_4state_tip_tip) (double *res, const uint8_t *tip_left, const double *Tleft, 
+                                                 const uint8_t *tip_right, const double *Tright, int n_cat, int first, int last);
+/*! \brief partial likelihoods for 4 states when one child is a leaf (described by its ambiguity codes) */
+extern void (*lk_kernel_partial_4state_tip_inner) (double *res, const uint8_t *tip, const double *Ttip, const double *inner,
+                                                   const double *Qinner, int n_cat, int first, int last);
+
+/*! \brief as lk_kernel_partial_4state, but only for patterns pat[0..n), reading left and right children at patterns lpat[] 
+ * and rpat[] (i.e. in the same block, but possibly elsewhere, in case of site repeats) */
+extern void (*lk_kernel_partial_4state_indexed) (double *res, const double *left, const double *Qleft, const double *right, 
+                                                 const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+/*! \brief as lk_kernel_partial_4state_indexed, for 20 states */
+extern void (*lk_kernel_partial_20state_indexed) (double *res, const double *left, const double *Qleft, const double *right, 
+                                                  const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+/*! \brief as lk_kernel_partial_4state_indexed, for 61 states */
+extern void (*lk_kernel_partial_61state_indexed) (double *res, const double *left, const double *Qleft, const double *right, 
+                                                  const double *Qright, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+/*! \brief as lk_kernel_partial_4state_indexed, for any number of states */
+void lk_kernel_partial_nstate_indexed (double *res, const double *left, const double *Qleft, const double *right, const double *Qright, 
+                                       int n_state, int n_cat, const int *pat, const int *lpat, const int *rpat, int n);
+/*! \brief as lk_kernel_partial_4state_tip_tip, but only for patterns pat[0..n) */
+extern void (*lk_kernel_partial_4state_tip_tip_indexed) (double *res, const uint8_t *tip_left, const double *Tleft, 
+                                                         const uint8_t *tip_right, const double *Tright, int n_cat, const int *pat, int n);
+/*! \brief as lk_kernel_partial_4state_tip_inner, but only for patterns pat[0..n), reading inner node at patterns ipat[] */
+extern void (*lk_kernel_partial_4state_tip_inner_indexed) (double *res, const uint8_t *tip, const double *Ttip, const double *inner,
+                                                           const double *Qinner, int n_cat, const int *pat, const int *ipat, int n);
+
+/*! \brief chooses the fastest kernels supported by the CPU, unless set_likelihood_kernel() was called before */
+void likelihood_kernel_init (void);
+/*! \brief use kernels up to given instruction set (LK_KERNEL_*), if supported by the CPU; returns the chosen one */
+int set_likelihood_kernel (int kernel);
+
+#endif
@@ -27,6 +27,15 @@ biomcmc_malloc (size_t size)
   return value;
 }
 
+void *
+biomcmc_malloc_aligned (size_t size)
+{
+  void *value = NULL;
+  if (posix_memalign (&value, BIOMCMC_ALIGNMENT, size)) value = NULL; /* returns error code, not pointer */
+  if (value == NULL) biomcmc_error ( "biomcmc_malloc_aligned error allocating %d bites", size);
+  return value;
+}
+
 void *
 biomcmc_realloc (void *ptr, size_t size)
 {
@@ -64,6 +73,27 @@ biomcmc_warning (const char *template, ...)
   return;
 }
 
+uint32_t
+biomcmc_cpu_features (void)
+{
+  static uint32_t features = 0;
+  static bool is_set = false;
+  uint32_t f = 0;
+
+  if (is_set) return features;
+#ifdef BIOMCMC_X86_SIMD
+  __builtin_cpu_init (); /* needed only if called from constructors, but harmless otherwise */
+  if (__builtin_cpu_supports ("sse2"))     f |= BIOMCMC_CPU_SSE2;
+  if (__builtin_cpu_supports ("popcnt"))   f |= BIOMCMC_CPU_POPCNT;
+  if (__builtin_cpu_supports ("avx2"))     f |= BIOMCMC_CPU_AVX2;
+  if (__builtin_cpu_supports ("avx512f"))  f |= BIOMCMC_CPU_AVX512F;
+  if (__builtin_cpu_supports ("avx512vpopcntdq")) f |= BIOMCMC_CPU_AVX512POPCNT;
+#endif
+  features = f; /* all threads would find the same value, thus race conditions are harmless */
+  is_set = true;
+  return features;
+}
+
 int
 compare_int_increasing (const void *a, const void *b)
 {
@@ -61,6 +61,19 @@
 #define BIOMCMC_MAX(x,y) (((x)>(y)) ? (x) : (y))
 #define BIOMCMC_MOD(a)   (((a)>0)   ? (a) :(-a))
 
+#define BIOMCMC_ALIGNMENT 64 /*!< \brief alignment in bytes of SIMD-friendly vectors (cache line, and AVX-512 register size) */
+
+/* CPU instruction sets available at runtime, as bits returned by biomcmc_cpu_features() */
+#define BIOMCMC_CPU_SSE2        0x01U /*!< \brief SSE2 (always present on x86_64) */
+#define BIOMCMC_CPU_POPCNT      0x02U /*!< \brief hardware popcount of 64 bits words */
+#define BIOMCMC_CPU_AVX2        0x04U /*!< \brief AVX2, 256 bits integer and floating point vectors */
+#define BIOMCMC_CPU_AVX512F     0x08U /*!< \brief AVX-512 foundation, 512 bits vectors */
+#define BIOMCMC_CPU_AVX512POPCNT 0x10U /*!< \brief AVX-512 VPOPCNTDQ, vectorised popcount of 64 bits words */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+ #define BIOMCMC_X86_SIMD /*!< \brief compiler can generate x86 SIMD functions through target attributes */
+#endif
+
 
 /*! \brief Mnemonic for boolean (char is smaller than int) */
 typedef unsigned char bool;
@@ -87,6 +100,14 @@ struct hungarian_struct
  *  \return pointer to newly allocated memory */
 void *biomcmc_malloc (size_t size);
 
+/*! \brief Memory-safe aligned malloc() function.
+ *
+ *  Allocates size bytes starting at a multiple of BIOMCMC_ALIGNMENT, such that vectors can be loaded into SIMD registers
+ *  without crossing cache lines. Memory can be released with the usual free(). 
+ *  \param[in] size allocated size, in bytes
+ *  \return pointer to newly allocated (aligned) memory */
+void *biomcmc_malloc_aligned (size_t size);
+
 /*! \brief Memory-safe realloc() function.
  *
  * Changes the size of the memory block pointed to by ptr to size bytes. An error message is thrown in case of failure.
@@ -104,6 +125,12 @@ void biomcmc_error (const char *template, ...);
 
 void biomcmc_warning (const char *template, ...);
 
+/*! \brief Bitmask of BIOMCMC_CPU_* instruction sets supported by the CPU (and operating system) at runtime.
+ *
+ * Detected once and cached, such that SIMD-specialised functions can be chosen without rebuilding the library for the 
+ * host. It is zero if the compiler or architecture do not allow for runtime dispatch. */
+uint32_t biomcmc_cpu_features (void);
+
 /*! \brief Comparison between integers, doubles, etc. used by qsort() */
 int compare_int_increasing (const void *a, const void *b);
 int compare_int_decreasing (const void *a, const void *b);
@@ -16,7 +16,80 @@
 int update_biparsdatmat_column_from_ones (binary_parsimony_datamatrix mrp, topology t, int *ones, bipartition bp, int *map);
 void update_binary_parsimony_length (binary_parsimony pars, int new_columns_size);
 void update_binary_parsimony_datamatrix_column_if_new (binary_parsimony_datamatrix mrp);
-uint32_t hash_value_of_binary_parsimony_datamatrix_column (binary_parsimony_datamatrix mrp, int idx);
+/*! \brief fingerprint of current column mrp->i, from its bitstrings col_bits and occupancy */
+uint64_t fingerprint_of_binary_parsimony_datamatrix_column (binary_parsimony_datamatrix mrp);
+/*! \brief double the size of the column hash table (with at least twice the number of columns) */
+void update_binary_parsimony_datamatrix_index_size (binary_parsimony_datamatrix mrp);
+/*! \brief allocate bit-planes with at least n_sites columns, with new words zeroed (never shrinks) */
+void update_binary_parsimony_datamatrix_planes_length (binary_parsimony_datamatrix mrp, int n_sites);
+/*! \brief copy column idx of s[][] into the bit-planes */
+void update_binary_parsimony_datamatrix_planes_column (binary_parsimony_datamatrix mrp, int idx);
+/*! \brief matrix for internal nodes, with only bit-planes (including changed[]) */
+binary_parsimony_datamatrix new_binary_parsimony_internal_datamatrix (int n_nodes, int n_sites);
+/*! \brief Fitch algorithm for node over BinParsBlock words (64 columns each) starting at w, updating per-column scores; 
+ * if delta is not NULL then only differences w.r.t. previous state are counted, and cost differences added to delta[] */
+void binary_parsimony_fitch_block (binary_parsimony pars, topol_node node, int nleaves, int w, double *delta);
+/*! \brief add change (+1 or -1) to score of column col, adding its effect on costs to delta[] */
+void binary_parsimony_column_score_change (binary_parsimony pars, int col, int change, double *delta);
+/*! \brief exchange bit-planes of internal node idx between current and previous states */
+void swap_binary_parsimony_internal_node (binary_parsimony pars, int idx);
+/*! \brief bit-planes of column weights, where bit b of freq[col] is set in plane b (n_fbits planes, enough for max freq) */
+uint64_t** new_binary_parsimony_weight_planes (binary_parsimony_datamatrix mrp, int *n_fbits);
+void del_binary_parsimony_weight_planes (uint64_t **fbits, int n_fbits);
+/*! \brief sum of freq[] over the columns set in x, for word w */
+static inline int binary_parsimony_weighted_popcount (uint64_t x, uint64_t **fbits, int n_fbits, int w);
+/*! \brief distances between all pairs of taxa from blocks starting at taxa i0 and j0 (with i0 <= j0) */
+void pairwise_distances_binary_parsimony_tile (binary_parsimony_datamatrix mrp, double **dist, int size_dist, uint64_t **fbits, 
+                                               int n_fbits, double *weight, int i0, int j0);
+/*! \brief workspace of each thread, reused across moves; scratch sets are needed only for ancestors of the pruned subtree
+ * and for nodes waiting in the depth-first stack, thus buffers grow with tree depth and not with number of nodes */
+typedef struct
+{
+  uint64_t **d01, **d10; /*! \brief Fitch sets of pruned tree (by node id), as pointers to original sets or to dbuf */
+  uint64_t *dbuf;        /*! \brief sets of ancestors of pruned subtree (by node level), which change when it is removed */
+  uint64_t **u01, **u10; /*! \brief sets from above of nodes in stack (by stack position), and of popped node (last) */
+  uint64_t *ubuf;
+  topol_node *stack;
+  int depth;             /*! \brief buffers are allocated for trees up to this depth */
+} bpars_spr_thread;
+
+/*! \brief Fitch sets of all nodes (after full scoring) as seen from above, and column weights as bit-planes, for SPR search */
+typedef struct
+{
+  binary_parsimony pars;
+  topology t;
+  int n_words, n_fbits;    /*! \brief number of words with columns, and of bits in largest column weight (freq) */
+  uint64_t **fbits;        /*! \brief bit-planes of column weights: bit b of freq[col] */
+  uint64_t **up01, **up10; /*! \brief Fitch sets (by node id) of the tree above node, i.e. of the complement of its subtree */
+  int score;               /*! \brief unrooted score of t, since moves may change the root (insertion costs are unrooted) */
+  bpars_spr_thread *ws;    /*! \brief one workspace per thread */
+  int n_threads;
+  int *delta;              /*! \brief best score difference (by prune node id), with its regraft node and direction */
+  topol_node *best_r;
+  bool *best_lca;
+} bpars_spr;
+
+/*! \brief allocate SPR search structure for tree t (with up-to-date Fitch sets, i.e. just after full scoring) */
+void bpars_spr_init (bpars_spr *spr, binary_parsimony pars, topology t);
+/*! \brief full (unrooted) scoring of spr->t, followed by update of upstream Fitch sets */
+void bpars_spr_update (bpars_spr *spr);
+void bpars_spr_free (bpars_spr *spr);
+/*! \brief point Fitch sets of pruned tree to original ones, and grow buffers if tree is deeper than before */
+void bpars_spr_thread_update (bpars_spr *spr, bpars_spr_thread *ws, int depth);
+/*! \brief Fitch set x of two sets a and b, over n_words */
+void bpars_fitch_sets (uint64_t *a01, uint64_t *a10, uint64_t *b01, uint64_t *b10, uint64_t *x01, uint64_t *x10, int n_words);
+/*! \brief weighted number of columns where a subtree with set x conflicts with edge between sets d (below) and u (above) */
+int bpars_insertion_cost (bpars_spr *spr, uint64_t *x01, uint64_t *x10, uint64_t *d01, uint64_t *d10, uint64_t *u01, uint64_t *u10);
+/*! \brief best SPR move (smallest negative score difference), returning difference or zero if no improvement exists */
+int bpars_spr_best_move (bpars_spr *spr, topol_node *prune, topol_node *regraft, bool *lca);
+/*! \brief best regraft for subtree below prune or, if lca, for rest of tree into prune's subtree; returns score difference */
+int bpars_spr_scan_prune (bpars_spr *spr, bpars_spr_thread *ws, topol_node p, topol_node *regraft, bool *lca);
+/*! \brief Fitch algorithm for node over patterns [first, last), over state sets (one byte each) */
+void dna_parsimony_fitch_range (dna_parsimony pars, topol_node node, int first, int last);
+/*! \brief Sankoff algorithm for node over patterns [first, last) */
+void dna_parsimony_sankoff_range (dna_parsimony pars, topol_node node, int first, int last);
+/*! \brief add to x[] the minimum cost over states of child, for each parent state and pattern in [first, last) */
+void dna_parsimony_sankoff_child (dna_parsimony pars, double *x, topol_node child, int first, int last);
 
 binary_parsimony_datamatrix
 new_binary_parsimony_datamatrix (int n_sequences)
@@ -30,10 +103,18 @@ new_binary_parsimony_datamatrix (int n_sequences)
   mrp->ref_counter = 1;
   mrp->freq_sum = 0;
   mrp->s = (bool**) biomcmc_malloc(mrp->ntax * sizeof (bool*)); 
+  mrp->s01 = (uint64_t**) biomcmc_malloc(mrp->ntax * sizeof (uint64_t*)); 
+  mrp->s10 = (uint64_t**) biomcmc_malloc(mrp->ntax * sizeof (uint64_t*)); 
   for (i = 0; i < mrp->ntax; i++)  mrp->s[i] = NULL; 
+  for (i = 0; i < mrp->ntax; i++)  mrp->s01[i] = mrp->s10[i] = NULL; 
+  mrp->n_words = 0;
+  mrp->changed = NULL;
   mrp->freq = NULL;
   mrp->col_hash = NULL;
   mrp->occupancy = NULL;
+  mrp->col_index = NULL;
+  mrp->index_size = 0;
+  mrp->col_bits = (uint64_t*) biomcmc_malloc (2 * ((mrp->ntax + 63) / 64) * sizeof (uint64_t));
 
   return mrp;
 }
@@ -46,10 +127,11 @@ new_binary_parsimony_datamatrix_fixed_length (int n_sequences, int n_sites)
   mrp->nchar = n_sites;
 
   mrp->freq = (int*) biomcmc_malloc (mrp->nchar * sizeof (int)); 
-  mrp->col_hash = (uint32_t*) biomcmc_malloc (mrp->nchar * sizeof (uint32_t)); 
+  mrp->col_hash = (uint64_t*) biomcmc_malloc (mrp->nchar * sizeof (uint64_t)); 
   mrp->occupancy = (int*) biomcmc_malloc (mrp->nchar * sizeof (int)); 
   for (i = 0; i < mrp->ntax; i++)  mrp->s[i] = (bool*) biomcmc_malloc(mrp->nchar * sizeof (bool)); 
   for (i = 0; i < mrp->nchar; i++) mrp->freq[i] = mrp->occupancy[i] = 0;
+  update_binary_parsimony_datamatrix_planes_length (mrp, mrp->nchar);
 
   return mrp;
 }
@@ -64,13 +146,37 @@ del_binary_parsimony_datamatrix (binary_parsimony_datamatrix mrp)
       free (mrp->s[i]); 
     }
     if (mrp->s) free (mrp->s);
+    for(i=mrp->ntax-1; i>=0; i--) { 
+      if (mrp->s01[i]) free (mrp->s01[i]); 
+      if (mrp->s10[i]) free (mrp->s10[i]); 
+    }
+    free (mrp->s01);
+    free (mrp->s10);
+    if (mrp->changed) {
+      for(i=mrp->ntax-1; i>=0; i--) if (mrp->changed[i]) free (mrp->changed[i]); 
+      free (mrp->changed);
+    }
     if (mrp->freq) free (mrp->freq);
     if (mrp->col_hash) free (mrp->col_hash);
+    if (mrp->col_index) free (mrp->col_index);
+    if (mrp->col_bits) free (mrp->col_bits);
     if (mrp->occupancy) free (mrp->occupancy);
     free (mrp);
   }
 }
 
+binary_parsimony_datamatrix
+new_binary_parsimony_internal_datamatrix (int n_nodes, int n_sites)
+{
+  int i;
+  binary_parsimony_datamatrix mrp = new_binary_parsimony_datamatrix (n_nodes);
+  mrp->nchar = n_sites;
+  mrp->changed = (uint64_t**) biomcmc_malloc(mrp->ntax * sizeof (uint64_t*)); 
+  for (i = 0; i < mrp->ntax; i++)  mrp->changed[i] = NULL; 
+  update_binary_parsimony_datamatrix_planes_length (mrp, n_sites); // internal->s is not used, only its bit-planes
+  return mrp;
+}
+
 binary_parsimony
 new_binary_parsimony (int n_sequences)
 {
@@ -78,7 +184,10 @@ new_binary_parsimony (int n_sequences)
   pars = (binary_parsimony) biomcmc_malloc (sizeof (struct binary_parsimony_struct));
   pars->ref_counter = 1;
   pars->external = new_binary_parsimony_datamatrix (n_sequences);
-  pars->internal = new_binary_parsimony_datamatrix (n_sequences - 1);
+  pars->internal = new_binary_parsimony_internal_datamatrix (n_sequences - 1, 0);
+  pars->previous = new_binary_parsimony_internal_datamatrix (n_sequences - 1, 0);
+  pars->moved = (int*) biomcmc_malloc ((n_sequences - 1) * sizeof (int));
+  pars->n_moved = pars->n_scored = 0;
   pars->score = NULL; 
   return pars;
 }
@@ -90,10 +199,10 @@ new_binary_parsimony_fixed_length (int n_sequences, int n_sites)
   pars = (binary_parsimony) biomcmc_malloc (sizeof (struct binary_parsimony_struct));
   pars->ref_counter = 1;
   pars->external = new_binary_parsimony_datamatrix_fixed_length (n_sequences, n_sites);
-  pars->internal = new_binary_parsimony_datamatrix_fixed_length (n_sequences - 1, n_sites);
-  if (pars->internal->freq) free (pars->internal->freq);
-  if (pars->internal->col_hash) free (pars->internal->col_hash);
-  if (pars->internal->occupancy) free (pars->internal->occupancy);
+  pars->internal = new_binary_parsimony_internal_datamatrix (n_sequences - 1, n_sites);
+  pars->previous = new_binary_parsimony_internal_datamatrix (n_sequences - 1, n_sites);
+  pars->moved = (int*) biomcmc_malloc ((n_sequences - 1) * sizeof (int));
+  pars->n_moved = pars->n_scored = 0;
   pars->score = (int*) biomcmc_malloc (pars->external->nchar * sizeof (int));
   return pars;
 }
@@ -104,6 +213,8 @@ del_binary_parsimony (binary_parsimony pars)
   if (pars) {
     if (--pars->ref_counter) return; /* some other place is using it, we cannot delete it yet */
     if (pars->score) free (pars->score);
+    if (pars->moved) free (pars->moved);
+    del_binary_parsimony_datamatrix (pars->previous);
     del_binary_parsimony_datamatrix (pars->internal);
     del_binary_parsimony_datamatrix (pars->external);
     free (pars);
@@ -148,11 +259,15 @@ update_binary_parsimony_from_topology (binary_parsimony pars, topology t, int *m
 int
 update_biparsdatmat_column_from_ones (binary_parsimony_datamatrix mrp, topology t, int *ones, bipartition bp, int *map)
 {
-  int j, nsp = 0;
+  int j, nsp = 0, n_ints = (mrp->ntax + 63) / 64;
+  uint64_t *present = mrp->col_bits, *in_split = mrp->col_bits + n_ints; // column as bitstrings, for its fingerprint
+  for (j=0; j < 2 * n_ints; j++) mrp->col_bits[j] = 0ULL;
   for (j=0; j < mrp->ntax; j++)  mrp->s[         j  ][mrp->i] = 3U; // all seqs are 'N' at first (a.k.a. {0,1}) -> absent from t in the end
   for (j=0; j < t->nleaves; j++) mrp->s[     map[j] ][mrp->i] = 1U; // species present in t start as 
   for (j=0; j < bp->n_ones; j++) mrp->s[map[ones[j]]][mrp->i] = 2U; // these species present in t are then {1} 
-  for (j=0; j < mrp->ntax; j++) if (mrp->s[j][mrp->i] == 2U) nsp++;
+  for (j=0; j < t->nleaves; j++) present[map[j] / 64]        |= 1ULL << (map[j] % 64);
+  for (j=0; j < bp->n_ones; j++) in_split[map[ones[j]] / 64] |= 1ULL << (map[ones[j]] % 64);
+  for (j=0; j < n_ints; j++) nsp += __builtin_popcountll (in_split[j]); // number of species with state 2U
   return nsp;
 }
 
@@ -160,66 +275,152 @@ void
 update_binary_parsimony_length (binary_parsimony pars, int new_columns_size)
 {
   int i, new_size = pars->external->i + new_columns_size + 1;
+  if (new_size <= pars->external->nchar) return; // enough space already
+  if (new_size < 2 * pars->external->nchar) new_size = 2 * pars->external->nchar; // amortised growth
   pars->external->nchar = pars->internal->nchar = new_size;
   pars->score = (int*) biomcmc_realloc ((int*) pars->score, new_size * sizeof (int));
   pars->external->freq = (int*) biomcmc_realloc ((int*) pars->external->freq, new_size * sizeof (int));
-  pars->external->col_hash = (uint32_t*) biomcmc_realloc ((uint32_t*) pars->external->col_hash, new_size * sizeof (uint32_t));
+  pars->external->col_hash = (uint64_t*) biomcmc_realloc ((uint64_t*) pars->external->col_hash, new_size * sizeof (uint64_t));
   pars->external->occupancy = (int*) biomcmc_realloc ((int*) pars->external->occupancy, new_size * sizeof (int));
   // notice that internal->freq and internal->col_hash are NOT updated (should be NULL); external->ntax != internal->nchar
   for (i = 0; i < pars->external->ntax; i++) pars->external->s[i] = (bool*) biomcmc_realloc((bool*) pars->external->s[i], new_size * sizeof (bool)); 
-  for (i = 0; i < pars->internal->ntax; i++) pars->internal->s[i] = (bool*) biomcmc_realloc((bool*) pars->internal->s[i], new_size * sizeof (bool));
+  update_binary_parsimony_datamatrix_planes_length (pars->external, new_size); // internal->s is not used, only its bit-planes
+  update_binary_parsimony_datamatrix_planes_length (pars->internal, new_size);
+  update_binary_parsimony_datamatrix_planes_length (pars->previous, new_size);
   for (i = pars->external->i; i < new_size; i++) pars->external->freq[i] = pars->external->occupancy[i] = 0;
 }
 
 void    
 update_binary_parsimony_datamatrix_column_if_new (binary_parsimony_datamatrix mrp)
 {
-  int i, j;
-  uint32_t hashv = hash_value_of_binary_parsimony_datamatrix_column (mrp, mrp->i);
+  int i, j, h;
+  uint64_t hashv = fingerprint_of_binary_parsimony_datamatrix_column (mrp);
 
-  for (i=0; i < mrp->i; i++) if ((hashv == mrp->col_hash[i]) && (mrp->occupancy[i] == mrp->occupancy[mrp->i])) { 
-    // same hash value and occupancy; may be identical or may be coincidence (collision)
-    for (j=0; (j < mrp->ntax) && (mrp->s[j][i] == mrp->s[j][mrp->i]); j++); // one line loop: finishes or halts when diff is found 
-    if (j == mrp->ntax) { mrp->freq[i]++; return; } // premature loop end means that they're distinct; here they're the same
+  if (2 * (mrp->i + 1) > mrp->index_size) update_binary_parsimony_datamatrix_index_size (mrp);
+  for (h = hashv & (mrp->index_size - 1); (i = mrp->col_index[h]) >= 0; h = (h + 1) & (mrp->index_size - 1)) // linear probing
+    if ((hashv == mrp->col_hash[i]) && (mrp->occupancy[i] == mrp->occupancy[mrp->i])) { 
+      // same fingerprint and occupancy; may be identical or may be coincidence (collision)
+      for (j=0; (j < mrp->ntax) && (mrp->s[j][i] == mrp->s[j][mrp->i]); j++); // one line loop: finishes or halts when diff is found 
+      if (j == mrp->ntax) { mrp->freq[i]++; return; } // premature loop end means that they're distinct; here they're the same
+    }
+  // empty slot reached: column was not found and thus is unique
+  update_binary_parsimony_datamatrix_planes_column (mrp, mrp->i);
+  mrp->col_index[h] = mrp->i;
+  mrp->freq[mrp->i] = 1;
+  mrp->col_hash[mrp->i++] = hashv;
+}
+
+void
+update_binary_parsimony_datamatrix_index_size (binary_parsimony_datamatrix mrp)
+{
+  int i, h, new_size = (mrp->index_size ? 2 * mrp->index_size : 1024);
+  while (new_size < 2 * (mrp->i + 1)) new_size *= 2;
+  mrp->index_size = new_size;
+  mrp->col_index = (int*) biomcmc_realloc ((int*) mrp->col_index, mrp->index_size * sizeof (int));
+  for (i = 0; i < mrp->index_size; i++) mrp->col_index[i] = -1;
+  for (i = 0; i < mrp->i; i++) { // rehash existing columns (fingerprints are kept)
+    for (h = mrp->col_hash[i] & (mrp->index_size - 1); mrp->col_index[h] >= 0; h = (h + 1) & (mrp->index_size - 1));
+    mrp->col_index[h] = i;
   }
-  if (i == mrp->i) { // column loop didn't stop prematurely (i.e. column was not found and thus is unique)
-    mrp->freq[mrp->i] = 1;
-    mrp->col_hash[mrp->i++] = hashv;
+}
+
+uint64_t 
+fingerprint_of_binary_parsimony_datamatrix_column (binary_parsimony_datamatrix mrp)
+{ // columns are fully determined by the species present and by those in the split, which are already bitstrings
+  return biomcmc_xxh64 (mrp->col_bits, 2 * ((mrp->ntax + 63) / 64) * sizeof (uint64_t), /*seed*/ (uint32_t) mrp->occupancy[mrp->i]);
+}
+
+void
+update_binary_parsimony_datamatrix_planes_length (binary_parsimony_datamatrix mrp, int n_sites)
+{
+  int i, k, n_words = ((n_sites + 63) / 64 + BinParsBlock - 1) / BinParsBlock * BinParsBlock;
+  if (n_words <= mrp->n_words) return;
+  for (i = 0; i < mrp->ntax; i++) {
+    mrp->s01[i] = (uint64_t*) biomcmc_realloc ((uint64_t*) mrp->s01[i], n_words * sizeof (uint64_t));
+    mrp->s10[i] = (uint64_t*) biomcmc_realloc ((uint64_t*) mrp->s10[i], n_words * sizeof (uint64_t));
+    for (k = mrp->n_words; k < n_words; k++) mrp->s01[i][k] = mrp->s10[i][k] = 0ULL;
+    if (!mrp->changed) continue;
+    mrp->changed[i] = (uint64_t*) biomcmc_realloc ((uint64_t*) mrp->changed[i], n_words * sizeof (uint64_t));
+    for (k = mrp->n_words; k < n_words; k++) mrp->changed[i][k] = 0ULL;
   }
+  mrp->n_words = n_words;
 }
 
-uint32_t 
-hash_value_of_binary_parsimony_datamatrix_column (binary_parsimony_datamatrix mrp, int idx)
-{ // very unoptimised, since s[i][idx] is 1,2,3 (less than 8 bits) ?
-  int i;
-  uint32_t hashv = biomcmc_hashint_salted ((uint32_t) mrp->s[0][idx], /*salt*/ 1);
-  for (i=1; i < mrp->ntax; i++) hashv = biomcmc_hashint_mix_salted (hashv, (uint32_t) mrp->s[i][idx], /*salt*/ 2);
-  return hashv;
+void
+update_binary_parsimony_datamatrix_planes_column (binary_parsimony_datamatrix mrp, int idx)
+{
+  int j, w = idx / 64;
+  uint64_t bit = 1ULL << (idx % 64);
+  for (j = 0; j < mrp->ntax; j++) {
+    if (mrp->s[j][idx] & 1U) mrp->s01[j][w] |= bit;
+    else                     mrp->s01[j][w] &= ~bit;
+    if (mrp->s[j][idx] & 2U) mrp->s10[j][w] |= bit;
+    else                     mrp->s10[j][w] &= ~bit;
+  }
+}
+
+void
+binary_parsimony_fitch_block (binary_parsimony pars, topol_node node, int nleaves, int w, double *delta)
+{ /* same as s = l & r, and if (!s) {score++; s = l | r} for each column, but over 64 x BinParsBlock columns at once */
+  int k, n_valid, id = node->id - nleaves;
+  uint64_t *l01, *l10, *r01, *r10, *s01, *s10, *c, a, b, x, mask;
+  /* id (0...nleaves) are leaves; (nleaves...2x nleaves-1) are internal nodes */
+  if (node->left->internal) { l01 = pars->internal->s01[node->left->id - nleaves]; l10 = pars->internal->s10[node->left->id - nleaves]; }
+  else                      { l01 = pars->external->s01[node->left->id];           l10 = pars->external->s10[node->left->id]; }
+  if (node->right->internal){ r01 = pars->internal->s01[node->right->id - nleaves];r10 = pars->internal->s10[node->right->id - nleaves]; }
+  else                      { r01 = pars->external->s01[node->right->id];          r10 = pars->external->s10[node->right->id]; }
+  s01 = pars->internal->s01[id] + w;
+  s10 = pars->internal->s10[id] + w;
+  c   = pars->internal->changed[id] + w;
+  l01 += w; l10 += w; r01 += w; r10 += w;
+
+  for (k = 0; k < BinParsBlock; k++) { /* vectorisable */
+    a = l01[k] & r01[k];
+    b = l10[k] & r10[k];
+    c[k] = ~(a | b); // 00 only arises with 10 & 01
+    s01[k] = a | (c[k] & (l01[k] | r01[k]));
+    s10[k] = b | (c[k] & (l10[k] | r10[k]));
+  }
+  for (k = 0; k < BinParsBlock; k++) {
+    n_valid = pars->external->i - 64 * (w + k); // columns beyond external->i are not data 
+    if (n_valid <= 0) break;
+    mask = (n_valid < 64) ? ((1ULL << n_valid) - 1) : ~0ULL;
+    if (!delta) for (x = c[k] & mask; x; x &= x - 1) pars->score[64 * (w + k) + __builtin_ctzll (x)]++; // one per set bit 
+    else { /* incremental: only columns that changed since previous state of this node */
+      a = pars->previous->changed[id][w + k];
+      for (x = c[k] & ~a & mask; x; x &= x - 1) binary_parsimony_column_score_change (pars, 64 * (w + k) + __builtin_ctzll (x),  1, delta);
+      for (x = a & ~c[k] & mask; x; x &= x - 1) binary_parsimony_column_score_change (pars, 64 * (w + k) + __builtin_ctzll (x), -1, delta);
+    }
+  }
+}
+
+void
+binary_parsimony_column_score_change (binary_parsimony pars, int col, int change, double *delta)
+{
+  int freq = pars->external->freq[col], occ = pars->external->occupancy[col];
+  delta[1] -= (pars->score[col] > 1) * freq;
+  pars->score[col] += change;
+  delta[1] += (pars->score[col] > 1) * freq;
+  delta[0] += change * freq;
+  delta[2] += (double) (change * freq) / (double) (occ);
+  delta[3] += (double) (change * freq) / (double) (pars->external->ntax - occ + 1);
 }
 
 int
 binary_parsimony_score_of_topology (binary_parsimony pars, topology t)
 {
-  int i,j, pars_score = 0, incompatible = 0;
+  int i, j, w, pars_score = 0, incompatible = 0, n_words = (pars->external->i + 63) / 64;
   double  incomplete = 0., complete = 0.;
-  bool s1, s2, intersection;
   if (!t->traversal_updated) update_topology_traversal (t);
   for (i=0; i < pars->external->i; i++) pars->score[i] = 0;  // external->i < external->nchar since may have duplicates
+  /* bit-sliced Fitch: each thread has its own set of columns, over all nodes */
 #ifdef _OPENMP
-#pragma omp parallel for shared(pars, t) \
-  private(i,j,s1,s2,intersection) reduction (+:pars_score, incompatible, incomplete)
+#pragma omp parallel for shared(pars, t, n_words) private(w,j) schedule(static)
 #endif
-  for (i=0; i < pars->external->i; i++) { // pthreads would go here
-    for (j=0; j < t->nleaves-2; j++) {
-      /* id (0...nleaves) are leaves; (nleaves...2x nleaves-1) are internal nodes */
-      if (t->postorder[j]->left->internal) s1 = pars->internal->s[t->postorder[j]->left->id - t->nleaves][i];
-      else s1 = pars->external->s[t->postorder[j]->left->id][i];
-      if (t->postorder[j]->right->internal) s2 = pars->internal->s[t->postorder[j]->right->id - t->nleaves][i];
-      else s2 = pars->external->s[t->postorder[j]->right->id][i];
-      intersection = s1 & s2; // 11, 01, 00, or 10 
-      if (!intersection) { pars->score[i]++; intersection = s1|s2; } //00 only arises with 10 & 01  
-      pars->internal->s[t->postorder[j]->id - t->nleaves][i] =  intersection;
-    } // for j in tree node
+  for (w = 0; w < n_words; w += BinParsBlock) for (j = 0; j < t->nleaves-2; j++) // root (postorder[nleaves-2]) is not scored
+    binary_parsimony_fitch_block (pars, t->postorder[j], t->nleaves, w, NULL);
+
+  for (i=0; i < pars->external->i; i++) { // fixed order, thus independent of number of threads
     pars_score += (pars->score[i] * pars->external->freq[i]); // only external has freqs
     if (pars->score[i] > 1) incompatible += pars->external->freq[i];
     incomplete += (double) (pars->score[i] * pars->external->freq[i]) / (double) (pars->external->occupancy[i]); // trees w more species are less penalised
@@ -229,31 +430,600 @@ binary_parsimony_score_of_topology (binary_parsimony pars, topology t)
   pars->costs[1] = incompatible;
   pars->costs[2] = incomplete;
   pars->costs[3] = complete;
+  pars->n_scored = pars->external->i;
+  pars->n_moved = 0;
   return pars_score;
 }
 
+int
+binary_parsimony_unrooted_score_of_topology (binary_parsimony pars, topology t)
+{ /* root is not scored by binary_parsimony_score_of_topology(); its step is where sets of its children are disjoint */
+  int k, n_valid, score, n_words = (pars->external->i + 63) / 64;
+  uint64_t *l01, *l10, *r01, *r10, x, mask;
+  topol_node l, r;
+
+  score = binary_parsimony_score_of_topology (pars, t);
+  l = t->root->left; 
+  r = t->root->right;
+  if (l->internal) { l01 = pars->internal->s01[l->id - t->nleaves]; l10 = pars->internal->s10[l->id - t->nleaves]; }
+  else             { l01 = pars->external->s01[l->id];              l10 = pars->external->s10[l->id]; }
+  if (r->internal) { r01 = pars->internal->s01[r->id - t->nleaves]; r10 = pars->internal->s10[r->id - t->nleaves]; }
+  else             { r01 = pars->external->s01[r->id];              r10 = pars->external->s10[r->id]; }
+  for (k = 0; k < n_words; k++) {
+    n_valid = pars->external->i - 64 * k;
+    mask = (n_valid < 64) ? ((1ULL << n_valid) - 1) : ~0ULL;
+    for (x = ~((l01[k] & r01[k]) | (l10[k] & r10[k])) & mask; x; x &= x - 1) score += pars->external->freq[64 * k + __builtin_ctzll (x)];
+  }
+  return score;
+}
+
+int
+binary_parsimony_score_of_moved_branches (binary_parsimony pars, topology t)
+{
+  int i, j, w, n_words = (pars->external->i + 63) / 64;
+  double delta[4] = {0., 0., 0., 0.};
+
+  if (!t->traversal_updated) update_topology_traversal (t);
+  if (pars->n_scored != pars->external->i) return binary_parsimony_score_of_topology (pars, t); // new columns since then
+  for (i = 0; i < 4; i++) pars->prev_costs[i] = pars->costs[i];
+  /* undone nodes (in postorder) will be overwritten, thus their current states are kept in pars->previous */
+  for (pars->n_moved = 0, i = 0; i < t->n_undone; i++) if (t->undone[i] != t->root) { // as in full scoring, root is skipped
+    pars->moved[pars->n_moved] = t->undone[i]->id - t->nleaves;
+    swap_binary_parsimony_internal_node (pars, pars->moved[pars->n_moved++]);
+  }
+#ifdef _OPENMP
+#pragma omp parallel for shared(pars, t, n_words) private(w,j) reduction(+:delta[:4]) schedule(static)
+#endif
+  for (w = 0; w < n_words; w += BinParsBlock) for (j = 0; j < pars->n_moved; j++) 
+    binary_parsimony_fitch_block (pars, t->nodelist[pars->moved[j] + t->nleaves], t->nleaves, w, delta);
+
+  for (i = 0; i < 4; i++) pars->costs[i] = pars->prev_costs[i] + delta[i];
+  return (int) pars->costs[0];
+}
+
 void
-pairwise_distances_from_binary_parsimony_datamatrix (binary_parsimony_datamatrix mrp, double **dist, int size_dist)
+accept_binary_parsimony_moved_branches (binary_parsimony pars, topology t)
+{
+  int i;
+  for (i = 0; i < t->n_undone; i++) t->undone[i]->d_done = true; /* update tree d_done, as in likelihood */
+  pars->n_moved = 0;
+}
+
+void
+undo_binary_parsimony_moved_branches (binary_parsimony pars)
+{
+  int i, k, n_valid, n_words = (pars->external->i + 63) / 64;
+  uint64_t *c, *prev, x, mask;
+  double delta[4] = {0., 0., 0., 0.}; // not used, since costs are restored from prev_costs
+
+  for (i = 0; i < pars->n_moved; i++) {
+    c = pars->internal->changed[pars->moved[i]];
+    prev = pars->previous->changed[pars->moved[i]];
+    for (k = 0; k < n_words; k++) {
+      n_valid = pars->external->i - 64 * k;
+      mask = (n_valid < 64) ? ((1ULL << n_valid) - 1) : ~0ULL;
+      for (x = c[k] & ~prev[k] & mask; x; x &= x - 1) binary_parsimony_column_score_change (pars, 64 * k + __builtin_ctzll (x), -1, delta);
+      for (x = prev[k] & ~c[k] & mask; x; x &= x - 1) binary_parsimony_column_score_change (pars, 64 * k + __builtin_ctzll (x),  1, delta);
+    }
+    swap_binary_parsimony_internal_node (pars, pars->moved[i]);
+  }
+  for (i = 0; i < 4; i++) pars->costs[i] = pars->prev_costs[i];
+  pars->n_moved = 0;
+}
+
+void
+swap_binary_parsimony_internal_node (binary_parsimony pars, int idx)
+{
+  uint64_t *tmp;
+  tmp = pars->internal->s01[idx];     pars->internal->s01[idx] = pars->previous->s01[idx];         pars->previous->s01[idx] = tmp;
+  tmp = pars->internal->s10[idx];     pars->internal->s10[idx] = pars->previous->s10[idx];         pars->previous->s10[idx] = tmp;
+  tmp = pars->internal->changed[idx]; pars->internal->changed[idx] = pars->previous->changed[idx]; pars->previous->changed[idx] = tmp;
+}
+
+int
+binary_parsimony_spr_hill_climbing (binary_parsimony pars, topology t, int max_moves)
+{
+  int i, delta;
+  bool lca;
+  topol_node prune, regraft;
+  bpars_spr spr;
+
+  binary_parsimony_score_of_topology (pars, t);
+  bpars_spr_init (&spr, pars, t);
+  for (i = 0; (max_moves <= 0) || (i < max_moves); i++) {
+    delta = bpars_spr_best_move (&spr, &prune, &regraft, &lca);
+    if (!delta) break; // local optimum 
+    if (lca) apply_spr_at_nodes_LCAprune    (t, prune, regraft, true);
+    else     apply_spr_at_nodes_notLCAprune (t, prune, regraft, true);
+    bpars_spr_update (&spr);
+  }
+  i = spr.score;
+  bpars_spr_free (&spr);
+  return i;
+}
+
+int
+binary_parsimony_ratchet (binary_parsimony pars, topology t, int n_iter, double reweight_prob)
+{
+  int i, iter, score, best_score, *freq = (int*) biomcmc_malloc (pars->external->i * sizeof (int));
+  topology best = new_topology (t->nleaves);
+
+  for (i = 0; i < pars->external->i; i++) freq[i] = pars->external->freq[i];
+  best_score = binary_parsimony_spr_hill_climbing (pars, t, 0);
+  copy_topology_from_topology (best, t);
+  for (iter = 0; iter < n_iter; iter++) {
+    for (i = 0; i < pars->external->i; i++) if (biomcmc_rng_unif () < reweight_prob) pars->external->freq[i] *= 2;
+    binary_parsimony_spr_hill_climbing (pars, t, 0); // perturbed landscape
+    for (i = 0; i < pars->external->i; i++) pars->external->freq[i] = freq[i];
+    score = binary_parsimony_spr_hill_climbing (pars, t, 0);
+    if (score < best_score) { best_score = score; copy_topology_from_topology (best, t); }
+  }
+  copy_topology_from_topology (t, best);
+  binary_parsimony_score_of_topology (pars, t); // costs[] of rooted tree, as after hill climbing
+  del_topology (best);
+  free (freq);
+  return best_score;
+}
+
+void
+bpars_spr_init (bpars_spr *spr, binary_parsimony pars, topology t)
+{
+  int i;
+  spr->pars = pars;
+  spr->t = t;
+  spr->n_words = (pars->external->i + 63) / 64;
+  spr->fbits = new_binary_parsimony_weight_planes (pars->external, &(spr->n_fbits));
+
+  spr->up01 = (uint64_t**) biomcmc_malloc (t->nnodes * sizeof (uint64_t*));
+  spr->up10 = (uint64_t**) biomcmc_malloc (t->nnodes * sizeof (uint64_t*));
+  for (i = 0; i < t->nnodes; i++) {
+    spr->up01[i] = (uint64_t*) biomcmc_malloc ((spr->n_words + 1) * sizeof (uint64_t)); // +1 avoids malloc(0)
+    spr->up10[i] = (uint64_t*) biomcmc_malloc ((spr->n_words + 1) * sizeof (uint64_t));
+  }
+  spr->delta    = (int*)        biomcmc_malloc (t->nnodes * sizeof (int));
+  spr->best_r   = (topol_node*) biomcmc_malloc (t->nnodes * sizeof (topol_node));
+  spr->best_lca = (bool*)       biomcmc_malloc (t->nnodes * sizeof (bool));
+#ifdef _OPENMP
+  spr->n_threads = omp_get_max_threads ();
+#else
+  spr->n_threads = 1;
+#endif
+  spr->ws = (bpars_spr_thread*) biomcmc_malloc (spr->n_threads * sizeof (bpars_spr_thread));
+  for (i = 0; i < spr->n_threads; i++) {
+    spr->ws[i].d01 = (uint64_t**) biomcmc_malloc (2 * t->nnodes * sizeof (uint64_t*));
+    spr->ws[i].d10 = spr->ws[i].d01 + t->nnodes;
+    spr->ws[i].dbuf = spr->ws[i].ubuf = NULL;
+    spr->ws[i].u01 = spr->ws[i].u10 = NULL;
+    spr->ws[i].stack = NULL;
+    spr->ws[i].depth = -1;
+  }
+  bpars_spr_update (spr);
+}
+
+#define bpars_down01(spr,node) ((node)->internal ? (spr)->pars->internal->s01[(node)->id - (spr)->t->nleaves] : (spr)->pars->external->s01[(node)->id])
+#define bpars_down10(spr,node) ((node)->internal ? (spr)->pars->internal->s10[(node)->id - (spr)->t->nleaves] : (spr)->pars->external->s10[(node)->id])
+
+void
+bpars_spr_update (bpars_spr *spr)
+{ /* sets above root's children are their sisters' sets; preorder scan == postorder[nleaves-3 -> 0] */
+  int i, j;
+  topol_node v, c;
+  spr->score = binary_parsimony_unrooted_score_of_topology (spr->pars, spr->t);
+  v = spr->t->root;
+  for (j = 0; j < spr->n_words; j++) {
+    spr->up01[v->left->id][j]  = bpars_down01(spr, v->right)[j]; spr->up10[v->left->id][j]  = bpars_down10(spr, v->right)[j];
+    spr->up01[v->right->id][j] = bpars_down01(spr, v->left)[j];  spr->up10[v->right->id][j] = bpars_down10(spr, v->left)[j];
+  }
+  for (i = spr->t->nleaves - 3; i >= 0; i--) for (v = spr->t->postorder[i], j = 0; j < 2; j++) {
+    c = (j ? v->right : v->left);
+    bpars_fitch_sets (spr->up01[v->id], spr->up10[v->id], bpars_down01(spr, c->sister), bpars_down10(spr, c->sister), 
+                      spr->up01[c->id], spr->up10[c->id], spr->n_words);
+  }
+  for (i = 0, j = 0; i < spr->t->nleaves; i++) if (j < spr->t->nodelist[i]->level) j = spr->t->nodelist[i]->level; // levels are from traversal
+  for (i = 0; i < spr->n_threads; i++) bpars_spr_thread_update (spr, spr->ws + i, j);
+}
+
+void
+bpars_spr_thread_update (bpars_spr *spr, bpars_spr_thread *ws, int depth)
+{ /* DFS stack has at most one pending sibling per level, plus the children of popped node */
+  int i, W = spr->n_words + 1, n_slots = depth + 4;
+  for (i = 0; i < spr->t->nnodes; i++) {
+    ws->d01[i] = bpars_down01(spr, spr->t->nodelist[i]);
+    ws->d10[i] = bpars_down10(spr, spr->t->nodelist[i]);
+  }
+  if (depth <= ws->depth) return;
+  ws->depth = depth;
+  ws->dbuf  = (uint64_t*)   biomcmc_realloc ((uint64_t*)   ws->dbuf,  2 * (depth + 1) * W * sizeof (uint64_t));
+  ws->ubuf  = (uint64_t*)   biomcmc_realloc ((uint64_t*)   ws->ubuf,  2 * n_slots * W * sizeof (uint64_t));
+  ws->u01   = (uint64_t**)  biomcmc_realloc ((uint64_t**)  ws->u01,   2 * n_slots * sizeof (uint64_t*));
+  ws->stack = (topol_node*) biomcmc_realloc ((topol_node*) ws->stack, n_slots * sizeof (topol_node));
+  ws->u10 = ws->u01 + n_slots;
+  for (i = 0; i < n_slots; i++) { ws->u01[i] = ws->ubuf + (2 * i) * W; ws->u10[i] = ws->ubuf + (2 * i + 1) * W; }
+}
+
+void
+bpars_spr_free (bpars_spr *spr)
+{
+  int i;
+  for (i = spr->t->nnodes - 1; i >= 0; i--) { free (spr->up01[i]); free (spr->up10[i]); }
+  free (spr->up01); 
+  free (spr->up10);
+  for (i = spr->n_threads - 1; i >= 0; i--) {
+    free (spr->ws[i].d01);
+    if (spr->ws[i].dbuf)  free (spr->ws[i].dbuf);
+    if (spr->ws[i].ubuf)  free (spr->ws[i].ubuf);
+    if (spr->ws[i].u01)   free (spr->ws[i].u01);
+    if (spr->ws[i].stack) free (spr->ws[i].stack);
+  }
+  free (spr->ws);
+  free (spr->delta);
+  free (spr->best_r);
+  free (spr->best_lca);
+  del_binary_parsimony_weight_planes (spr->fbits, spr->n_fbits);
+}
+
+void
+bpars_fitch_sets (uint64_t *a01, uint64_t *a10, uint64_t *b01, uint64_t *b10, uint64_t *x01, uint64_t *x10, int n_words)
 {
-  int i,j,k, idx, dist_int;
-  double dist_dbl;
-  for (j = 1; j < mrp->ntax; j++) for (i = 0; i < j; i++) {
-    idx = (j * (j-1)) /2 + i;
-    dist_int = 0; // {10}^{01}={11}   
-    dist_dbl = 0.;
-    for (k = 0; k < mrp->i; k++) if (((mrp->s[i][k] ^ mrp->s[j][k]) & 3U) == 3U) { // only {10} to {01} 
-      dist_int += mrp->freq[k];
-      dist_dbl += ((double) (mrp->freq[k]) / biomcmc_log1p ((double) (mrp->occupancy[i])));
+  int k;
+  uint64_t i01, i10, e;
+  for (k = 0; k < n_words; k++) { /* vectorisable */
+    i01 = a01[k] & b01[k];
+    i10 = a10[k] & b10[k];
+    e = ~(i01 | i10);
+    x01[k] = i01 | (e & (a01[k] | b01[k]));
+    x10[k] = i10 | (e & (a10[k] | b10[k]));
+  }
+}
+
+int
+bpars_insertion_cost (bpars_spr *spr, uint64_t *x01, uint64_t *x10, uint64_t *d01, uint64_t *d10, uint64_t *u01, uint64_t *u10)
+{ /* x is joined to Fitch set f of edge (if the tree were rooted there), adding one per column where x and f are disjoint */
+  int k, cost = 0;
+  uint64_t i01, i10, e;
+  for (k = 0; k < spr->n_words; k++) {
+    i01 = d01[k] & u01[k];
+    i10 = d10[k] & u10[k];
+    e = ~(i01 | i10);
+    i01 |= (e & (d01[k] | u01[k])); // edge set f
+    i10 |= (e & (d10[k] | u10[k]));
+    e = ~((x01[k] & i01) | (x10[k] & i10)); 
+    cost += binary_parsimony_weighted_popcount (e, spr->fbits, spr->n_fbits, k);
+  }
+  return cost;
+}
+
+int
+bpars_spr_best_move (bpars_spr *spr, topol_node *prune, topol_node *regraft, bool *lca)
+{
+  int i, best = 0, nnodes = spr->t->nnodes;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(spr->n_threads) shared(spr, nnodes) schedule(dynamic)
+#endif
+  for (i = 0; i < nnodes; i++) { /* each thread scans a set of prune nodes, with its own copy of the pruned tree */
+    int thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num ();
+#endif
+    spr->delta[i] = 0;
+    if (spr->t->nodelist[i] != spr->t->root) 
+      spr->delta[i] = bpars_spr_scan_prune (spr, spr->ws + thread, spr->t->nodelist[i], spr->best_r + i, spr->best_lca + i);
+  }
+
+  for (i = 0; i < nnodes; i++) if (spr->delta[i] < best) { // fixed order, thus independent of number of threads
+    best = spr->delta[i];
+    *prune = spr->t->nodelist[i];
+    *regraft = spr->best_r[i];
+    *lca = spr->best_lca[i];
+  }
+  return best;
+}
+
+/*! \brief pops node from DFS stack, whose set from above moves to the last slot (thus its slot can be reused by children) */
+#define bpars_stack_pop(ws,n_stack,spare) { uint64_t *tmp_; \
+  tmp_ = (ws)->u01[n_stack]; (ws)->u01[n_stack] = (ws)->u01[spare]; (ws)->u01[spare] = tmp_; \
+  tmp_ = (ws)->u10[n_stack]; (ws)->u10[n_stack] = (ws)->u10[spare]; (ws)->u10[spare] = tmp_; }
+
+int
+bpars_spr_scan_prune (bpars_spr *spr, bpars_spr_thread *ws, topol_node p, topol_node *regraft, bool *lca)
+{
+  int i, n_stack, orig, cost, best = 0, W = spr->n_words + 1, spare = ws->depth + 3;
+  size_t n_bytes = spr->n_words * sizeof (uint64_t);
+  topol_node q = p->up, s = p->sister, v, c, prev, root, child[2], *stack = ws->stack;
+  uint64_t *x01 = bpars_down01(spr, p), *x10 = bpars_down10(spr, p);
+
+  /* 1. subtree p is removed, its sister s takes the place of q = p->up; only sets of ancestors of q change (downwards) */
+  for (prev = q, c = s, v = q->up; v; prev = v, c = v, v = v->up) {
+    ws->d01[v->id] = ws->dbuf + (2 * v->level) * W; 
+    ws->d10[v->id] = ws->dbuf + (2 * v->level + 1) * W;
+    bpars_fitch_sets (ws->d01[c->id], ws->d10[c->id], ws->d01[prev->sister->id], ws->d10[prev->sister->id], 
+                      ws->d01[v->id], ws->d10[v->id], spr->n_words);
+  }
+  root = (q == spr->t->root) ? s : spr->t->root;
+
+  /* 2. sets from above, in preorder over pruned tree, and insertion cost of p on each edge */
+  if (root->internal) {
+    child[0] = (root->left  == q) ? s : root->left;
+    child[1] = (root->right == q) ? s : root->right;
+    memcpy (ws->u01[0], ws->d01[child[1]->id], n_bytes); memcpy (ws->u10[0], ws->d10[child[1]->id], n_bytes);
+    memcpy (ws->u01[1], ws->d01[child[0]->id], n_bytes); memcpy (ws->u10[1], ws->d10[child[0]->id], n_bytes);
+    /* original position is above s, where tree above is the one above q; or, if s is the root, at root's edge */
+    if (s == root) orig = bpars_insertion_cost (spr, x01, x10, ws->d01[child[0]->id], ws->d10[child[0]->id], ws->u01[0], ws->u10[0]);
+    else           orig = bpars_insertion_cost (spr, x01, x10, ws->d01[s->id], ws->d10[s->id], spr->up01[q->id], spr->up10[q->id]);
+    stack[0] = child[0]; stack[1] = child[1]; n_stack = 2;
+    while (n_stack) {
+      v = stack[--n_stack];
+      bpars_stack_pop (ws, n_stack, spare);
+      cost = bpars_insertion_cost (spr, x01, x10, ws->d01[v->id], ws->d10[v->id], ws->u01[spare], ws->u10[spare]) - orig;
+      if (cost < best) { best = cost; *regraft = v; *lca = false; }
+      if (!v->internal) continue;
+      child[0] = (v->left  == q) ? s : v->left;
+      child[1] = (v->right == q) ? s : v->right;
+      for (i = 0; i < 2; i++) {
+        bpars_fitch_sets (ws->u01[spare], ws->u10[spare], ws->d01[child[1-i]->id], ws->d10[child[1-i]->id], 
+                          ws->u01[n_stack], ws->u10[n_stack], spr->n_words);
+        stack[n_stack++] = child[i];
+      }
     }
-    /* different distances/scalings: */
-    dist[0][idx] = (double) (dist_int)/ (double) (mrp->freq_sum);
-    if (size_dist > 0) dist[1][idx] = dist_dbl;
-    if (size_dist > 1) {
-      int invalid_pairs = 0;
-      for (k = 0; k < mrp->i; k++) if ((mrp->s[i][k] + mrp->s[j][k]) == 6U) invalid_pairs++; 
-      dist[2][idx] = (double) (dist_int)/ ((double) (mrp->freq_sum - invalid_pairs) + 1); // avoid division by zero
+  }
+
+  /* 3. rest of tree (with set from above p) is moved into subtree p, which is not changed */
+  if (p->internal) {
+    x01 = spr->up01[p->id]; x10 = spr->up10[p->id];
+    memcpy (ws->u01[0], ws->d01[p->right->id], n_bytes); memcpy (ws->u10[0], ws->d10[p->right->id], n_bytes);
+    memcpy (ws->u01[1], ws->d01[p->left->id],  n_bytes); memcpy (ws->u10[1], ws->d10[p->left->id],  n_bytes);
+    orig = bpars_insertion_cost (spr, x01, x10, ws->d01[p->left->id], ws->d10[p->left->id], ws->u01[0], ws->u10[0]);
+    stack[0] = p->left; stack[1] = p->right; n_stack = 2;
+    while (n_stack) {
+      v = stack[--n_stack];
+      bpars_stack_pop (ws, n_stack, spare);
+      if ((v->up != p) && ((cost = bpars_insertion_cost (spr, x01, x10, ws->d01[v->id], ws->d10[v->id], ws->u01[spare], ws->u10[spare]) - orig) < best)) {
+        best = cost; *regraft = v; *lca = true; 
+      }
+      if (!v->internal) continue;
+      for (i = 0; i < 2; i++) {
+        c = (i ? v->right : v->left);
+        bpars_fitch_sets (ws->u01[spare], ws->u10[spare], ws->d01[c->sister->id], ws->d10[c->sister->id], 
+                          ws->u01[n_stack], ws->u10[n_stack], spr->n_words);
+        stack[n_stack++] = c;
+      }
     }
   }
+
+  /* pruned tree is the original one again, for next prune node */
+  for (v = q->up; v; v = v->up) { ws->d01[v->id] = bpars_down01(spr, v); ws->d10[v->id] = bpars_down10(spr, v); }
+  return best;
+}
+
+dna_parsimony
+new_dna_parsimony_from_alignment (alignment align)
+{
+  int i, j;
+  double unit[16];
+  dna_parsimony pars;
+
+  if (!align->is_aligned) biomcmc_error ("DNA parsimony needs aligned sequences (with site patterns)");
+  pars = (dna_parsimony) biomcmc_malloc (sizeof (struct dna_parsimony_struct));
+  pars->ref_counter = 1;
+  pars->ntax = align->ntax;
+  pars->npat = align->npat;
+  pars->freq  = (int*) biomcmc_malloc (pars->npat * sizeof (int));
+  pars->score = (int*) biomcmc_malloc (pars->npat * sizeof (int));
+  for (i = 0; i < pars->npat; i++) pars->freq[i] = align->pattern_freq[i];
+
+  pars->s = (uint8_t**) biomcmc_malloc ((2 * pars->ntax - 1) * sizeof (uint8_t*));
+  for (i = 0; i < 2 * pars->ntax - 1; i++) pars->s[i] = (uint8_t*) biomcmc_malloc_aligned (pars->npat * sizeof (uint8_t));
+  for (i = 0; i < pars->ntax; i++) {
+    store_ambiguity_code_at_leaf (pars->s[i], align->character->string[i], pars->npat);
+    for (j = 0; j < pars->npat; j++) if (!pars->s[i][j]) pars->s[i][j] = 15; // unknown chars are missing data
+  }
+  pars->sankoff = (double**) biomcmc_malloc ((pars->ntax - 1) * sizeof (double*));
+  for (i = 0; i < pars->ntax - 1; i++) pars->sankoff[i] = (double*) biomcmc_malloc_aligned (4 * pars->npat * sizeof (double));
+
+  for (i = 0; i < 16; i++) unit[i] = (double) ((i / 4) != (i % 4)); // Sankoff with unit costs is equivalent to Fitch
+  dna_parsimony_set_sankoff_costs (pars, unit);
+  return pars;
+}
+
+void
+del_dna_parsimony (dna_parsimony pars)
+{
+  int i;
+  if (!pars) return;
+  if (--pars->ref_counter) return; /* some other place is using it, we cannot delete it yet */
+  for (i = 2 * pars->ntax - 2; i >= 0; i--) if (pars->s[i]) free (pars->s[i]);
+  free (pars->s);
+  for (i = pars->ntax - 2; i >= 0; i--) if (pars->sankoff[i]) free (pars->sankoff[i]);
+  free (pars->sankoff);
+  if (pars->freq) free (pars->freq);
+  if (pars->score) free (pars->score);
+  free (pars);
+}
+
+void
+dna_parsimony_set_sankoff_costs (dna_parsimony pars, double *cost)
+{
+  int code, s, t;
+  for (s = 0; s < 16; s++) pars->cost[s] = cost[s];
+  /* leaves have only 16 possible state sets, thus minimum over their states can be precalculated (as likelihood tip kernels) */
+  for (code = 0; code < 16; code++) for (s = 0; s < 4; s++) {
+    pars->tip[4 * code + s] = code ? 1e300 : 0.;
+    for (t = 0; t < 4; t++) if ((code & (1 << t)) && (cost[4 * s + t] < pars->tip[4 * code + s])) pars->tip[4 * code + s] = cost[4 * s + t];
+  }
+}
+
+int
+dna_parsimony_fitch_score_of_topology (dna_parsimony pars, topology t)
+{
+  int i, j, b, pars_score = 0;
+
+  if (!t->traversal_updated) update_topology_traversal (t);
+  if (t->nleaves != pars->ntax) biomcmc_error ("DNA parsimony has %d sequences but tree has %d leaves", pars->ntax, t->nleaves);
+  for (i = 0; i < pars->npat; i++) pars->score[i] = 0;
+  /* each thread has its own blocks of patterns, over all nodes (postorder) */
+#ifdef _OPENMP
+#pragma omp parallel for shared(pars, t) private(b,j) schedule(static)
+#endif
+  for (b = 0; b < pars->npat; b += DnaParsBlock) for (j = 0; j < t->nleaves - 1; j++)
+    dna_parsimony_fitch_range (pars, t->postorder[j], b, BIOMCMC_MIN (b + DnaParsBlock, pars->npat));
+
+  for (i = 0; i < pars->npat; i++) pars_score += pars->score[i] * pars->freq[i];
+  return pars_score;
+}
+
+void
+dna_parsimony_fitch_range (dna_parsimony pars, topol_node node, int first, int last)
+{ /* state sets are IUPAC codes, thus intersection and union are AND and OR; vectorisable over patterns */
+  int i;
+  uint8_t a, *l = pars->s[node->left->id], *r = pars->s[node->right->id], *x = pars->s[node->id];
+  for (i = first; i < last; i++) {
+    a = l[i] & r[i];
+    pars->score[i] += (a == 0);
+    x[i] = a ? a : (l[i] | r[i]);
+  }
+}
+
+double
+dna_parsimony_sankoff_score_of_topology (dna_parsimony pars, topology t)
+{
+  int i, j, b, n = pars->npat;
+  double pars_score = 0., min, *x;
+
+  if (!t->traversal_updated) update_topology_traversal (t);
+  if (t->nleaves != pars->ntax) biomcmc_error ("DNA parsimony has %d sequences but tree has %d leaves", pars->ntax, t->nleaves);
+#ifdef _OPENMP
+#pragma omp parallel for shared(pars, t) private(b,j) schedule(static)
+#endif
+  for (b = 0; b < pars->npat; b += DnaParsBlock) for (j = 0; j < t->nleaves - 1; j++)
+    dna_parsimony_sankoff_range (pars, t->postorder[j], b, BIOMCMC_MIN (b + DnaParsBlock, pars->npat));
+
+  x = pars->sankoff[t->root->id - t->nleaves];
+  for (i = 0; i < n; i++) { // fixed order, thus independent of number of threads
+    for (min = x[i], j = 1; j < 4; j++) if (x[j * n + i] < min) min = x[j * n + i];
+    pars_score += min * (double) pars->freq[i];
+  }
+  return pars_score;
+}
+
+void
+dna_parsimony_sankoff_range (dna_parsimony pars, topol_node node, int first, int last)
+{
+  int i, s, n = pars->npat;
+  double *x = pars->sankoff[node->id - pars->ntax];
+  for (s = 0; s < 4; s++) for (i = first; i < last; i++) x[s * n + i] = 0.;
+  dna_parsimony_sankoff_child (pars, x, node->left,  first, last);
+  dna_parsimony_sankoff_child (pars, x, node->right, first, last);
+}
+
+void
+dna_parsimony_sankoff_child (dna_parsimony pars, double *x, topol_node child, int first, int last)
+{
+  int i, s, t, n = pars->npat;
+  double *c, *v, m;
+  if (!child->internal) { /* lookup of min over leaf states, from state set */
+    for (s = 0; s < 4; s++) for (i = first; i < last; i++) x[s * n + i] += pars->tip[4 * pars->s[child->id][i] + s];
+    return;
+  }
+  v = pars->sankoff[child->id - pars->ntax];
+  for (s = 0; s < 4; s++) {
+    c = pars->cost + 4 * s;
+    for (i = first; i < last; i++) { /* vectorisable over patterns, since arrays are state-major */
+      m = c[0] + v[i];
+      for (t = 1; t < 4; t++) m = (c[t] + v[t * n + i] < m) ? c[t] + v[t * n + i] : m;
+      x[s * n + i] += m;
+    }
+  }
+}
+
+void
+pairwise_distances_from_binary_parsimony_datamatrix (binary_parsimony_datamatrix mrp, double **dist, int size_dist)
+{
+  int k, n_fbits, n_tiles = (mrp->ntax + BinParsTile - 1) / BinParsTile;
+  uint64_t **fbits = new_binary_parsimony_weight_planes (mrp, &n_fbits);
+  double *weight = NULL;
+
+  if (size_dist > 0) { /* non-integer weights, summed only over columns in conflict */
+    weight = (double*) biomcmc_malloc ((mrp->i + 1) * sizeof (double));
+    for (k = 0; k < mrp->i; k++) weight[k] = (double) (mrp->freq[k]) / biomcmc_log1p ((double) (mrp->occupancy[k]));
+  }
+  /* tiles of BinParsTile x BinParsTile taxon pairs, upper triangle only */
+#ifdef _OPENMP
+#pragma omp parallel for shared(mrp, dist, size_dist, fbits, n_fbits, weight, n_tiles) private(k) schedule(dynamic)
+#endif
+  for (k = 0; k < n_tiles * n_tiles; k++) if ((k / n_tiles) <= (k % n_tiles))
+    pairwise_distances_binary_parsimony_tile (mrp, dist, size_dist, fbits, n_fbits, weight, (k / n_tiles) * BinParsTile, (k % n_tiles) * BinParsTile);
+
+  if (weight) free (weight);
+  del_binary_parsimony_weight_planes (fbits, n_fbits);
+}
+
+void
+pairwise_distances_binary_parsimony_tile (binary_parsimony_datamatrix mrp, double **dist, int size_dist, uint64_t **fbits, 
+                                          int n_fbits, double *weight, int i0, int j0)
+{
+  int i, j, w, w0, w1, idx, n_words = (mrp->i + 63) / 64, i1 = i0 + BinParsTile, j1 = j0 + BinParsTile;
+  int conflict[BinParsTile * BinParsTile], invalid[BinParsTile * BinParsTile];
+  double conflict_dbl[BinParsTile * BinParsTile];
+  uint64_t *a01, *a10, *b01, *b10, x;
+
+  if (i1 > mrp->ntax) i1 = mrp->ntax;
+  if (j1 > mrp->ntax) j1 = mrp->ntax;
+  for (i = 0; i < BinParsTile * BinParsTile; i++) { conflict[i] = invalid[i] = 0; conflict_dbl[i] = 0.; }
+  /* columns in chunks, such that bit-planes of all taxa in tile stay in cache */
+  for (w0 = 0; w0 < n_words; w0 += BinParsChunk) {
+    w1 = (w0 + BinParsChunk < n_words) ? w0 + BinParsChunk : n_words;
+    for (j = j0; j < j1; j++) for (i = i0; (i < i1) && (i < j); i++) {
+      idx = (j - j0) * BinParsTile + (i - i0);
+      a01 = mrp->s01[i]; a10 = mrp->s10[i]; b01 = mrp->s01[j]; b10 = mrp->s10[j];
+      for (w = w0; w < w1; w++) {
+        x = (a01[w] ^ b01[w]) & (a10[w] ^ b10[w]) & (a01[w] ^ a10[w]); // only {10} to {01}
+        conflict[idx] += binary_parsimony_weighted_popcount (x, fbits, n_fbits, w);
+        if (weight) for (; x; x &= x - 1) conflict_dbl[idx] += weight[64 * w + __builtin_ctzll (x)];
+        if (size_dist > 1) invalid[idx] += binary_parsimony_weighted_popcount (a01[w] & a10[w] & b01[w] & b10[w], fbits, n_fbits, w); // both {11}
+      }
+    }
+  }
+  /* different distances/scalings: */
+  for (j = j0; j < j1; j++) for (i = i0; (i < i1) && (i < j); i++) {
+    idx = (j - j0) * BinParsTile + (i - i0);
+    dist[0][(j * (j-1)) /2 + i] = (double) (conflict[idx]) / (double) (mrp->freq_sum);
+    if (size_dist > 0) dist[1][(j * (j-1)) /2 + i] = conflict_dbl[idx];
+    if (size_dist > 1) dist[2][(j * (j-1)) /2 + i] = (double) (conflict[idx]) / ((double) (mrp->freq_sum - invalid[idx]) + 1); // avoid division by zero
+  }
+}
+
+uint64_t**
+new_binary_parsimony_weight_planes (binary_parsimony_datamatrix mrp, int *n_fbits)
+{
+  int i, b, max_freq = 0, n_words = (mrp->i + 63) / 64 + 1; // +1 avoids malloc(0)
+  uint64_t **fbits;
+  for (i = 0; i < mrp->i; i++) if (mrp->freq[i] > max_freq) max_freq = mrp->freq[i];
+  for (*n_fbits = 0; max_freq >> (*n_fbits); (*n_fbits)++);
+  fbits = (uint64_t**) biomcmc_malloc ((*n_fbits + 1) * sizeof (uint64_t*));
+  for (b = 0; b < *n_fbits; b++) {
+    fbits[b] = (uint64_t*) biomcmc_malloc (n_words * sizeof (uint64_t));
+    for (i = 0; i < n_words; i++) fbits[b][i] = 0ULL;
+  }
+  for (i = 0; i < mrp->i; i++) for (b = 0; b < *n_fbits; b++) if ((mrp->freq[i] >> b) & 1) fbits[b][i / 64] |= 1ULL << (i % 64);
+  return fbits;
+}
+
+void
+del_binary_parsimony_weight_planes (uint64_t **fbits, int n_fbits)
+{
+  int b;
+  if (!fbits) return;
+  for (b = n_fbits - 1; b >= 0; b--) free (fbits[b]);
+  free (fbits);
+}
+
+static inline int
+binary_parsimony_weighted_popcount (uint64_t x, uint64_t **fbits, int n_fbits, int w)
+{
+  int b, count = 0;
+  for (b = 0; b < n_fbits; b++) count += __builtin_popcountll (x & fbits[b][w]) << b;
+  return count;
 }
 
 /* Extra ideas/todo:
@@ -20,24 +20,55 @@
 #define _biomcmc_parsimony_
 
 #include "topology_distance.h"
+#include "alignment.h"
+
+/*! \brief number of 64-bit words of bit-planes scored together (thus a multiple of SIMD vector lengths) */
+#define BinParsBlock 8
+/*! \brief number of site patterns of DNA parsimony scored together by a thread (a multiple of SIMD vector lengths) */
+#define DnaParsBlock 1024
+/*! \brief number of taxa (squared: number of pairs) in each block of pairwise distance calculation */
+#define BinParsTile 32
+/*! \brief number of 64-bit words (columns/64) in each chunk of pairwise distance calculation, for cache reuse */
+#define BinParsChunk 256
 
 typedef struct binary_parsimony_datamatrix_struct* binary_parsimony_datamatrix; 
 typedef struct binary_parsimony_struct* binary_parsimony;
+typedef struct dna_parsimony_struct* dna_parsimony;
 
 /*! \brief used by matrix representation with parsimony (01 10 11 sequences) */
 struct binary_parsimony_datamatrix_struct {
   int ntax, nchar, i;  /*!< \brief number of taxa, distinct sites (patterns), and index to current (last) column */
   bool **s;            /*!< \brief 1 (01) and 2 (10) are the two binary states, with 3 (11) being undetermined */
+  uint64_t **s01, **s10; /*!< \brief bit-sliced s: bit (k%64) of s01[j][k/64] is set iff s[j][k] has 01 (idem for s10) */
+  int n_words;         /*!< \brief number of 64-bit words per bit-plane (a multiple of BinParsBlock) */
+  uint64_t **changed;  /*!< \brief (internal nodes only) bit-plane of columns where Fitch's intersection is empty, i.e. with a cost */
   int *freq, freq_sum; /*!< \brief frequency of pattern. */
   int *occupancy;      /*!< \brief how many species represented by each bipartition */
-  uint32_t *col_hash;  /*!< \brief hash value of each column, to speed up comparisons */
+  uint64_t *col_hash;  /*!< \brief 64-bit fingerprint of each column (with its occupancy), to speed up comparisons */
+  int *col_index, index_size; /*!< \brief open-addressing hash table of columns, indexed by fingerprint (-1 if empty) */
+  uint64_t *col_bits;  /*!< \brief species present in, and in the split of, the current column (bitstrings) */
   int ref_counter;     /*!< \brief how many places have a pointer to this instance */
 };
 
 struct binary_parsimony_struct {
   int *score;      /*!< \brief parsimony score per pattern */
   binary_parsimony_datamatrix external, internal; /*!< \brief binary matrices for leaves and for internal nodes */
-  double costs[4];
+  binary_parsimony_datamatrix previous; /*!< \brief internal nodes before binary_parsimony_score_of_moved_branches(), for undo */
+  int *moved, n_moved; /*!< \brief internal nodes (id - nleaves) rescored by last binary_parsimony_score_of_moved_branches() */
+  int n_scored;        /*!< \brief number of columns in last full scoring (incremental rescoring is only possible with same data) */
+  double costs[4], prev_costs[4]; /*!< \brief score, incompatible columns, and weighted scores (current and before moves) */
+  int ref_counter; /*!< \brief how many places have a pointer to this instance */
+};
+
+/*! \brief nucleotide (multistate) parsimony over alignment site patterns, with Fitch and Sankoff algorithms */
+struct dna_parsimony_struct {
+  int ntax, npat;  /*!< \brief number of leaves and of site patterns (columns) */
+  uint8_t **s;     /*!< \brief 4-bit state sets (A=0001 C=0010 G=0100 T=1000, ambiguous as IUPAC) of leaves and internal nodes */
+  int *freq;       /*!< \brief pattern frequency, from alignment_struct::pattern_freq */
+  int *score;      /*!< \brief Fitch (unweighted) score per pattern */
+  double **sankoff; /*!< \brief Sankoff cost of each state at internal nodes (state-major: [s * npat + pattern]) */
+  double cost[16]; /*!< \brief Sankoff substitution costs cost[4 * from + to], in ACGT order */
+  double tip[64];  /*!< \brief Sankoff cost for each of 16 leaf state sets and 4 parent states: min_{t in set} cost[4 * s + t] */
   int ref_counter; /*!< \brief how many places have a pointer to this instance */
 };
 
@@ -50,6 +81,39 @@ void del_binary_parsimony (binary_parsimony pars);
 /*! \brief given a map[] with location in sptree of gene tree leaves, update binary matrix with splits from genetree */
 void update_binary_parsimony_from_topology (binary_parsimony pars, topology t, int *map, int n_species);
 int binary_parsimony_score_of_topology (binary_parsimony pars, topology t);
+/*! \brief binary_parsimony_score_of_topology() plus the (weighted) steps at the root node, i.e. the score of the unrooted
+ * tree, which does not depend on the root location; pars->costs[] are those of the rooted tree */
+int binary_parsimony_unrooted_score_of_topology (binary_parsimony pars, topology t);
+/*! \brief parsimony score after a topology change (SPR, NNI etc.), rescoring only nodes in t->undone i.e. those with
+ * d_done == false, and reusing internal states from previous (full or incremental) scoring of same columns.
+ * Must be followed by either accept_binary_parsimony_moved_branches() or undo_binary_parsimony_moved_branches() */
+int binary_parsimony_score_of_moved_branches (binary_parsimony pars, topology t);
+/*! \brief keep states from binary_parsimony_score_of_moved_branches(), and set d_done of rescored nodes (like 
+ * accept_likelihood_moved_branches() ) */
+void accept_binary_parsimony_moved_branches (binary_parsimony pars, topology t);
+/*! \brief restore internal states, scores and costs from before binary_parsimony_score_of_moved_branches(); can be called 
+ * before or after topology_undo_random_move() */
+void undo_binary_parsimony_moved_branches (binary_parsimony pars);
+/*! \brief SPR hill-climbing (best improvement) of t over all prune subtrees and regraft edges, in both directions (moving
+ * the subtree or its complement), scored by incremental insertion costs. Stops after max_moves (if positive) or at a local 
+ * optimum, returning the unrooted parsimony score (see binary_parsimony_unrooted_score_of_topology(), since moves can
+ * change the root), while pars->costs[] are those of the final rooted tree */
+int binary_parsimony_spr_hill_climbing (binary_parsimony pars, topology t, int max_moves);
+/*! \brief parsimony ratchet (Nixon 1999): each iteration doubles the weight of columns with probability reweight_prob, 
+ * climbs to a local optimum, and then climbs again from there with original weights. t is replaced by best tree found, and its unrooted score is returned */
+int binary_parsimony_ratchet (binary_parsimony pars, topology t, int n_iter, double reweight_prob);
+/*! \brief nucleotide parsimony for alignment patterns (leaf ids of trees are alignment taxa indexes), with unit Sankoff costs */
+dna_parsimony new_dna_parsimony_from_alignment (alignment align);
+void del_dna_parsimony (dna_parsimony pars);
+/*! \brief Fitch parsimony score over 4-bit state sets, weighted by pattern frequencies */
+int dna_parsimony_fitch_score_of_topology (dna_parsimony pars, topology t);
+/*! \brief substitution costs cost[4 * from + to] (ACGT order) for Sankoff algorithm, e.g. transversions costlier than transitions */
+void dna_parsimony_set_sankoff_costs (dna_parsimony pars, double *cost);
+/*! \brief Sankoff (weighted) parsimony score, weighted by pattern frequencies */
+double dna_parsimony_sankoff_score_of_topology (dna_parsimony pars, topology t);
+/*! \brief distances between taxa, as the (weighted) number of columns where they disagree; dist[k] are lower-triangular 
+ * matrices, with dist[0] normalised by the total weight; dist[1] (if n_dist > 0) weighted by column occupancy; and 
+ * dist[2] (if n_dist > 1) normalised by the weight of columns where not both are missing */
 void pairwise_distances_from_binary_parsimony_datamatrix (binary_parsimony_datamatrix mrp, double **dist, int n_dist);
 
 #endif
@@ -18,51 +18,84 @@
 
 #include "phylogeny.h"
 
+const int LikPatternBlock = 64; /* patterns per work unit: all nodes are visited for a block before moving to the next */
+const int LikScaleExponent = 256, LikScaleExponentSingle = 64;
+
 node_likelihood new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle);
-void            del_node_likelihood (node_likelihood l, int n_cat, int n_pat);
+void            del_node_likelihood (node_likelihood l);
 lk_vector new_lk_vector (int n_cat, int n_pat, int n_state);
-void      del_lk_vector (lk_vector u, int n_cat, int n_pat);
+void      del_lk_vector (lk_vector u);
+void phylogeny_first_touch_lk_vectors (phylogeny phy);
+/*! \brief store all lk_vectors of node in single or double precision (discarding their values) */
+void node_likelihood_set_precision (node_likelihood l, int n_elem, bool single);
 
-void init_evolution_model_parameters (evolution_model m, double kappa, double alpha, double beta, double *pi);
 void init_eigenvectors_from_eq_frequencies (double **z1, double **z2, double *pi);
+void init_eigenvectors_equal_input (double **z1, double **z2, double *pi, int n_state);
+void update_Q_matrix_vectors (evolution_model m);
+void tip_lookup_table_from_Qv (double *tip, double *Qv, int n_cat);
+branch_pmatrix new_branch_pmatrix (int ntax, int nnodes, int n_cat, int n_state);
+void del_branch_pmatrix (branch_pmatrix pm);
+/*! \brief phylogeny over patterns pattern[0...npat) of alignment (or its first npat, if pattern is NULL) with frequencies
+ * freq[], and initial model parameters from pairwise distances */
+phylogeny new_phylogeny_from_alignment_patterns (alignment align, int *pattern, int *freq, int npat, int n_cat, int n_state, 
+                                                 int n_cycle, distance_matrix dist);
 
 phylogeny
 new_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cycle, distance_matrix external_dist)
 {
-  int i, j, k, l;
   phylogeny phy;
   distance_matrix dist;
-  double alpha, beta;
 
   if (!align->is_aligned) biomcmc_error ("can't build a phylogeny, sequences not aligned");
+  if (n_state != 4) biomcmc_error ("phylogeny from alignment implemented only for DNA (n_state = 4), not %d states", n_state);
 
   if (external_dist == NULL) dist = new_distance_matrix_from_alignment (align);
   else dist = external_dist;
 
+  phy = new_phylogeny_from_alignment_patterns (align, NULL, align->pattern_freq, align->npat, n_cat, n_state, n_cycle, dist);
+  phy->align_filename = align->filename; /* inherit original file name information */
+  align->filename = NULL;
+
+  if (external_dist == NULL) del_distance_matrix (dist);
+  return phy;
+}
+
+phylogeny
+new_phylogeny_from_alignment_patterns (alignment align, int *pattern, int *freq, int npat, int n_cat, int n_state, int n_cycle, 
+                                       distance_matrix dist)
+{
+  int i, j, k;
+  phylogeny phy;
+  double alpha, beta;
+  char *seq = NULL;
+
   if (dist->mean_K2P_dist < 1e-16) biomcmc_error ("average pairwise distance is too small");
   if (dist->var_K2P_dist  < 1e-16) biomcmc_error ("variance in pairwise distances is too small");
   beta  = dist->mean_K2P_dist / dist->var_K2P_dist;
   alpha = beta * dist->mean_K2P_dist;
 
-  phy = new_phylogeny (align->ntax, n_cat, align->npat, n_state, n_cycle);
+  phy = new_phylogeny (align->ntax, n_cat, npat, n_state, n_cycle);
   init_evolution_model_parameters (phy->model, dist->mean_R, alpha, beta, dist->freq);
-  phy->nsites = align->nchar; /* original number of sites (may be used to calculate some constant like gamma rates) */
-
-  phy->align_filename = align->filename; /* inherit original file name information */
-  align->filename = NULL;
-
-  for (i = 0; i < phy->ntax; i++) { /* store "trivial likelihood" at first rate category lk[0] */
-    store_likelihood_info_at_leaf (phy->l[i]->d[0]->lk[0], align->character->string[i], align->npat, n_state);
-    for (j=1; j<n_cat; j++) for (k=0; k < phy->npat; k++) { 
-      for (l=0; l < 4; l++) phy->l[i]->d[0]->lk[j][k][l] = phy->l[i]->d[0]->lk[0][k][l]; /* copy to other categories */
-      phy->l[i]->d[0]->lnmax[j][k] = 0.; /* log (scale factor) is zero since tips are already scaled */
+  for (phy->nsites = 0, i = 0; i < npat; i++) phy->nsites += freq[i]; /* original number of sites (may be used to calculate some constant like gamma rates) */
+
+  if (pattern) seq = (char*) biomcmc_malloc ((npat + 1) * sizeof (char));
+  if (n_state == 4) phy->tip = (uint8_t**) biomcmc_malloc (phy->ntax * sizeof (uint8_t*));
+  for (i = 0; i < phy->ntax; i++) { 
+    if (pattern) for (j = 0; j < npat; j++) seq[j] = align->character->string[i][pattern[j]];
+    else seq = align->character->string[i];
+    /* store "trivial likelihood", replicated over all rate categories */
+    store_likelihood_info_at_leaf (phy->l[i]->d[0]->lk, seq, npat, n_cat, n_state);
+    /* scale factor is 2^0 since tips are already scaled */
+    for (k = 0; k < phy->npat * n_cat; k++) phy->l[i]->d[0]->scale[k] = 0;
+    if (n_state == 4) { /* leaves can also be described by their ambiguity codes, which index precalculated Q x leaf */
+      phy->tip[i] = (uint8_t*) biomcmc_malloc (phy->npat * sizeof (uint8_t));
+      store_ambiguity_code_at_leaf (phy->tip[i], seq, phy->npat);
     }
   }
+  if (pattern) free (seq);
 
-  for (i = 0; i < phy->npat; i++) phy->weight[i] = (double) align->pattern_freq[i];
-
-  if (external_dist == NULL) del_distance_matrix (dist);
-
+  for (i = 0; i < phy->npat; i++) phy->weight[i] = (double) freq[i];
+  phylogeny_update_leaf_site_repeats (phy);
   return phy;
 }
 
@@ -82,16 +115,42 @@ new_phylogeny (int n_tax, int n_cat, int n_pat, int n_state, int n_cycle)
   phy->nnodes = 2 * n_tax - 1; 
   phy->lk_current = phy->lk_proposal = phy->lk_accepted = 0.;
   phy->align_filename = NULL;
+  phy->tip = NULL; /* only created from alignment */
+  phy->pmat = NULL; /* integrate over branch lengths by default */
+  phy->site_repeats = true;
+  phy->n_cycle = n_cycle + 2;
+  phy->checkpoint = NULL; /* all internal nodes store their partial likelihoods */
+  phy->block_buffer = NULL;
+  phy->block_view = NULL;
+  phy->n_block_buffer = 0;
+  phy->recompute = NULL;
+  phy->recalculate = NULL;
+  phy->n_recompute = 0;
+  phy->single_precision = false;
+  phy->scale_exponent = LikScaleExponent;
 
   phy->l = (node_likelihood*) biomcmc_malloc ((phy->nnodes) * sizeof (node_likelihood));
   phy->weight   = (double*) biomcmc_malloc (n_pat * sizeof (double)); /* frequency of pattern */
-  phy->pat_lnLk = (double*) biomcmc_malloc (n_pat * sizeof (double)); /* log likelihood of pattern */
+  phy->pat_lnLk = (double*) biomcmc_malloc_aligned (n_pat * sizeof (double)); /* log likelihood of pattern */
+  phy->block_lnLk = (double*) biomcmc_malloc (((n_pat + LikPatternBlock - 1) / LikPatternBlock) * sizeof (double));
+  phy->slice = NULL;
 
   phy->model = new_evolution_model (n_cat, n_state);
+  likelihood_kernel_init (); /* choose SIMD instruction set once, according to CPU */
 
   /* internal nodes must have at least one extra partial likelihood vectors (for proposal state) */
   for (i = 0; i < n_tax; i++)  phy->l[i] = new_node_likelihood (n_cat, n_pat, n_state, 1); /* leaf */
-  for (; i < phy->nnodes; i++) phy->l[i] = new_node_likelihood (n_cat, n_pat, n_state, n_cycle + 2); /* internal node */
+  for (; i < phy->nnodes; i++) phy->l[i] = new_node_likelihood (n_cat, n_pat, n_state, phy->n_cycle); /* internal node */
+
+  /* leaves have no repeats unless phylogeny_update_leaf_site_repeats() is called (e.g. if created from alignment) */
+  phy->leaf_rep = (uint8_t**) biomcmc_malloc (n_tax * sizeof (uint8_t*));
+  for (i = 0; i < n_tax; i++) {
+    phy->leaf_rep[i] = (uint8_t*) biomcmc_malloc (n_pat * sizeof (uint8_t));
+    memcpy (phy->leaf_rep[i], phy->l[i]->d[0]->rep, n_pat * sizeof (uint8_t));
+  }
+
+  phylogeny_set_threads (phy, 0);
+  phylogeny_first_touch_lk_vectors (phy);
 
   return phy;
 }
@@ -103,16 +162,127 @@ del_phylogeny (phylogeny phy)
   if (!phy) return;
   if (phy->weight)         free (phy->weight);
   if (phy->pat_lnLk)       free (phy->pat_lnLk);
+  if (phy->block_lnLk)     free (phy->block_lnLk);
+  if (phy->slice)          free (phy->slice);
   if (phy->align_filename) free (phy->align_filename);
+  if (phy->checkpoint)     free (phy->checkpoint);
+  if (phy->recompute)      free (phy->recompute);
+  if (phy->recalculate)    free (phy->recalculate);
+  if (phy->block_buffer) {
+    for (i = phy->n_block_buffer - 1; i >= 0; i--) del_lk_vector (phy->block_buffer[i]);
+    free (phy->block_buffer);
+  }
+  if (phy->block_view)     free (phy->block_view);
+  if (phy->tip) {
+    for (i = phy->ntax - 1; i >= 0; i--) if (phy->tip[i]) free (phy->tip[i]);
+    free (phy->tip);
+  }
+  if (phy->leaf_rep) {
+    for (i = phy->ntax - 1; i >= 0; i--) if (phy->leaf_rep[i]) free (phy->leaf_rep[i]);
+    free (phy->leaf_rep);
+  }
+  del_branch_pmatrix (phy->pmat);
   if (!phy->model) biomcmc_error ("I cannot deallocate phylogenetic memory since I lost the model");
   if (phy->l) {
-    for (i = phy->nnodes - 1; i >= 0; i--) del_node_likelihood (phy->l[i], phy->model->nrates, phy->npat);
+    for (i = phy->nnodes - 1; i >= 0; i--) del_node_likelihood (phy->l[i]);
     free (phy->l);
   }
   del_evolution_model (phy->model);
   free (phy);
 }
 
+partitioned_phylogeny
+new_partitioned_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cycle)
+{
+  int i, j, site, npat, *local, *pattern, *freq, first = 0, last = align->nchar - 1;
+  partitioned_phylogeny pp;
+  distance_matrix dist;
+
+  if (!align->is_aligned) biomcmc_error ("can't build a phylogeny, sequences not aligned");
+  if (n_state != 4) biomcmc_error ("phylogeny from alignment implemented only for DNA (n_state = 4), not %d states", n_state);
+
+  pp = (partitioned_phylogeny) biomcmc_malloc (sizeof (struct partitioned_phylogeny_struct));
+  pp->n_part = (align->n_charset ? align->n_charset : 1); /* no ASSUMPTIONS block: one partition with all sites */
+  pp->part = (phylogeny*) biomcmc_malloc (pp->n_part * sizeof (phylogeny));
+  pp->order = (int*) biomcmc_malloc (pp->n_part * sizeof (int));
+  pp->owner = (int*) biomcmc_malloc (pp->n_part * sizeof (int));
+  pp->n_threads = 1;
+  pp->lk_proposal = pp->lk_current = 0.;
+  pp->ref_counter = 1;
+
+  dist = new_distance_matrix_from_alignment (align); /* initial model parameters, shared by all partitions */
+  local   = (int*) biomcmc_malloc (align->npat * sizeof (int));
+  pattern = (int*) biomcmc_malloc (align->npat * sizeof (int));
+  freq    = (int*) biomcmc_malloc (align->npat * sizeof (int));
+  for (j = 0; j < align->npat; j++) local[j] = -1;
+  for (i = 0; i < pp->n_part; i++) { /* distinct patterns of charset, from those of whole alignment */
+    if (align->n_charset) { first = align->charset_start[i]; last = align->charset_end[i]; }
+    for (npat = 0, site = first; site <= last; site++) {
+      j = align->site_pattern[site];
+      if (local[j] < 0) { local[j] = npat; pattern[npat] = j; freq[npat++] = 0; }
+      freq[local[j]]++;
+    }
+    pp->part[i] = new_phylogeny_from_alignment_patterns (align, pattern, freq, npat, n_cat, n_state, n_cycle, dist);
+    for (j = 0; j < npat; j++) local[pattern[j]] = -1;
+  }
+  free (local);
+  free (pattern);
+  free (freq);
+  del_distance_matrix (dist);
+
+  partitioned_phylogeny_set_threads (pp, 0);
+  return pp;
+}
+
+void
+del_partitioned_phylogeny (partitioned_phylogeny pp)
+{
+  int i;
+  if (!pp) return;
+  if (--pp->ref_counter) return;
+  if (pp->part) {
+    for (i = pp->n_part - 1; i >= 0; i--) del_phylogeny (pp->part[i]);
+    free (pp->part);
+  }
+  if (pp->order) free (pp->order);
+  if (pp->owner) free (pp->owner);
+  free (pp);
+}
+
+void
+partitioned_phylogeny_set_threads (partitioned_phylogeny pp, int n_threads)
+{
+  int i, j, k, total = 0, *load;
+#ifdef _OPENMP
+  if (n_threads < 1) n_threads = omp_get_max_threads ();
+#endif
+  if (n_threads < 1) n_threads = 1;
+  pp->n_threads = n_threads;
+
+  /* partitions by decreasing number of patterns (insertion sort, stable) */
+  for (i = 0; i < pp->n_part; i++) {
+    for (j = i; (j > 0) && (pp->part[pp->order[j-1]]->npat < pp->part[i]->npat); j--) pp->order[j] = pp->order[j-1];
+    pp->order[j] = i;
+    total += pp->part[i]->npat;
+  }
+  /* partitions larger than a thread's share use all threads, one at a time; the others are assigned whole to the least
+   * loaded thread (longest processing time first) */
+  load = (int*) biomcmc_malloc (n_threads * sizeof (int));
+  for (k = 0; k < n_threads; k++) load[k] = 0;
+  for (i = 0; i < pp->n_part; i++) {
+    j = pp->order[i];
+    if ((n_threads > 1) && (pp->part[j]->npat * n_threads > total)) {
+      pp->owner[j] = -1; 
+      phylogeny_set_threads (pp->part[j], n_threads);
+      continue;
+    }
+    for (pp->owner[j] = 0, k = 1; k < n_threads; k++) if (load[k] < load[pp->owner[j]]) pp->owner[j] = k;
+    load[pp->owner[j]] += pp->part[j]->npat;
+    phylogeny_set_threads (pp->part[j], 1);
+  }
+  free (load);
+}
+
 void
 phylogeny_order_accepted_lk_vector (phylogeny phy)
 {
@@ -141,6 +311,193 @@ phylogeny_link_current_to_accepted (phylogeny phy)
   phy->lk_current = phy->lk_accepted;
 }	
 
+void
+phylogeny_set_threads (phylogeny phy, int n_threads)
+{
+  int i, n_blk = (phy->npat + LikPatternBlock - 1) / LikPatternBlock;
+#ifdef _OPENMP
+  if (n_threads < 1) n_threads = omp_get_max_threads ();
+#endif
+  if (n_threads > n_blk) n_threads = n_blk; /* small alignments don't need all threads (or any parallel region) */
+  if (n_threads < 1) n_threads = 1;
+  phy->n_threads = n_threads;
+  phy->slice = (int*) biomcmc_realloc ((int*) phy->slice, (n_threads + 1) * sizeof (int));
+  for (i = 0; i <= n_threads; i++) phy->slice[i] = (i * n_blk) / n_threads; /* balanced, contiguous */
+  if (phy->checkpoint || phy->single_precision) phylogeny_update_block_buffers (phy);
+}
+
+void
+phylogeny_set_checkpoints (phylogeny phy, bool *checkpoint)
+{
+  int i, j, n_pool = 0, *pool = (int*) biomcmc_malloc (phy->nnodes * sizeof (int));
+  node_likelihood tmp;
+
+  /* storage moves from nodes no longer checkpoints to new ones */
+  for (i = phy->ntax; i < phy->nnodes; i++) if (checkpoint && !checkpoint[i] && phy->l[i]->n_cycle) pool[n_pool++] = i;
+  for (i = phy->ntax; i < phy->nnodes; i++) if ((!checkpoint || checkpoint[i]) && !phy->l[i]->n_cycle) {
+    if (n_pool) {
+      j = pool[--n_pool];
+      tmp = phy->l[i]; phy->l[i] = phy->l[j]; phy->l[j] = tmp;
+    }
+    else {
+      del_node_likelihood (phy->l[i]);
+      phy->l[i] = new_node_likelihood (phy->model->nrates, phy->npat, phy->model->n_state, phy->n_cycle);
+      if (phy->single_precision) node_likelihood_set_precision (phy->l[i], phy->npat * phy->model->nrates * phy->model->n_state, true);
+    }
+  }
+  for (; n_pool > 0; n_pool--) {
+    del_node_likelihood (phy->l[pool[n_pool-1]]);
+    phy->l[pool[n_pool-1]] = new_node_likelihood (phy->model->nrates, phy->npat, phy->model->n_state, 0);
+  }
+  free (pool);
+
+  if (phy->checkpoint) free (phy->checkpoint);
+  phy->checkpoint = checkpoint;
+  phylogeny_update_block_buffers (phy);
+}
+
+void
+phylogeny_set_single_precision (phylogeny phy, bool single)
+{
+  int i;
+  if (phy->single_precision == single) return;
+  phy->single_precision = single;
+  phy->scale_exponent = (single ? LikScaleExponentSingle : LikScaleExponent);
+  for (i = phy->ntax; i < phy->nnodes; i++) node_likelihood_set_precision (phy->l[i], phy->npat * phy->model->nrates * phy->model->n_state, single);
+  phylogeny_update_block_buffers (phy);
+}
+
+void
+node_likelihood_set_precision (node_likelihood l, int n_elem, bool single)
+{ /* same rounding to cache lines as new_lk_vector() */
+  int i, j;
+  size_t size = (single ? sizeof (float) : sizeof (double)) * n_elem;
+  lk_vector v;
+  size = ((size + BIOMCMC_ALIGNMENT - 1) / BIOMCMC_ALIGNMENT) * BIOMCMC_ALIGNMENT;
+  for (j = 0; j < l->n_cycle; j++) for (i = 0; i < 2; i++) {
+    v = (i ? l->u[j] : l->d[j]);
+    if (v->lk)   free (v->lk);
+    if (v->lk32) free (v->lk32);
+    v->lk = NULL; v->lk32 = NULL;
+    if (single) v->lk32 = (float*)  biomcmc_malloc_aligned (size);
+    else        v->lk   = (double*) biomcmc_malloc_aligned (size);
+  }
+}
+
+void
+phylogeny_update_block_buffers (phylogeny phy)
+{
+  int i, n_cat = phy->model->nrates, n_state = phy->model->n_state;
+
+  for (i = phy->n_block_buffer - 1; i >= 0; i--) del_lk_vector (phy->block_buffer[i]);
+  if (!phy->checkpoint && !phy->single_precision) { /* all nodes are stored in double precision */
+    if (phy->block_buffer) free (phy->block_buffer);
+    if (phy->block_view)   free (phy->block_view);
+    phy->block_buffer = NULL;
+    phy->block_view = NULL;
+    phy->n_block_buffer = 0;
+    return;
+  }
+  phy->n_block_buffer = phy->n_threads * phy->nnodes;
+  phy->recompute = (int*) biomcmc_realloc ((int*) phy->recompute, phy->nnodes * sizeof (int));
+  phy->recalculate = (bool*) biomcmc_realloc ((bool*) phy->recalculate, phy->nnodes * sizeof (bool));
+  phy->block_buffer = (lk_vector*) biomcmc_realloc ((lk_vector*) phy->block_buffer, phy->n_block_buffer * sizeof (lk_vector));
+  phy->block_view = (struct lk_vector_struct*) biomcmc_realloc ((struct lk_vector_struct*) phy->block_view, 
+                                                                 phy->n_block_buffer * sizeof (struct lk_vector_struct));
+  for (i = 0; i < phy->n_block_buffer; i++) {
+    if ((i % phy->nnodes >= phy->ntax) && (phy->single_precision || !phy->checkpoint[i % phy->nnodes])) 
+      phy->block_buffer[i] = new_lk_vector (n_cat, LikPatternBlock, n_state);
+    else phy->block_buffer[i] = NULL;
+  }
+}
+
+void
+phylogeny_first_touch_lk_vectors (phylogeny phy)
+{ /* each thread writes first to the patterns it will work on, s.t. memory pages are allocated in its NUMA node */
+#ifdef _OPENMP
+#pragma omp parallel num_threads(phy->n_threads) proc_bind(close) if(phy->n_threads > 1) shared(phy)
+#endif
+  {
+    int i, j, slice = 0, stride = 1, first, last, n_cat = phy->model->nrates, size = n_cat * phy->model->n_state;
+#ifdef _OPENMP
+    slice  = omp_get_thread_num ();
+    stride = omp_get_num_threads ();
+#endif
+    for (; slice < phy->n_threads; slice += stride) {
+      first = BIOMCMC_MIN (phy->slice[slice] * LikPatternBlock, phy->npat);
+      last  = BIOMCMC_MIN (phy->slice[slice + 1] * LikPatternBlock, phy->npat);
+      for (i = 0; i < phy->nnodes; i++) for (j = 0; j < phy->l[i]->n_cycle; j++) {
+        memset (phy->l[i]->d[j]->lk + first * size, 0, (last - first) * size * sizeof (double));
+        memset (phy->l[i]->u[j]->lk + first * size, 0, (last - first) * size * sizeof (double));
+        memset (phy->l[i]->d[j]->scale + first * n_cat, 0, (last - first) * n_cat * sizeof (int));
+        memset (phy->l[i]->u[j]->scale + first * n_cat, 0, (last - first) * n_cat * sizeof (int));
+      }
+      memset (phy->pat_lnLk + first, 0, (last - first) * sizeof (double));
+    }
+  }
+}
+
+void
+phylogeny_update_leaf_site_repeats (phylogeny phy)
+{ /* patterns with the same vector at this leaf (e.g. same ambiguity code) point to the first one in the block */
+  int i, j, k, n_rep, rep[256], size = phy->model->nrates * phy->model->n_state, base;
+  double *lk;
+
+  for (i = 0; i < phy->ntax; i++) {
+    lk = phy->l[i]->d[0]->lk;
+    for (base = 0; base < phy->npat; base += LikPatternBlock) {
+      for (n_rep = 0, j = base; (j < phy->npat) && (j < base + LikPatternBlock); j++) {
+        for (k = 0; (k < n_rep) && memcmp (lk + j * size, lk + (base + rep[k]) * size, size * sizeof (double)); k++);
+        if (k == n_rep) rep[n_rep++] = j - base;
+        phy->leaf_rep[i][j] = rep[k];
+      }
+    }
+  }
+}
+
+void
+phylogeny_use_branch_lengths (phylogeny phy, bool use_blength)
+{
+  if (use_blength && !phy->pmat) phy->pmat = new_branch_pmatrix (phy->ntax, phy->nnodes, phy->model->nrates, phy->model->n_state);
+  if (!use_blength && phy->pmat) { del_branch_pmatrix (phy->pmat); phy->pmat = NULL; }
+}
+
+branch_pmatrix
+new_branch_pmatrix (int ntax, int nnodes, int n_cat, int n_state)
+{
+  int i;
+  branch_pmatrix pm = (branch_pmatrix) biomcmc_malloc (sizeof (struct branch_pmatrix_struct));
+  pm->ntax = ntax;
+  pm->nnodes = nnodes;
+  pm->P    = (double**) biomcmc_malloc (nnodes * sizeof (double*));
+  pm->Ptip = (double**) biomcmc_malloc (ntax * sizeof (double*));
+  pm->t    = (double*)  biomcmc_malloc (nnodes * sizeof (double));
+  pm->expo = (double*)  biomcmc_malloc (n_state * sizeof (double));
+  pm->version = (unsigned int*) biomcmc_malloc (nnodes * sizeof (unsigned int));
+  for (i = 0; i < nnodes; i++) {
+    pm->P[i] = (double*) biomcmc_malloc_aligned (2 * n_cat * n_state * n_state * sizeof (double));
+    pm->t[i] = -1.; /* impossible branch length forces calculation */
+    pm->version[i] = 0;
+  }
+  for (i = 0; i < ntax; i++) pm->Ptip[i] = (double*) biomcmc_malloc_aligned (16 * n_cat * n_state * sizeof (double));
+  return pm;
+}
+
+void
+del_branch_pmatrix (branch_pmatrix pm)
+{
+  int i;
+  if (!pm) return;
+  for (i = pm->ntax - 1; i >= 0; i--) if (pm->Ptip[i]) free (pm->Ptip[i]);
+  for (i = pm->nnodes - 1; i >= 0; i--) if (pm->P[i]) free (pm->P[i]);
+  free (pm->Ptip);
+  free (pm->P);
+  free (pm->t);
+  free (pm->expo);
+  free (pm->version);
+  free (pm);
+}
+
 node_likelihood
 new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle)
 {
@@ -149,6 +506,11 @@ new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle)
   l =	(node_likelihood) biomcmc_malloc (sizeof (struct node_likelihood_struct));
   /* one vector for current state, one for proposal update and one for accepted */
   l->n_cycle = n_cycle;
+  if (!n_cycle) { /* node is recalculated whenever needed, in memory-bounded mode (see phylogeny_struct::checkpoint) */
+    l->u = l->d = NULL;
+    l->u_current = l->u_accepted = l->d_current = l->d_accepted = l->d_proposal = NULL;
+    return l;
+  }
   l->u = (lk_vector*) biomcmc_malloc ((l->n_cycle) * sizeof (lk_vector));
   l->d = (lk_vector*) biomcmc_malloc ((l->n_cycle) * sizeof (lk_vector));
 
@@ -176,16 +538,16 @@ new_node_likelihood (int n_cat, int n_pat, int n_state, int n_cycle)
 }
 
 void
-del_node_likelihood (node_likelihood l, int n_cat, int n_pat)
+del_node_likelihood (node_likelihood l)
 {
   int i;
   if (!l) return;
   if (l->u) {
-    for (i = l->n_cycle - 1; i >= 0; i--) del_lk_vector (l->u[i], n_cat, n_pat);
+    for (i = l->n_cycle - 1; i >= 0; i--) del_lk_vector (l->u[i]);
     free (l->u);
   }
   if (l->d) {
-    for (i = l->n_cycle - 1; i >= 0; i--) del_lk_vector (l->d[i], n_cat, n_pat);
+    for (i = l->n_cycle - 1; i >= 0; i--) del_lk_vector (l->d[i]);
     free (l->d);
   }
   free (l);
@@ -194,44 +556,37 @@ del_node_likelihood (node_likelihood l, int n_cat, int n_pat)
 lk_vector
 new_lk_vector (int n_cat, int n_pat, int n_state)
 {
-  int j, k;
+  int i;
+  size_t size = (size_t) n_pat * n_cat * n_state * sizeof (double);
   lk_vector u;
 
   u = (lk_vector) biomcmc_malloc (sizeof (struct lk_vector_struct));
   u->prev = u->next = NULL;
-
-  u->lk    = (double***) biomcmc_malloc ((n_cat) * sizeof (double**));
-  u->lnmax = (double**)  biomcmc_malloc ((n_cat) * sizeof (double*));
-  for (j = 0; j < n_cat; j++) { 
-    u->lk[j]    = (double**) biomcmc_malloc (n_pat * sizeof (double*));
-    u->lnmax[j] = (double*)  biomcmc_malloc (n_pat * sizeof (double));
-    for (k = 0; k < n_pat; k++) u->lk[j][k] = (double*) biomcmc_malloc (n_state * sizeof (double));
-  }
+  /* one contiguous block per node, rounded up to full cache lines such that SIMD loads never cross vectors */
+  size = ((size + BIOMCMC_ALIGNMENT - 1) / BIOMCMC_ALIGNMENT) * BIOMCMC_ALIGNMENT;
+  u->lk    = (double*) biomcmc_malloc_aligned (size);
+  size = ((n_pat * n_cat * sizeof (int) + BIOMCMC_ALIGNMENT - 1) / BIOMCMC_ALIGNMENT) * BIOMCMC_ALIGNMENT;
+  u->scale = (int*) biomcmc_malloc_aligned (size); /* aligned s.t. slices of different threads don't share cache lines */
+  u->rep = (uint8_t*) biomcmc_malloc (n_pat * sizeof (uint8_t));
+  u->lk32 = NULL;
+  for (i = 0; i < n_pat; i++) u->rep[i] = i % LikPatternBlock; /* no repeats */
 
   return u;
 }
 
 void
-del_lk_vector (lk_vector u, int n_cat, int n_pat)
+del_lk_vector (lk_vector u)
 {
   if (!u) return;
-  if (u->lk) {
-    int j, k;
-    for (j = n_cat - 1; j >= 0; j--) { 
-      if (u->lk[j]) {
-        for (k = n_pat - 1; k >= 0; k--) if (u->lk[j][k]) free (u->lk[j][k]);
-        free (u->lk[j]);
-      }
-      if (u->lnmax[j]) free (u->lnmax[j]);
-    }
-    if (u->lk)    free (u->lk);
-    if (u->lnmax) free (u->lnmax);
-  }
+  if (u->lk)    free (u->lk);
+  if (u->lk32)  free (u->lk32);
+  if (u->scale) free (u->scale);
+  if (u->rep)   free (u->rep);
   free (u);
 }
 
 evolution_model
-new_evolution_model (int n_cat, int n_state) /*n_state MUST BE 4 */
+new_evolution_model (int n_cat, int n_state)
 {
   int i, j;
   evolution_model m;
@@ -239,6 +594,7 @@ new_evolution_model (int n_cat, int n_state) /*n_state MUST BE 4 */
   m->nrates  = n_cat;
   m->n_state = n_state; 
   m->kappa = m->alpha = m->beta = 1.; /* arbitrary values */
+  m->version = 0;
 
   m->rate = (double*)   biomcmc_malloc (n_cat * sizeof (double));
   m->Q    = (double***) biomcmc_malloc (n_cat * sizeof (double**));
@@ -247,6 +603,8 @@ new_evolution_model (int n_cat, int n_state) /*n_state MUST BE 4 */
     for (j = 0; j < n_state; j++)
       m->Q[i][j]  = (double*) biomcmc_malloc (n_state * sizeof (double));
   }
+  m->Qv = (double*) biomcmc_malloc_aligned (2 * n_cat * n_state * n_state * sizeof (double));
+  m->Qtip = (double*) biomcmc_malloc_aligned (16 * n_cat * n_state * sizeof (double));
 
   m->pi  = (double*) biomcmc_malloc ((n_state + 2) * sizeof (double)); /* pi[4] = pi_Y; pi[5] = pi_R */
   for (i = 0; i < n_state; i++) m->pi[i] = 0.25;
@@ -282,6 +640,8 @@ del_evolution_model (evolution_model m)
     }
     free (m->Q);
   }
+  if (m->Qv) free (m->Qv);
+  if (m->Qtip) free (m->Qtip);
   free (m);
 }
 
@@ -291,19 +651,20 @@ init_evolution_model_parameters (evolution_model m, double kappa, double alpha,
   int i;
 
   for (i = 0; i < m->n_state; i++) m->pi[i] = pi[i];
-  m->pi[4] = pi[1] + pi[3]; /* pi_Y = pi_C + pi_T */ /* ASSUMES n_state = 4 */
-  m->pi[5] = pi[0] + pi[2]; /* pi_R = pi_A + pi_G */
-
   /* initialize left and right eigenvectors (just need to be done once since eq. freqs. don't change) */
-  init_eigenvectors_from_eq_frequencies (m->z1, m->z2, m->pi);
+  if (m->n_state == 4) {
+    m->pi[4] = pi[1] + pi[3]; /* pi_Y = pi_C + pi_T */
+    m->pi[5] = pi[0] + pi[2]; /* pi_R = pi_A + pi_G */
+    init_eigenvectors_from_eq_frequencies (m->z1, m->z2, m->pi);
+  }
+  else init_eigenvectors_equal_input (m->z1, m->z2, m->pi, m->n_state);
+  m->version++; /* eigenvectors changed */
 
   m->kappa = kappa;
-  m->alpha = alpha;
-  m->beta  = beta;
   /* update psi */
   update_model_eigenvalues_from_kappa (m, m->kappa);
-  /* calculate rates for each category *//*FIXME: what if rates too low (maybe reescale?) */
-  biomcmc_discrete_gamma (m->alpha, m->beta, m->rate, m->nrates);
+  /* calculate rates for each category */
+  update_model_rates_from_gamma (m, alpha, beta);
   /* update Q matrix for each rate */
   update_Q_matrix_from_average_rate (m, m->rate);
 }
@@ -315,12 +676,16 @@ copy_evolution_model (evolution_model to, evolution_model from, bool copy_Qmatri
   to->kappa = from->kappa;
   to->alpha = from->alpha;
   to->beta  = from->beta;
+  to->version++;
 
   for (i = 0; i < from->n_state + 2; i++) to->pi[i] = from->pi[i];
   for (i = 0; i < from->nrates; i++) to->rate[i] = from->rate[i];
 
-  if (copy_Qmatrix) for (i = 0; i < from->nrates; i++) 
-    for (j = 0; j < from->n_state; j++) for (k = 0; k < from->n_state; k++) to->Q[i][j][k] = from->Q[i][j][k];
+  if (copy_Qmatrix) {
+    for (i = 0; i < from->nrates; i++) 
+      for (j = 0; j < from->n_state; j++) for (k = 0; k < from->n_state; k++) to->Q[i][j][k] = from->Q[i][j][k];
+    update_Q_matrix_vectors (to);
+  }
 
   for (j = 0; j < from->n_state; j++) {
     to->psi[j] = from->psi[j];
@@ -361,10 +726,37 @@ init_eigenvectors_from_eq_frequencies (double **z1, double **z2, double *pi)
   z2[2][2] = -pi[0]/pi[5];
 }
 
+void
+init_eigenvectors_equal_input (double **z1, double **z2, double *pi, int n_state)
+{ /* P = 1 pi^T + (I - 1 pi^T) exp(-psi t), where the rows of (I - 1 pi^T) are e_i - pi. Row zero is a combination of the 
+     others, s.t. (I - 1 pi^T) = sum_{k>0} z2[k] z1[k]^T with z1[k] = e_k - pi and z2[k][0] = -pi[k]/pi[0] */
+  int i, k;
+  for (i = 0; i < n_state; i++) {
+    z1[0][i] = pi[i];
+    z2[0][i] = 1.;
+  }
+  for (k = 1; k < n_state; k++) {
+    for (i = 0; i < n_state; i++) {
+      z1[k][i] = (double)(i == k) - pi[i];
+      z2[k][i] = (double)(i == k);
+    }
+    z2[k][0] = - pi[k] / pi[0];
+  }
+}
+
 void
 update_model_eigenvalues_from_kappa (evolution_model m, double kappa)
 {  /* (double *psi, double *pi, double *kappa) */
-  double k = kappa * ((m->pi[0]*m->pi[2]) + (m->pi[1]*m->pi[3])) + (m->pi[4]*m->pi[5]);
+  int i;
+  double k;
+  m->version++; /* per-branch matrices depend on psi, even if Q is not updated */
+  if (m->n_state != 4) { /* equal-input model (kappa is ignored), scaled s.t. one substitution per unit of time */
+    for (k = 1., i = 0; i < m->n_state; i++) k -= m->pi[i] * m->pi[i];
+    m->psi[0] = 0.;
+    for (i = 1; i < m->n_state; i++) m->psi[i] = 1./k;
+    return;
+  }
+  k = kappa * ((m->pi[0]*m->pi[2]) + (m->pi[1]*m->pi[3])) + (m->pi[4]*m->pi[5]);
   //  k = (2. * k)/(2. + kappa);
   k = 0.5/k;
   m->psi[0] = 0.;
@@ -373,6 +765,15 @@ update_model_eigenvalues_from_kappa (evolution_model m, double kappa)
   m->psi[3] = ((kappa * m->pi[4]) + m->pi[5]) * k;
 }
 
+void
+update_model_rates_from_gamma (evolution_model m, double alpha, double beta)
+{ /*FIXME: what if rates too low (maybe reescale?) */
+  m->alpha = alpha;
+  m->beta  = beta;
+  biomcmc_discrete_gamma (m->alpha, m->beta, m->rate, m->nrates);
+  m->version++;
+}
+
 void
 update_Q_matrix_from_average_rate (evolution_model m, double *lambda)
 {  /* (double **Q, double **z1, double **z2, double *psi, double lambda) */
@@ -381,6 +782,49 @@ update_Q_matrix_from_average_rate (evolution_model m, double *lambda)
     m->Q[cat][j][i] = 0.;
     for (k=0; k < m->n_state; k++) m->Q[cat][j][i] += (m->z1[k][i] * m->z2[k][j])/(1. + (m->psi[k] * lambda[cat]));
   }
+  update_Q_matrix_vectors (m);
+}
+
+void
+update_Q_matrix_vectors (evolution_model m)
+{ /* row (cat,s2) has column s2 of Q[cat] followed by column s2 of Q[cat+1], s.t. SIMD kernels can load a pattern (or
+     two consecutive (pattern,category) elements) at once */
+  int cat, s1, s2, n = m->n_state;
+  double *row;
+  for (cat = 0; cat < m->nrates; cat++) for (s2 = 0; s2 < n; s2++) {
+    row = m->Qv + (cat * n + s2) * 2 * n;
+    for (s1 = 0; s1 < n; s1++) {
+      row[s1]     = m->Q[cat][s1][s2];
+      row[n + s1] = m->Q[(cat + 1) % m->nrates][s1][s2];
+    }
+  }
+  if (n == 4) tip_lookup_table_from_Qv (m->Qtip, m->Qv, m->nrates);
 }
 
+void
+tip_lookup_table_from_Qv (double *tip, double *Qv, int n_cat)
+{ /* same products and sums as the kernels over leaf vectors with ones and zeroes, thus identical results */
+  int cat, code, s1, s2;
+  double lk;
+  for (cat = 0; cat < n_cat; cat++) for (code = 0; code < 16; code++) for (s1 = 0; s1 < 4; s1++) {
+    lk = Qv[cat * 32 + s1] * (double) (code & 1);
+    for (s2 = 1; s2 < 4; s2++) lk += Qv[cat * 32 + 8 * s2 + s1] * (double) ((code >> s2) & 1);
+    tip[(cat * 16 + code) * 4 + s1] = lk;
+  }
+}
 
+void
+update_pmatrix_from_branch_length (evolution_model m, double t, double *P, double *Ptip, double *expo)
+{ /* same reasoning as update_Q_matrix_from_average_rate(), without integrating over t */
+  int cat, k, s1, s2, n = m->n_state, nr = m->nrates;
+  double p;
+  for (cat = 0; cat < nr; cat++) {
+    for (k = 0; k < n; k++) expo[k] = exp (- m->psi[k] * m->rate[cat] * t);
+    for (s1 = 0; s1 < n; s1++) for (s2 = 0; s2 < n; s2++) {
+      for (p = 0., k = 0; k < n; k++) p += m->z1[k][s2] * m->z2[k][s1] * expo[k];
+      P[(cat * n + s2) * 2 * n + s1] = p; /* first half of row for this category, second half of previous category */
+      P[(((cat + nr - 1) % nr) * n + s2) * 2 * n + n + s1] = p;
+    }
+  }
+  if (Ptip && (n == 4)) tip_lookup_table_from_Qv (Ptip, P, nr);
+}
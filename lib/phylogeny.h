@@ -21,11 +21,22 @@
 
 #include "alignment.h"
 #include "prob_distribution.h"
+#include "likelihood_kernel.h"
 
 typedef struct phylogeny_struct* phylogeny;
 typedef struct evolution_model_struct* evolution_model;
 typedef struct node_likelihood_struct* node_likelihood;
 typedef struct lk_vector_struct* lk_vector;
+typedef struct branch_pmatrix_struct* branch_pmatrix;
+typedef struct partitioned_phylogeny_struct* partitioned_phylogeny;
+
+/*! \brief number of patterns in a block (unit of work in likelihood calculation); multiple of 8 s.t. blocks start at
+ * cache line boundaries of all pattern-major vectors, and smaller than 256 (see lk_vector_struct::rep) */
+extern const int LikPatternBlock;
+/*! \brief partial likelihoods of an element (pattern and category) are multiplied by 2^LikScaleExponent when all are below 
+ * 2^-LikScaleExponent; in single precision mode (see phylogeny_set_single_precision() ) by 2^LikScaleExponentSingle, s.t.
+ * stored values stay far from the smallest normal float 2^-126 */
+extern const int LikScaleExponent, LikScaleExponentSingle;
 
 /*! \brief Model parameters and likelihood vectors for one segment. */
 struct phylogeny_struct
@@ -41,7 +52,39 @@ struct phylogeny_struct
   double lk_proposal;	/*! \brief Proposal \f$ ln(L) \f$. Ultimately subject to acceptance/rejection by MCMC.*/
   double lk_accepted;	/*! \brief Accepted \f$ ln(L) \f$. */
   double *pat_lnLk;   /*! \brief sitewise (pattern-wise, in fact) log of likelihood, marginalized over rates */
+  branch_pmatrix pmat; /*! \brief per-branch transition matrices, if branch lengths are used (NULL otherwise) */
+  uint8_t **tip;      /*! \brief 4-bit ambiguity code (A=1,C=2,G=4,T=8) of each leaf pattern, for tip kernels (NULL if not DNA) */
+  bool site_repeats;  /*! \brief calculate partial likelihoods once per distinct subtree pattern (default), see lk_vector_struct::rep */
+  uint8_t **leaf_rep; /*! \brief first pattern in block with same leaf vector (as lk_vector_struct::rep, but not for storage) */
+  int n_threads;      /*! \brief number of threads in likelihood calculation (each thread always works on same patterns) */
+  int *slice;         /*! \brief thread i works on blocks slice[i] <= b < slice[i+1] (of LikPatternBlock patterns each) */
+  double *block_lnLk; /*! \brief ln(likelihood) of each block, summed in order s.t. result doesn't depend on n_threads */
   char *align_filename;  /*! \brief name of original alignment file, without extension */ 
+  int n_cycle;        /*! \brief size of circular list of partial likelihoods of each internal node (see node_likelihood_struct) */
+  /*! \brief memory-bounded mode: internal nodes (checkpoints) whose partial likelihoods are stored, while the others are 
+   * recalculated for each block of patterns whenever needed. NULL if all are stored (default); see phylogeny_set_memory_budget() */
+  bool *checkpoint;
+  lk_vector *block_buffer; /*! \brief memory-bounded or single precision modes: vectors of one block of patterns, at [thread * nnodes + id] */
+  struct lk_vector_struct *block_view; /*! \brief memory-bounded mode: stored vectors (or leaves) seen from first pattern of current block */
+  int n_block_buffer; /*! \brief size of block_buffer[] and block_view[] */
+  int *recompute, n_recompute; /*! \brief memory-bounded mode: nodes calculated in current likelihood evaluation (ids, in postorder) */
+  bool *recalculate; /*! \brief memory-bounded mode: if node (by id) is calculated in current likelihood evaluation */
+  bool single_precision; /*! \brief partial likelihoods of internal nodes are stored as floats (lk_vector_struct::lk32) */
+  int scale_exponent;    /*! \brief LikScaleExponent, or LikScaleExponentSingle in single precision mode */
+};
+
+/*! \brief One phylogeny (with its own site patterns and evolution model) for each gene segment (charset) of an 
+ * alignment, over the same topology */
+struct partitioned_phylogeny_struct
+{
+  int n_part;         /*! \brief number of partitions (alignment_struct::n_charset, or one if alignment has no charsets) */
+  phylogeny *part;    /*! \brief phylogeny of each partition */
+  int *order;         /*! \brief partitions by decreasing number of patterns */
+  int *owner;         /*! \brief thread calculating the likelihood of each partition, or -1 if calculated by all threads */
+  int n_threads;      /*! \brief number of threads over all partitions (see partitioned_phylogeny_set_threads() ) */
+  double lk_current,  /*! \brief Current \f$ ln(L) \f$, summed over partitions */
+         lk_proposal; /*! \brief Proposal \f$ ln(L) \f$, summed over partitions */
+  int ref_counter;
 };
 
 /* model parameters assuming integrated rate and discrete gamma */
@@ -49,6 +92,8 @@ struct evolution_model_struct
 {
   double *rate,	 /*! \brief expected substitution rate (one for each gamma category) */
          ***Q,   /*! \brief Transition probability matrix (one 4x4 vector for each category) */
+         *Qtip,  /*! \brief Q times each of the 16 ambiguity codes: Qtip[(cat * 16 + code) * n_state + s1] (DNA only) */
+         *Qv,    /*! \brief Q columns for vectorised kernels: Qv[((cat * n_state + s2) * 2 + h) * n_state + s1] = Q[(cat+h) % nrates][s1][s2] */
          kappa,  /*! \brief transition/transversion ratio \f$\kappa_i\f$ for HKY model */
          *pi,    /*! \brief Equilibrium base distribution */
          **z1,   /*! \brief Left eigenvector for HKY model (depends on pi[]) */
@@ -56,8 +101,11 @@ struct evolution_model_struct
          *psi;   /*! \brief Eigenvalues for HKY model (function of kappa) */
   double alpha,  /*! \brief alpha from the discrete gamma (sitewise heterogeneity) E[x]=alpha/beta */
          beta;   /*! \brief beta from the discrete gamma (sitewise heterogeneity) */
+  unsigned int version; /*! \brief incremented whenever psi, z1, z2 or rate change, s.t. per-branch matrices know when to 
+                          update (functions below do it; code changing these values directly must also increment it) */
   int nrates,    /*! \brief number of discrete rate categories */
-      n_state;   /*! \brief number of states (4 for DNA, 64 for codon...) MUST BE 4 currently */
+      n_state;   /*! \brief number of states (4 for DNA, 20 for amino acids, 61 for codons...). DNA uses the HKY model,
+                     other state spaces the equal-input model (same rate to each state, proportional to pi) */
 };
 
 /*! \brief Partial Likelihood information for each node such that no calculation is necessary 
@@ -66,7 +114,7 @@ struct node_likelihood_struct
 {
   lk_vector *u; /*! \brief Upstream partial likelihood linked list. */
   lk_vector *d; /*! \brief Dounstream partial likelihood linked list. */
-  int n_cycle;  /*! \brief Likelihood linked list size (1 for leaves and minisampler size for internal nodes). */
+  int n_cycle;  /*! \brief Likelihood linked list size (1 for leaves and minisampler size for internal nodes, or zero if not stored). */
   /*! \brief Upstream partial likelihood of current topology (inside Al-Awadi update, for instance). Proposal topologies are 
    * accessed through node_likelihood_struct::u_current->next. */
   lk_vector u_current;
@@ -79,14 +127,41 @@ struct node_likelihood_struct
 };
 
 /*! \brief Circular linked list with partial likelihood information for a node. Its size is the largest between 
- * chain_data_struct::n_cycles and chain_data_struct::n_mini. */
+ * chain_data_struct::n_cycles and chain_data_struct::n_mini. 
+ *
+ * Values are stored pattern-major in one contiguous, BIOMCMC_ALIGNMENT-aligned block, with the states of all
+ * categories of a pattern adjacent to each other: state s of category c at pattern p is at lk[(p * nrates + c) * n_state + s]. 
+ * Thus the inner loops over categories and states run over consecutive memory, and a range of patterns is a 
+ * contiguous slice (that can be assigned to one thread). */
 struct lk_vector_struct
 {
-  double ***lk;   /*! \brief Partial likelihood values for each pattern,  gamma category and state (A,G,C,T). */
-  double **lnmax; /*! \brief scaling factors following Yang's JMolEvol.2000.423 to avoid underflow */
+  double *lk;    /*! \brief Partial likelihood values for each pattern, gamma category and state (A,C,G,T), pattern-major. */
+  /*! \brief binary exponent of the scaling factor at [p * nrates + c], s.t. the partial likelihoods are lk[] x 2^scale; 
+   * powers of two avoid underflow (even in very deep trees) without rounding errors or log() calls */
+  int *scale;
+  /*! \brief site repeats: the partial likelihood of pattern p is stored at pattern (p - p % LikPatternBlock + rep[p]), 
+   * the first one in the block with the same subtree pattern (leaf states below the node), and only calculated there. 
+   * Thus values at other patterns are undefined, and must always be accessed through rep[] (identity for leaves) */
+  uint8_t *rep;
+  /*! \brief single precision storage of lk[] (which is then NULL), in the same layout; calculations are still in double 
+   * precision, over one block of patterns at a time (see phylogeny_set_single_precision() ) */
+  float *lk32;
   lk_vector next, prev; /*! \brief Double-linked circular list information */
 };
 
+/*! \brief Transition probability matrices P(t) of each branch, for each rate category, calculated from the
+ * eigendecomposition of the HKY model (evolution_model_struct::z1, z2, and psi) and the branch lengths. Matrices are 
+ * cached and only recalculated when their branch length or the model (by evolution_model_struct::version) change. */
+struct branch_pmatrix_struct
+{
+  double **P,    /*! \brief P(t) of branch above each node, in the layout of evolution_model_struct::Qv. The root 
+                     slot has P(t_left + t_right), used between the root's children */
+         **Ptip, /*! \brief P(t) x leaf vector for each ambiguity code, as evolution_model_struct::Qtip (leaves only) */
+         *t,     /*! \brief branch length used in P[] (negative if never calculated) */
+         *expo;  /*! \brief auxiliary vector with exponentials of eigenvalues */
+  unsigned int *version; /*! \brief evolution_model_struct::version used in P[] */
+  int nnodes, ntax;
+};
 
 phylogeny new_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cycle, distance_matrix external_dist);
 
@@ -105,14 +180,53 @@ void phylogeny_link_accepted_to_current (phylogeny phy);
  * functions generally work on d_current */
 void phylogeny_link_current_to_accepted (phylogeny phy);
 
+/*! \brief number of threads for likelihood calculation (if zero or negative, the OpenMP default). Patterns are split 
+ * into static contiguous slices, one per thread. Memory pages are placed (in NUMA systems) by new_phylogeny(), following
+ * the default number of threads; with OMP_PROC_BIND=close or OMP_PLACES=cores threads stay next to their slices. */
+void phylogeny_set_threads (phylogeny phy, int n_threads);
+/*! \brief memory-bounded mode: store partial likelihoods only at internal nodes with checkpoint[id] true (and take
+ * ownership of checkpoint[]), or at all nodes if checkpoint is NULL; vector contents are lost. Checkpoints are usually 
+ * chosen by phylogeny_set_memory_budget() */
+void phylogeny_set_checkpoints (phylogeny phy, bool *checkpoint);
+/*! \brief store partial likelihoods of internal nodes in single precision (halving their memory and bandwidth), or back 
+ * in double precision; calculations are always in double precision, one block of patterns at a time (converted from 
+ * and to storage, and thus in cache). Vector contents are lost, and like memory-bounded mode (see 
+ * phylogeny_set_memory_budget() ) only ln_likelihood() and ln_likelihood_moved_branches() are available */
+void phylogeny_set_single_precision (phylogeny phy, bool single);
+/*! \brief memory-bounded or single precision modes: (re)allocate one block of patterns for each thread, for each node not
+ * stored in double precision */
+void phylogeny_update_block_buffers (phylogeny phy);
+
+/*! \brief one phylogeny per charset of alignment, with the distinct site patterns of the charset */
+partitioned_phylogeny new_partitioned_phylogeny_from_alignment (alignment align, int n_cat, int n_state, int n_cycle);
+void del_partitioned_phylogeny (partitioned_phylogeny pp);
+/*! \brief number of threads (if zero or negative, the OpenMP default) over all partitions: partitions with more than
+ * their share of patterns are calculated one at a time by all threads, while smaller ones are balanced over threads by
+ * their number of patterns, each calculated by a single thread */
+void partitioned_phylogeny_set_threads (partitioned_phylogeny pp, int n_threads);
+
+/*! \brief find repeated vectors at leaves (e.g. same nucleotide), needed for site repeats; must be called if leaf 
+ * vectors are modified (it's called by new_phylogeny_from_alignment()) */
+void phylogeny_update_leaf_site_repeats (phylogeny phy);
+
+/*! \brief use branch lengths from topology (with one transition matrix per branch) instead of integrating over them */
+void phylogeny_use_branch_lengths (phylogeny phy, bool use_blength);
+
 /*! \brief Phylogenetic evolutionary model parameters (for likelihood calculation) */
 evolution_model new_evolution_model (int n_cat, int n_state);
 void del_evolution_model (evolution_model m);
 
+/*! \brief set equilibrium frequencies pi (n_state values), kappa (ignored if not DNA) and discrete gamma parameters,
+ * updating eigenvectors, eigenvalues and Q matrices */
+void init_evolution_model_parameters (evolution_model m, double kappa, double alpha, double beta, double *pi);
+
 /*! \brief copy values from one evolution_model to another, possibly skipping the transition matrix */
 void copy_evolution_model (evolution_model to, evolution_model from, bool copy_Qmatrix);
 
+/*! \brief update eigenvalues psi from kappa (and pi), without updating Q matrices */
 void update_model_eigenvalues_from_kappa (evolution_model m, double kappa);
+/*! \brief update rate of each category from discrete gamma, without updating Q matrices */
+void update_model_rates_from_gamma (evolution_model m, double alpha, double beta);
 
 /*! \brief  HKY model integrated over branch length FIXME: change to E[x]=1/lambda (redo calcs) 
  *
@@ -126,4 +240,10 @@ void update_model_eigenvalues_from_kappa (evolution_model m, double kappa);
  *  where \f$Z_i \f$ is the matrix of eigenvectors and \f$\psi_i \f$ are the eigenvalues for the HKY model. */
 void update_Q_matrix_from_average_rate (evolution_model m, double *lambda);
 
+/*! \brief HKY transition probabilities for branch length t (for each rate category), in the layout of
+ * evolution_model_struct::Qv. If Ptip is not NULL, it receives P(t) x leaf vector for all ambiguity codes.
+ *
+ *  \f[ Prob(j/i,t)=\sum_{k=1}^4 Z_k Z_k^{-1} e^{-\psi_k r t} \f] where r is the rate of the category */
+void update_pmatrix_from_branch_length (evolution_model m, double t, double *P, double *Ptip, double *expo);
+
 #endif
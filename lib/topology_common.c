@@ -27,6 +27,33 @@ void topology_subtree_to_string_by_name (char *str, const topol_node node, const
 void undo_udone (topol_node this);
 /*! \brief Flag nodes ancestral to this topol_node_struct as lower part undone. */
 void undo_ddone (topol_node this);
+/*! \brief change topol_node_struct::split_hash of internal node, updating the tree hashes */
+void topology_set_split_hash (topology tree, topol_node node, uint64_t hash);
+/*! \brief update split hashes of nodes changed by apply_spr_at_nodes_LCAprune() (must be called before the move) */
+void update_split_hash_LCAprune (topology tree, topol_node prune, topol_node regraft);
+/*! \brief update split hashes of nodes changed by apply_spr_at_nodes_notLCAprune() (must be called before the move) */
+void update_split_hash_notLCAprune (topology tree, topol_node prune, topol_node regraft);
+
+/*! \brief random key of each leaf, defined by its ID (thus the same across topologies) */
+static inline uint64_t
+topology_leaf_key (int id)
+{
+  return biomcmc_hashint64_salted ((uint64_t) id + 1ULL, /*salt*/ 3);
+}
+
+/*! \brief split hash that does not depend on the side of the split (smallest between split and its complement) */
+static inline uint64_t
+split_hash_canonical (uint64_t hash, uint64_t leaves_hash)
+{
+  return ((hash ^ leaves_hash) < hash) ? (hash ^ leaves_hash) : hash;
+}
+
+/*! \brief XOR of leaf keys is linear, thus contribution of each split to the tree hash is mixed */
+static inline uint64_t
+split_hash_mix (uint64_t hash)
+{
+  return biomcmc_hashint64_salted (hash, /*salt*/ 4);
+}
 
 topology
 new_topology (int nleaves) 
@@ -34,12 +61,15 @@ new_topology (int nleaves)
   topology tree;
   int i;
   size_t sizeof_node = sizeof (struct topol_node_struct);
+  bipartition_arena splits;
 
   tree = (topology) biomcmc_malloc (sizeof (struct topology_struct));
   tree->nleaves = nleaves;
   tree->nnodes  = 2*nleaves - 1;
   tree->n_undone = nleaves - 1;
   tree->hashID1 = tree->hashID2 = 0;
+  tree->hash_rooted = tree->hash_unrooted = tree->leaves_hash = 0ULL;
+  tree->mark = 0;
   tree->traversal_updated = false;
   tree->ref_counter = 1;
   tree->taxlabel = NULL; /* Memory allocated by topology_space:: or other place */
@@ -60,6 +90,9 @@ new_topology (int nleaves)
   tree->index = (int*) biomcmc_malloc (4 * tree->nleaves * sizeof (int));
   for (i=0; i < (4 * tree->nleaves); i++) tree->index[i] = 0;
 
+  /* all splits in one block, freed after del_bipartition() of each one (leaf splits may be shared with other trees) */
+  splits = new_bipartition_arena (tree->nnodes, tree->nleaves);
+
   /* tree->nodelist will store the actual nodes */
   for (i=0; i<tree->nleaves; i++) { 
     tree->nodelist[i] = (topol_node) biomcmc_malloc (sizeof_node);
@@ -69,8 +102,11 @@ new_topology (int nleaves)
     tree->nodelist[i]->sister = tree->nodelist[i];
     tree->nodelist[i]->mid[0] = tree->nodelist[i]->mid[1] = tree->nodelist[i]->id = i;
 
-    tree->nodelist[i]->split = new_bipartition (tree->nleaves);
+    tree->nodelist[i]->split = splits->bip + i;
     bipartition_set (tree->nodelist[i]->split, i);
+    tree->nodelist[i]->split_hash = topology_leaf_key (i);
+    tree->nodelist[i]->mark = 0;
+    tree->leaves_hash ^= tree->nodelist[i]->split_hash;
   }
 
   for (i=tree->nleaves; i<tree->nnodes; i++) { 
@@ -81,7 +117,9 @@ new_topology (int nleaves)
     tree->nodelist[i]->internal = true;
     tree->nodelist[i]->mid[0] = tree->nodelist[i]->mid[1] = tree->nodelist[i]->id = i;
 
-    tree->nodelist[i]->split = new_bipartition (tree->nleaves);
+    tree->nodelist[i]->split = splits->bip + i;
+    tree->nodelist[i]->split_hash = 0ULL;
+    tree->nodelist[i]->mark = 0;
   }
   tree->root = tree->nodelist[tree->nnodes - 1]; /* arbitrary, but usually correct */
 
@@ -204,6 +242,13 @@ update_topology_traversal (topology tree)
   for (i = tree->nleaves-3; i >= 0; i--) tree->postorder[i]->level = tree->postorder[i]->up->level + 1; /*internal nodes */
   for (i = 0; i < tree->nleaves; i++)    tree->nodelist[i]->level  = tree->nodelist[i]->up->level  + 1;
 
+  /* split hashes were set by update_subtree_bipartitions(); root contributes a constant to both sums */
+  tree->hash_rooted = tree->hash_unrooted = 0ULL;
+  for (i = 0; i < tree->nleaves-1; i++) {
+    tree->hash_rooted   += split_hash_mix (tree->postorder[i]->split_hash);
+    tree->hash_unrooted += split_hash_mix (split_hash_canonical (tree->postorder[i]->split_hash, tree->leaves_hash));
+  }
+
   tree->traversal_updated = true;
 }
 
@@ -212,11 +257,12 @@ update_subtree_bipartitions (topol_node this)
 {
   uint32_t hash1 = 0x55555UL, hash2 = 0xefc6dUL; /* each tree has a (ideally) unique hash value */
   if (this->left->internal)  hash1 = update_subtree_bipartitions (this->left);
-  else                       hash1 = this->left->id;
+  else { hash1 = this->left->id; this->left->split_hash = topology_leaf_key (this->left->id); }
   if (this->right->internal) hash2 = update_subtree_bipartitions (this->right);
-  else                       hash2 = this->right->id;
+  else { hash2 = this->right->id; this->right->split_hash = topology_leaf_key (this->right->id); }
 
   bipartition_OR (this->split, this->left->split, this->right->split, false);
+  this->split_hash = this->left->split_hash ^ this->right->split_hash;
   if (bipartition_is_larger (this->right->split, this->left->split)) {
     // heavy child (more leaves - or leaves with larger ids in case of a tie) at left 
     topol_node tmp = this->left; 
@@ -244,6 +290,27 @@ update_subtree_traversal (topology tree, topol_node this, int *postcount, int *u
   return biomcmc_hashint_mix_salted (hash1, hash2 + (uint32_t) (*postcount), /*salt*/ 1);
 }
 
+uint64_t
+topology_hash_rooted (topology tree)
+{
+  return tree->hash_rooted;
+}
+
+uint64_t
+topology_hash_unrooted (topology tree)
+{ /* both children of root represent the same unrooted edge (or a trivial split, if one of them is a leaf) */
+  topol_node child = tree->root->left->internal ? tree->root->left : tree->root->right;
+  if (!child->internal) return tree->hash_unrooted;
+  return tree->hash_unrooted - split_hash_mix (split_hash_canonical (child->split_hash, tree->leaves_hash));
+}
+
+uint64_t
+topology_split_hash (topology tree, topol_node node, bool unrooted)
+{
+  if (unrooted) return split_hash_canonical (node->split_hash, tree->leaves_hash);
+  return node->split_hash;
+}
+
 bool
 topology_is_equal (topology t1, topology t2)
 { // this is a simple (lowlevel) function, doesn't check if taxlabels are equivalent when both are present
@@ -252,6 +319,7 @@ topology_is_equal (topology t1, topology t2)
   if (!t1->traversal_updated) update_topology_traversal (t1);
   if (!t2->traversal_updated) update_topology_traversal (t2);
 
+  if (t1->hash_rooted != t2->hash_rooted) return false;
   if (t1->hashID1 != t2->hashID1) return false;
   if (t1->hashID2 != t2->hashID2) return false;
   for (i=0; i < t1->nleaves-1; i++) // only if by chance both hash values are the same (double collision) 
@@ -268,6 +336,7 @@ topology_is_equal_unrooted (topology t1, topology t2, bool use_root_later)
   if (t1->nleaves != t2->nleaves) return false;
   if (!t1->traversal_updated) update_topology_traversal (t1);
   if (!t2->traversal_updated) update_topology_traversal (t2);
+  if (topology_hash_unrooted (t1) != topology_hash_unrooted (t2)) return false;
 
   b1 = (bipartition*) biomcmc_malloc (2 * n * sizeof (bipartition));
   b2 = b1 + n; // first half from t1 and second half from t2
@@ -480,6 +549,7 @@ apply_spr_at_nodes_LCAprune (topology tree, topol_node prune, topol_node regraft
   bool regraft_is_left = false;
 
   if (!node1_is_child_of_node2 (regraft, prune)) printf ("gotcha! This is a BUG, not your fault\n"); //DEBUG
+  update_split_hash_LCAprune (tree, prune, regraft);
   r->up = prune;
   rup->up = prune;
   if (rup->left == r) { /* regraft is left child */
@@ -564,6 +634,8 @@ apply_spr_at_nodes_notLCAprune (topology tree, topol_node prune, topol_node regr
    */
   topol_node psister, p = prune;
 
+  update_split_hash_notLCAprune (tree, prune, regraft);
+
   /* update u_done and d_done information */
   if (update_done) {
     undo_ddone (prune->up);
@@ -644,6 +716,48 @@ apply_spr_at_nodes_notLCAprune (topology tree, topol_node prune, topol_node regr
   tree->traversal_updated = false;
 }
 
+void
+topology_set_split_hash (topology tree, topol_node node, uint64_t hash)
+{
+  tree->hash_rooted   += split_hash_mix (hash) - split_hash_mix (node->split_hash);
+  tree->hash_unrooted += split_hash_mix (split_hash_canonical (hash, tree->leaves_hash)) - 
+                         split_hash_mix (split_hash_canonical (node->split_hash, tree->leaves_hash));
+  node->split_hash = hash;
+}
+
+void
+update_split_hash_LCAprune (topology tree, topol_node prune, topol_node regraft)
+{ /* path from regraft to prune is reversed: each node below prune keeps all leaves except those originally below its child */
+  uint64_t previous = regraft->split_hash, original;
+  topol_node this;
+
+  for (this = regraft->up; this != prune; this = this->up) {
+    original = this->split_hash;
+    topology_set_split_hash (tree, this, prune->split_hash ^ previous);
+    previous = original;
+  }
+}
+
+void
+update_split_hash_notLCAprune (topology tree, topol_node prune, topol_node regraft)
+{ /* nodes between old and new positions lose or gain the leaves of prune; both paths end at their LCA (unchanged) */
+  topol_node x = prune->up->up, y = regraft->up, lca = NULL;
+  int i;
+
+  if (!(++tree->mark)) { /* overflow: reset marks of all nodes */
+    for (i = 0; i < tree->nnodes; i++) tree->nodelist[i]->mark = 0;
+    tree->mark = 1;
+  }
+  while (x || y) { /* climb alternately, thus cost is proportional to the number of changed nodes */
+    if (x) { if (x->mark == tree->mark) { lca = x; break; } x->mark = tree->mark; x = x->up; }
+    if (y) { if (y->mark == tree->mark) { lca = y; break; } y->mark = tree->mark; y = y->up; }
+  }
+  for (x = prune->up->up; x != lca; x = x->up) topology_set_split_hash (tree, x, x->split_hash ^ prune->split_hash);
+  for (y = regraft->up;   y != lca; y = y->up) topology_set_split_hash (tree, y, y->split_hash ^ prune->split_hash);
+  /* prune->up will be between prune and regraft (whose hash may have been changed above) */
+  topology_set_split_hash (tree, prune->up, prune->split_hash ^ regraft->split_hash);
+}
+
 void
 topology_undo_random_move (topology tree, bool update_done)
 {
@@ -662,7 +776,8 @@ undo_udone (topol_node this)
 void
 undo_ddone (topol_node this)
 {
-  while ((this) && (this->d_done)) { this->d_done = false; this = this->up; }
+  /* can't stop at first node already undone: after a path reversal (LCA prune) its new ancestors may be done */
+  for (; this; this = this->up) this->d_done = false;
 }
 
 void
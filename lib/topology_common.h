@@ -41,6 +41,8 @@ struct topol_node_struct
        u_done,   /*! \brief Has the topology up this edge (eq. to node) changed? (needed in likelihood calc) */
        d_done;   /*! \brief Has the topology down this edge (eq. to node) changed? (needed in likelihood calc) */
   bipartition split;    /*! \brief bipartition with information about leaves below node */ 
+  uint64_t split_hash;  /*! \brief XOR of random keys of leaves below node (Zobrist hash of split, kept by SPR moves) */
+  uint32_t mark;        /*! \brief scratch value used to find LCA in SPR moves (see topology_struct::mark) */
 };
 
 /*! \brief Binary unrooted topology (rooted at leaf with ID zero) */
@@ -59,6 +61,9 @@ struct topology_struct
   topol_node *undone;      /*! \brief pointers to outdated nodes in postorder (from last to first is preorder) */
   int n_undone;  /*! \brief number of outdated nodes (which need likelihood calc etc) in topology_struct::undone. */
   uint32_t hashID1, hashID2; /*! \brief hash values of tree, ideally a unique value for each tree (collisions happen...) */
+  uint64_t hash_rooted, hash_unrooted; /*! \brief sums of mixed split hashes over internal nodes (see topology_hash_rooted()) */
+  uint64_t leaves_hash;    /*! \brief XOR of keys of all leaves (root split hash), to map split hashes to unrooted ones */
+  uint32_t mark;           /*! \brief last value of topol_node_struct::mark used by SPR moves */
   bool traversal_updated;  /*! \brief zero if postorder[] vector needs update, one if we can use postdorder[] to traverse tree  */ 
   int ref_counter;         /*! \brief number of references of topology (how many places are pointing to it) */
   char_vector taxlabel;    /*! \brief Taxon names (just a pointer; actual values are setup by ::newick_tree_struct or ::alignment_struct) */
@@ -93,6 +98,17 @@ void update_topology_sisters (topology tree);
  * and order siblings by number of descendants. */ 
 void update_topology_traversal (topology tree);
 
+/*! \brief Order-independent 64 bits hash of the clades of the tree.
+ *
+ * Each leaf has a fixed random key, each split hash is the XOR of the keys below it (topol_node_struct::split_hash)
+ * and the tree hash is the sum of mixed split hashes. Equal trees over the same leaf IDs have equal values even
+ * across topologies, and it is kept up to date by the SPR functions in O(changed nodes) without a traversal update. */
+uint64_t topology_hash_rooted (topology tree);
+/*! \brief Order-independent 64 bits hash of the unrooted splits of the tree (same for all rootings, see topology_hash_rooted()) */
+uint64_t topology_hash_unrooted (topology tree);
+/*! \brief 64 bits hash of split below node; if unrooted, the split and its complement have same hash */
+uint64_t topology_split_hash (topology tree, topol_node node, bool unrooted);
+
 /*! \brief Compare two topologies based on bipartitions as clades (not on branch lengths) */
 bool topology_is_equal (topology t1, topology t2);
 
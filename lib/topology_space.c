@@ -45,6 +45,26 @@ void translate_taxa_topology_space (topology_space tsp, char *string, hashtable
 /*! \brief string with original file name, with extension stripped -- be caredul not to overwrite it on program */
 void store_filename_in_topology_space (topology_space tre, char *filename);
 
+/*! \brief Index of distinct topology equal to topol (rooted, then unrooted unless use_root_location), or negative if absent.
+ *
+ * Only topologies with same tree hash (looked up in topology_space_struct::index_rooted or ::index_unrooted) are
+ * compared, thus the cost does not grow with the number of distinct topologies. */
+int topology_space_find_distinct (topology_space tsp, topology topol, bool use_root_location);
+/*! \brief Store topology as new distinct topology, with given (unscaled) frequency, growing vectors and indices as needed */
+void topology_space_append_distinct (topology_space tsp, topology topol, double freq);
+/*! \brief Insert distinct topology into hash indices, doubling them (and reinserting all topologies) when half full */
+void topology_space_index_insert (topology_space tsp, int id);
+
+/*! \brief linear probing insertion into hash index; table must have empty slots */
+static inline void
+topology_space_slot_insert (struct topology_space_slot_struct *index, int size, uint64_t hash, int id)
+{
+  int i;
+  for (i = hash & (size - 1); index[i].id >= 0; i = (i + 1) & (size - 1));
+  index[i].hash = hash;
+  index[i].id = id;
+}
+
 // TODO: create from_newick_space_to_topol_space
 
 bool
@@ -231,48 +251,25 @@ read_topology_space_from_file_with_burnin_thin (char *seqfilename, hashtable ext
 void
 merge_topology_spaces (topology_space ts1, topology_space ts2, double weight_ts1, bool use_root_location)
 { /* ts1->tree is not correct anymore, should not be used after calling this function */
-  int i, j, *idx, n_idx = ts1->ndistinct; 
+  int i, j, found_id; 
   double total_freq = 0.;
 
   // TODO: check if taxlabel_hash is the same; branch lengths; mark where convergence could go.
   if (weight_ts1 <= 0.) weight_ts1 = 1.; // usually ts1->ntrees/ts2->ntrees
 
-  idx = (int*) biomcmc_malloc (ts1->ndistinct * sizeof (int)); 
-  for (i=0; i < ts1->ndistinct; i++) {
-    ts1->freq[i] *= weight_ts1; // weight (number of trees) of ts1 relative to ts2
-    idx[i] = i; /* index of trees from ts1 not compared to ts2 yet */
-  }
+  for (i=0; i < ts1->ndistinct; i++) ts1->freq[i] *= weight_ts1; // weight (number of trees) of ts1 relative to ts2
 
   for (j=0; j < ts2->ndistinct; j++) {
-    int found_id = -1;
-    /* comparison includes root location (faster than unrooted since uses hash) */ 
-    for (i=0; (i < n_idx) && (found_id < 0); i++) if (topology_is_equal (ts2->distinct[j], ts1->distinct[idx[i]] )) found_id = i;
-    if ((!use_root_location) && (found_id < 0)) { /* if they look distinct (different root), then do slower unrooted calculation */ 
-      for (i=0; (i < n_idx) && (found_id < 0); i++) if (topology_is_equal_unrooted (ts2->distinct[j], ts1->distinct[idx[i]], true)) found_id = i;
-    }
-    if (found_id >= 0) {
-      ts1->freq[ idx[found_id] ] += ts2->freq[j];
-      idx [found_id] = idx[--n_idx]; // assuming each tree from ts1 can be found at most once in ts2 
-    } // if tree not found 
+    found_id = topology_space_find_distinct (ts1, ts2->distinct[j], use_root_location);
+    if (found_id >= 0) ts1->freq[found_id] += ts2->freq[j];
     else { // tree ts2->distinct[j] is unique to ts2 
-      int new_id = ts1->ndistinct++;
-      ts2->distinct[j]->id = new_id;
-      ts1->freq =     (double*)   biomcmc_realloc ((double*)   ts1->freq,     sizeof (double) * (ts1->ndistinct));
-      ts1->distinct = (topology*) biomcmc_realloc ((topology*) ts1->distinct, sizeof (topology) * (ts1->ndistinct));
-      ts1->freq[new_id] = ts2->freq[j];
-      ts1->distinct[new_id] = ts2->distinct[j];
+      topology_space_append_distinct (ts1, ts2->distinct[j], ts2->freq[j]);
       ts2->distinct[j] = NULL;
-      for (i=0; i < ts1->distinct[new_id]->nleaves; i++) {
-        /* the leaf bipartitions never change, so can be shared among all topologies */
-        ts1->distinct[new_id]->nodelist[i]->split = ts1->distinct[0]->nodelist[i]->split;
-        ts1->distinct[0]->nodelist[i]->split->ref_counter++;
-      }
     }
   } // for j in ts2->ndistinct
 
   for (i=0; i < ts1->ndistinct; i++) total_freq += ts1->freq[i];
   for (i=0; i < ts1->ndistinct; i++) ts1->freq[i] /= total_freq;
-  if (idx) free (idx);
 }
 
 /*
@@ -368,6 +365,8 @@ new_topology_space (void)
   tsp->filename = NULL;
   tsp->distinct = NULL;
   tsp->freq = NULL; /* will be created online (as we read more trees) or when reading "[&W 0.01]" posterior probability data */
+  tsp->index_rooted = tsp->index_unrooted = NULL; /* hash indices are created with first distinct topology */
+  tsp->index_size = tsp->n_alloc_trees = tsp->n_alloc_distinct = 0;
   /* tsp->distinct vector is increased by add_tree_to_topology_space() while tsp->tree are pointers to dsp->distinct
    * tsp->taxlabel vector is setup by translate_taxa_topology_space() or add_tree_to_topology_space(), whichever is used
    * tsp->taxlabel_hash is setup by one of the above in absence of global external_hash -- will be replaced by a pointer to an external hastable (from
@@ -387,6 +386,8 @@ del_topology_space (topology_space tsp)
     if (tsp->tree)     free (tsp->tree);
     if (tsp->freq)     free (tsp->freq);
     if (tsp->filename) free (tsp->filename);
+    if (tsp->index_rooted)   free (tsp->index_rooted);
+    if (tsp->index_unrooted) free (tsp->index_unrooted);
     del_hashtable (tsp->taxlabel_hash);
     del_char_vector (tsp->taxlabel);
     free (tsp);
@@ -517,14 +518,14 @@ add_tree_to_topology_space (topology_space tsp, const char *string, bool transla
 void
 add_topology_to_topology_space_if_distinct (topology topol, topology_space tsp, double tree_weight, bool use_root_location)
 {
-  int i, found_id = -1;
-  tsp->tree = (topology*) biomcmc_realloc ((topology*) tsp->tree, sizeof (topology) * (tsp->ntrees+1));
+  int i, found_id;
+  if (tsp->ntrees == tsp->n_alloc_trees) { /* amortised growth, instead of one realloc per tree */
+    tsp->n_alloc_trees = 2 * tsp->n_alloc_trees + 16;
+    tsp->tree = (topology*) biomcmc_realloc ((topology*) tsp->tree, sizeof (topology) * tsp->n_alloc_trees);
+  }
 
-  /* distinct trees might have same unrooted info, but rooted calculation is faster */
-  for (i=0; (i < tsp->ndistinct) && (found_id < 0); i++) if (topology_is_equal (topol, tsp->distinct[i])) found_id = i;
-  if ((!use_root_location) && (found_id < 0)) /* if they look distinct (different root), then do slower unrooted calculation */ 
-    for (i=0; (i < tsp->ndistinct) && (found_id < 0); i++) if (topology_is_equal_unrooted (topol, tsp->distinct[i], true)) found_id = i;
-  // better solution is to have vector of splits for each tree, since slowest part is to copy/order bipartitions 
+  /* distinct trees might have same unrooted info; hash indices are checked first rooted, then unrooted */
+  found_id = topology_space_find_distinct (tsp, topol, use_root_location);
 
   if (found_id >= 0) { 
     tsp->tree[tsp->ntrees] = tsp->distinct[found_id];
@@ -535,18 +536,9 @@ add_topology_to_topology_space_if_distinct (topology topol, topology_space tsp,
     del_topology (topol);
   }
   else {
-    topol->id = tsp->ndistinct++;
     for (i = 0; i < topol->nnodes; i++) topol->blength[i] *= tree_weight; // weighted average 
-    tsp->distinct = (topology*) biomcmc_realloc ((topology*) tsp->distinct, sizeof (topology) * (tsp->ndistinct));
-    tsp->freq =     (double*)   biomcmc_realloc ((double*)   tsp->freq,     sizeof (double) * (tsp->ndistinct));
-    tsp->distinct[topol->id] = topol;
-    tsp->freq[topol->id] = tree_weight;
-    tsp->tree[tsp->ntrees] = tsp->distinct[topol->id];
-    if (topol->id > 0) for (i=0; i < tsp->distinct[topol->id]->nleaves; i++) {/* leaf bipartitions never change -> shared among all topologies */
-      del_bipartition (tsp->distinct[topol->id]->nodelist[i]->split);
-      tsp->distinct[topol->id]->nodelist[i]->split = tsp->distinct[0]->nodelist[i]->split;
-      tsp->distinct[0]->nodelist[i]->split->ref_counter++;
-    }
+    topology_space_append_distinct (tsp, topol, tree_weight);
+    tsp->tree[tsp->ntrees] = topol;
     if      (!(tsp->ndistinct%10000)) fprintf (stderr, "+");
     else if (!(tsp->ndistinct%1000))  fprintf (stderr, "."); /* the "else" is to avoid printing both */
     fflush (stdout); 
@@ -554,6 +546,73 @@ add_topology_to_topology_space_if_distinct (topology topol, topology_space tsp,
   tsp->ntrees++;
 }
 
+int
+topology_space_find_distinct (topology_space tsp, topology topol, bool use_root_location)
+{
+  int i, mask = tsp->index_size - 1;
+  uint64_t hash;
+
+  if (!tsp->index_size) return -1;
+  if (!topol->traversal_updated) update_topology_traversal (topol);
+
+  hash = topology_hash_rooted (topol); /* distinct topologies may share the hash value (collision) thus we scan all */
+  for (i = hash & mask; tsp->index_rooted[i].id >= 0; i = (i + 1) & mask)
+    if ((tsp->index_rooted[i].hash == hash) && topology_is_equal (topol, tsp->distinct[ tsp->index_rooted[i].id ])) 
+      return tsp->index_rooted[i].id;
+  if (use_root_location) return -1;
+
+  hash = topology_hash_unrooted (topol); /* if they look distinct (different root), then check unrooted index */
+  for (i = hash & mask; tsp->index_unrooted[i].id >= 0; i = (i + 1) & mask)
+    if ((tsp->index_unrooted[i].hash == hash) && topology_is_equal_unrooted (topol, tsp->distinct[ tsp->index_unrooted[i].id ], true)) 
+      return tsp->index_unrooted[i].id;
+  return -1;
+}
+
+void
+topology_space_append_distinct (topology_space tsp, topology topol, double freq)
+{
+  int i;
+
+  if (tsp->ndistinct == tsp->n_alloc_distinct) {
+    tsp->n_alloc_distinct = 2 * tsp->n_alloc_distinct + 16;
+    tsp->distinct = (topology*) biomcmc_realloc ((topology*) tsp->distinct, sizeof (topology) * tsp->n_alloc_distinct);
+    tsp->freq =     (double*)   biomcmc_realloc ((double*)   tsp->freq,     sizeof (double) * tsp->n_alloc_distinct);
+  }
+  topol->id = tsp->ndistinct++;
+  tsp->distinct[topol->id] = topol;
+  tsp->freq[topol->id] = freq;
+  if (topol->id > 0) for (i=0; i < topol->nleaves; i++) {/* leaf bipartitions never change -> shared among all topologies */
+    del_bipartition (topol->nodelist[i]->split);
+    topol->nodelist[i]->split = tsp->distinct[0]->nodelist[i]->split;
+    tsp->distinct[0]->nodelist[i]->split->ref_counter++;
+  }
+  topology_space_index_insert (tsp, topol->id);
+}
+
+void
+topology_space_index_insert (topology_space tsp, int id)
+{
+  int i;
+  topology topol = tsp->distinct[id];
+
+  if (!topol->traversal_updated) update_topology_traversal (topol);
+  if (2 * tsp->ndistinct > tsp->index_size) { /* at most half full, thus probing sequences are short */
+    tsp->index_size = (tsp->index_size) ? 2 * tsp->index_size : 64;
+    tsp->index_rooted   = (struct topology_space_slot_struct*) biomcmc_realloc ((struct topology_space_slot_struct*) tsp->index_rooted, 
+                                                                               tsp->index_size * sizeof (struct topology_space_slot_struct));
+    tsp->index_unrooted = (struct topology_space_slot_struct*) biomcmc_realloc ((struct topology_space_slot_struct*) tsp->index_unrooted, 
+                                                                               tsp->index_size * sizeof (struct topology_space_slot_struct));
+    for (i = 0; i < tsp->index_size; i++) tsp->index_rooted[i].id = tsp->index_unrooted[i].id = -1;
+    for (i = 0; i < tsp->ndistinct; i++) { /* includes new topology */
+      topology_space_slot_insert (tsp->index_rooted,   tsp->index_size, topology_hash_rooted   (tsp->distinct[i]), i);
+      topology_space_slot_insert (tsp->index_unrooted, tsp->index_size, topology_hash_unrooted (tsp->distinct[i]), i);
+    }
+    return;
+  }
+  topology_space_slot_insert (tsp->index_rooted,   tsp->index_size, topology_hash_rooted   (topol), id);
+  topology_space_slot_insert (tsp->index_unrooted, tsp->index_size, topology_hash_unrooted (topol), id);
+}
+
 /* TODO: create unroot_topol_space() */
 void
 translate_taxa_topology_space (topology_space tsp, char *string, hashtable external_hash) 
@@ -25,6 +25,13 @@
 
 typedef struct topology_space_struct* topology_space;
 
+/*! \brief slot of hash index of distinct topologies (open addressing, see topology_space_struct::index_rooted) */
+struct topology_space_slot_struct
+{
+  uint64_t hash; /*! \brief tree hash (topology_hash_rooted() or topology_hash_unrooted()) */
+  int id;        /*! \brief index of topology in topology_space_struct::distinct, or negative if slot is empty */
+};
+
 /*! \brief Collection of topologies from tree file. When topologies have no branch lengths we store only unique
  * topologies */
 struct topology_space_struct 
@@ -36,6 +43,9 @@ struct topology_space_struct
   hashtable taxlabel_hash;   /*! \brief Lookup table with taxon names. */
   bool is_rooted;            /*! \brief If trees are unrooted, then branch lengths must be accounted for in some comparisons */ 
   char *filename;            /*! \brief name (without extension) of the originating file from where topology_space was read */
+  struct topology_space_slot_struct *index_rooted, *index_unrooted; /*! \brief hash index of distinct topologies, verified by full comparison */
+  int index_size;            /*! \brief number of slots of each index (power of two, at least twice topology_space_struct::ndistinct) */
+  int n_alloc_trees, n_alloc_distinct; /*! \brief allocated sizes of topology_space_struct::tree and ::distinct (and ::freq) */
 };
 
 /*! \brief Read tree in newick format until char string_size, returning updated topolgy_space. Auxiliary for python module */
@@ -0,0 +1,652 @@
+#include <biomcmc.h> 
+#include <check.h>
+#include "likelihood.h"
+
+#define TEST_SUCCESS 0
+#define TEST_FAILURE 1
+#define TEST_SKIPPED 77
+#define TEST_HARDERROR 99
+
+#ifndef TEST_FILE_DIR
+#define TEST_FILE_DIR "./files/"
+#endif
+
+alignment align;
+phylogeny phy;
+topology tree;
+
+void
+random_alignment_setup (void)
+{ /* sequences drift away from a common ancestor, with ambiguous sites and gaps; tree is random */
+  int i, j, ntax = 24, nchar = 2000;
+  char_vector label, seq;
+  char *s, name[16], dna[] = "ACGTACGTACGTRYN-";
+
+  biomcmc_random_number_init (20201);
+  label = new_char_vector (ntax);
+  seq   = new_char_vector (ntax);
+  s = (char*) biomcmc_malloc ((nchar + 1) * sizeof (char));
+  for (j = 0; j < nchar; j++) s[j] = dna[ biomcmc_rng_unif_int (4) ];
+  s[nchar] = '\0';
+  for (i = 0; i < ntax; i++) {
+    for (j = 0; j < nchar; j++) if (biomcmc_rng_unif () < 0.02 * (double)(i+1)) s[j] = dna[ biomcmc_rng_unif_int (16) ];
+    sprintf (name, "seq%d", i);
+    char_vector_add_string (label, name);
+    char_vector_add_string (seq, s);
+  }
+  free (s);
+  align = new_alignment_from_taxlabel_and_character_vectors (label, seq, "random.fasta", true);
+  phy = new_phylogeny_from_alignment (align, 4, 4, 2, NULL);
+  tree = new_topology (ntax);
+  randomise_topology (tree);
+}
+
+void
+random_alignment_teardown (void)
+{
+  del_topology (tree);
+  del_phylogeny (phy);
+  del_alignment (align);
+  biomcmc_random_number_finalize ();
+}
+
+void
+normalise_frequencies (double *pi, int n)
+{
+  int i;
+  double sum = 0.;
+  for (i = 0; i < n; i++) sum += pi[i];
+  for (i = 0; i < n; i++) pi[i] /= sum;
+}
+
+START_TEST(simd_kernels_bitwise_loop)
+{
+  int i, kernel;
+  double lnL, *pat_lnLk = (double*) biomcmc_malloc (phy->npat * sizeof (double));
+
+  set_likelihood_kernel (LK_KERNEL_scalar);
+  ln_likelihood (phy, tree);
+  lnL = phy->lk_proposal;
+  for (i = 0; i < phy->npat; i++) pat_lnLk[i] = phy->pat_lnLk[i];
+
+  kernel = set_likelihood_kernel (_i); /* may be lower than _i, if CPU doesn't support it */
+  ln_likelihood (phy, tree);
+  for (i = 0; i < phy->npat; i++) 
+    if (pat_lnLk[i] != phy->pat_lnLk[i]) ck_abort_msg ("kernel %d differs from scalar at pattern %d", kernel, i);
+  ck_assert_msg (lnL == phy->lk_proposal, "kernel %d: lnL = %.17g but scalar lnL = %.17g", kernel, phy->lk_proposal, lnL);
+  free (pat_lnLk);
+}
+END_TEST
+
+START_TEST(tip_kernels_bitwise)
+{
+  int i;
+  uint8_t **tip = phy->tip;
+  double lnL, *pat_lnLk = (double*) biomcmc_malloc (phy->npat * sizeof (double));
+
+  ln_likelihood (phy, tree);
+  lnL = phy->lk_proposal;
+  for (i = 0; i < phy->npat; i++) pat_lnLk[i] = phy->pat_lnLk[i];
+
+  phy->tip = NULL; /* leaves are then treated as internal nodes */
+  ln_likelihood (phy, tree);
+  phy->tip = tip;
+  for (i = 0; i < phy->npat; i++) 
+    if (pat_lnLk[i] != phy->pat_lnLk[i]) ck_abort_msg ("tip kernels differ from full leaf vectors at pattern %d", i);
+  ck_assert_msg (lnL == phy->lk_proposal, "tip lnL = %.17g but full leaf lnL = %.17g", lnL, phy->lk_proposal);
+  free (pat_lnLk);
+}
+END_TEST
+
+START_TEST(moved_branches_equal_full_likelihood)
+{
+  int i;
+  ln_likelihood (phy, tree);
+  accept_likelihood (phy, tree);
+  for (i = 0; i < 20; i++) {
+    topology_apply_spr (tree, true);
+    ln_likelihood_moved_branches (phy, tree);
+    if (i % 2) accept_likelihood_moved_branches (phy, tree);
+    else topology_undo_random_move (tree, true);
+  }
+  ln_likelihood (phy, tree);
+  ck_assert_double_eq_tol (phy->lk_proposal, phy->lk_current, 1e-6);
+}
+END_TEST
+
+START_TEST(checkpoints_equal_full_storage)
+{
+  int i, n_checkpoints = 0;
+  size_t full, bytes;
+  double lnL, cost;
+
+  phylogeny_set_threads (phy, 3);
+  ln_likelihood (phy, tree);
+  lnL = phy->lk_proposal;
+  full = phylogeny_set_memory_budget (phy, tree, 0, &cost); /* all vectors stored */
+  ck_assert (!phy->checkpoint);
+  ck_assert_double_eq (cost, 1.);
+  bytes = phylogeny_set_memory_budget (phy, tree, full / 3, &cost);
+  ck_assert_msg ((bytes <= full / 3) && (cost > 1.), "%lu bytes (full storage: %lu), recompute cost %g", bytes, full, cost);
+  for (i = tree->nleaves; i < tree->nnodes; i++) if (phy->checkpoint[i]) n_checkpoints++;
+  ck_assert (n_checkpoints > 0 && n_checkpoints < tree->nleaves - 2);
+
+  ln_likelihood (phy, tree);
+  ck_assert (phy->lk_proposal == lnL); /* same calculations, in cache */
+  accept_likelihood (phy, tree);
+  for (i = 0; i < 40; i++) {
+    if (i % 3) topology_apply_spr (tree, true);
+    else       topology_apply_nni (tree, true);
+    ln_likelihood_moved_branches (phy, tree);
+    lnL = phy->lk_proposal;
+    if (i % 2) accept_likelihood_moved_branches (phy, tree);
+    else topology_undo_random_move (tree, true);
+    if (i % 10 == 9) { /* ln_likelihood() overwrites all proposal vectors */
+      ln_likelihood (phy, tree);
+      if (i % 2) ck_assert (phy->lk_proposal == lnL);
+      accept_likelihood (phy, tree);
+    }
+  }
+  ln_likelihood_moved_branches (phy, tree);
+  lnL = phy->lk_proposal;
+  ck_assert (phylogeny_set_memory_budget (phy, tree, full / 5, NULL) < bytes); /* new checkpoints for current tree */
+  ln_likelihood (phy, tree);
+  ck_assert_double_eq_tol (phy->lk_proposal, lnL, 1e-6);
+  ck_assert (phylogeny_set_memory_budget (phy, tree, 2 * full, NULL) == full);
+  ln_likelihood (phy, tree);
+  ck_assert_double_eq_tol (phy->lk_proposal, lnL, 1e-6);
+}
+END_TEST
+
+START_TEST(single_precision_close_to_double)
+{
+  int i;
+  size_t full;
+  double lnL, lnL_double;
+
+  ln_likelihood (phy, tree);
+  lnL_double = phy->lk_proposal;
+  full = phylogeny_set_memory_budget (phy, tree, 0, NULL);
+  phylogeny_set_single_precision (phy, true);
+  ck_assert (phylogeny_set_memory_budget (phy, tree, 0, NULL) < full);
+  ln_likelihood (phy, tree);
+  ck_assert_double_eq_tol (phy->lk_proposal, lnL_double, 1e-5 * fabs (lnL_double));
+  lnL = phy->lk_proposal;
+  phylogeny_set_threads (phy, 3);
+  ln_likelihood (phy, tree);
+  ck_assert (phy->lk_proposal == lnL); /* same rounding, whatever the number of threads */
+  accept_likelihood (phy, tree);
+  for (i = 0; i < 40; i++) {
+    if (i % 3) topology_apply_spr (tree, true);
+    else       topology_apply_nni (tree, true);
+    ln_likelihood_moved_branches (phy, tree);
+    lnL = phy->lk_proposal;
+    if (i % 2) accept_likelihood_moved_branches (phy, tree);
+    else topology_undo_random_move (tree, true);
+    if (i % 10 == 9) { /* stored values are the ones used when calculated */
+      ln_likelihood (phy, tree);
+      if (i % 2) ck_assert (phy->lk_proposal == lnL);
+      accept_likelihood (phy, tree);
+    }
+  }
+  ln_likelihood (phy, tree);
+  lnL = phy->lk_proposal;
+  phylogeny_set_memory_budget (phy, tree, full / 4, NULL); /* checkpoints also in single precision */
+  ck_assert (phy->checkpoint);
+  ln_likelihood (phy, tree);
+  ck_assert_double_eq_tol (phy->lk_proposal, lnL, 1e-5 * fabs (lnL)); /* recalculated nodes are not rounded */
+  phylogeny_set_single_precision (phy, false);
+  phylogeny_set_memory_budget (phy, tree, 0, NULL);
+  ln_likelihood (phy, tree);
+  ck_assert_double_eq_tol (phy->lk_proposal, lnL, 1e-5 * fabs (lnL));
+}
+END_TEST
+
+START_TEST(partitions_sum_to_full_likelihood)
+{
+  int i, n_sites = 0, start[] = {0, 300, 1300}, end[] = {299, 1299, 1999}; /* charsets, as read from ASSUMPTIONS block */
+  double lnL;
+  partitioned_phylogeny pp;
+
+  align->n_charset = 3;
+  align->charset_start = (int*) biomcmc_malloc (3 * sizeof (int));
+  align->charset_end   = (int*) biomcmc_malloc (3 * sizeof (int));
+  for (i = 0; i < 3; i++) { align->charset_start[i] = start[i]; align->charset_end[i] = end[i]; }
+  pp = new_partitioned_phylogeny_from_alignment (align, 4, 4, 2);
+  ck_assert_int_eq (pp->n_part, 3);
+  for (i = 0; i < 3; i++) {
+    ck_assert_int_le (pp->part[i]->npat, end[i] - start[i] + 1);
+    n_sites += pp->part[i]->nsites;
+  }
+  ck_assert_int_eq (n_sites, align->nchar);
+  ck_assert_int_eq (pp->order[0], 1); /* largest partition first */
+
+  ln_likelihood (phy, tree); /* same initial model parameters in all partitions */
+  ln_likelihood_partitions (pp, tree);
+  ck_assert_double_eq_tol (pp->lk_proposal, phy->lk_proposal, 1e-8 * fabs (phy->lk_proposal));
+  lnL = pp->lk_proposal;
+  partitioned_phylogeny_set_threads (pp, 4); /* partition 1 has more than 1/4 of the patterns, and uses all threads */
+  ck_assert_int_eq (pp->owner[1], -1);
+  ln_likelihood_partitions (pp, tree);
+  ck_assert (pp->lk_proposal == lnL);
+  accept_likelihood_partitions (pp, tree);
+
+  for (i = 0; i < 10; i++) {
+    topology_apply_spr (tree, true);
+    ln_likelihood_moved_branches_partitions (pp, tree);
+    if (i % 2) accept_likelihood_moved_branches_partitions (pp, tree);
+    else topology_undo_random_move (tree, true);
+  }
+  ln_likelihood_partitions (pp, tree);
+  ck_assert_double_eq_tol (pp->lk_proposal, pp->lk_current, 1e-6);
+  del_partitioned_phylogeny (pp);
+}
+END_TEST
+
+START_TEST(pmatrix_from_branch_length)
+{
+  int cat, s1, s2, n_cat = phy->model->nrates;
+  double *P = (double*) biomcmc_malloc_aligned (32 * n_cat * sizeof (double)), expo[4], sum, t[3] = {0., 0.3, 1e4};
+  for (int k = 0; k < 3; k++) {
+    update_pmatrix_from_branch_length (phy->model, t[k], P, NULL, expo);
+    for (cat = 0; cat < n_cat; cat++) for (s1 = 0; s1 < 4; s1++) {
+      for (sum = 0., s2 = 0; s2 < 4; s2++) {
+        sum += P[(cat * 4 + s2) * 8 + s1];
+        if (k == 0) ck_assert_double_eq_tol (P[(cat * 4 + s2) * 8 + s1], (double)(s1 == s2), 1e-12);
+        if (k == 2) ck_assert_double_eq_tol (P[(cat * 4 + s2) * 8 + s1], phy->model->pi[s2], 1e-8);
+      }
+      ck_assert_double_eq_tol (sum, 1., 1e-12);
+    }
+  }
+  free (P);
+}
+END_TEST
+
+START_TEST(branch_lengths_cached)
+{
+  int i, changed = 0;
+  double lnL, *P;
+  for (i = 0; i < tree->nnodes; i++) tree->blength[i] = 0.01 + 0.1 * biomcmc_rng_unif ();
+  phylogeny_use_branch_lengths (phy, true);
+  ln_likelihood (phy, tree);
+  lnL = phy->lk_proposal;
+  ck_assert (isfinite (lnL));
+
+  changed = tree->root->left->left ? tree->root->left->left->id : tree->root->right->left->id; /* not child of root */
+  P = phy->pmat->P[changed];
+  tree->blength[changed] *= 3.;
+  update_branch_pmatrix_from_topology (phy, tree);
+  ck_assert_msg (P == phy->pmat->P[changed], "matrices should be reused");
+  for (i = 0; i < tree->nnodes; i++) if ((tree->nodelist[i]->up != tree->root) && (tree->nodelist[i] != tree->root))
+    ck_assert_double_eq (phy->pmat->t[i], tree->blength[i]);
+  ln_likelihood (phy, tree);
+  ck_assert_msg (lnL != phy->lk_proposal, "likelihood should change with branch length");
+  tree->blength[changed] /= 3.;
+  ln_likelihood (phy, tree);
+  ck_assert_double_eq_tol (lnL, phy->lk_proposal, 1e-8);
+}
+END_TEST
+
+START_TEST(branch_lengths_model_change)
+{ /* integrated Q is not needed with branch lengths, thus only psi and rates are updated */
+  int i, j, n = 32 * phy->model->nrates;
+  double lnL, *P = (double*) biomcmc_malloc_aligned (n * sizeof (double)), expo[4];
+  for (i = 0; i < tree->nnodes; i++) tree->blength[i] = 0.01 + 0.1 * biomcmc_rng_unif ();
+  phylogeny_use_branch_lengths (phy, true);
+  ln_likelihood (phy, tree);
+  lnL = phy->lk_proposal;
+
+  for (j = 0; j < 2; j++) {
+    if (j) update_model_rates_from_gamma (phy->model, 0.3, 0.3);
+    else   update_model_eigenvalues_from_kappa (phy->model, 4. * phy->model->kappa);
+    update_branch_pmatrix_from_topology (phy, tree);
+    for (i = 0; i < tree->nnodes; i++) if (tree->nodelist[i]->up != tree->root) {
+      update_pmatrix_from_branch_length (phy->model, phy->pmat->t[i], P, NULL, expo);
+      ck_assert_msg (!memcmp (P, phy->pmat->P[i], n * sizeof (double)), "cached matrix of node %d is stale", i);
+    }
+    ln_likelihood (phy, tree);
+    ck_assert_msg (lnL != phy->lk_proposal, "likelihood should change with model");
+    lnL = phy->lk_proposal;
+  }
+  free (P);
+}
+END_TEST
+
+START_TEST(nstate_kernels_bitwise)
+{
+  int i, k, level, n_cat = 3, n_pat = 37, n_state[] = {4, 20, 61};
+  double *pi, *left, *right, *res, *res_generic;
+  evolution_model m;
+
+  biomcmc_random_number_init (20202);
+  for (k = 0; k < 3; k++) {
+    m = new_evolution_model (n_cat, n_state[k]);
+    pi = (double*) biomcmc_malloc (n_state[k] * sizeof (double));
+    for (i = 0; i < n_state[k]; i++) pi[i] = 0.5 + biomcmc_rng_unif ();
+    normalise_frequencies (pi, n_state[k]);
+    init_evolution_model_parameters (m, 2., 1., 1., pi);
+    left  = (double*) biomcmc_malloc_aligned (n_pat * n_cat * n_state[k] * sizeof (double));
+    right = (double*) biomcmc_malloc_aligned (n_pat * n_cat * n_state[k] * sizeof (double));
+    res   = (double*) biomcmc_malloc_aligned (n_pat * n_cat * n_state[k] * sizeof (double));
+    res_generic = (double*) biomcmc_malloc_aligned (n_pat * n_cat * n_state[k] * sizeof (double));
+    for (i = 0; i < n_pat * n_cat * n_state[k]; i++) { left[i] = biomcmc_rng_unif (); right[i] = biomcmc_rng_unif (); }
+
+    lk_kernel_partial_nstate (res_generic, left, m->Qv, right, m->Qv, n_state[k], n_cat, 1, n_pat * n_cat);
+    for (level = LK_KERNEL_scalar; level <= LK_KERNEL_avx512; level++) {
+      set_likelihood_kernel (level);
+      if      (n_state[k] == 4)  lk_kernel_partial_4state  (res, left, m->Qv, right, m->Qv, n_cat, 1, n_pat * n_cat);
+      else if (n_state[k] == 20) lk_kernel_partial_20state (res, left, m->Qv, right, m->Qv, n_cat, 1, n_pat * n_cat);
+      else                       lk_kernel_partial_61state (res, left, m->Qv, right, m->Qv, n_cat, 1, n_pat * n_cat);
+      for (i = n_state[k]; i < n_pat * n_cat * n_state[k]; i++) 
+        if (res[i] != res_generic[i]) ck_abort_msg ("%d states, kernel %d differs from generic at %d", n_state[k], level, i);
+    }
+    free (res_generic); free (res); free (right); free (left); free (pi);
+    del_evolution_model (m);
+  }
+  set_likelihood_kernel (LK_KERNEL_avx512);
+  biomcmc_random_number_finalize ();
+}
+END_TEST
+
+START_TEST(equal_input_pmatrix)
+{
+  int i, cat, s1, s2, n = 20, n_cat = 2;
+  double *P = (double*) biomcmc_malloc_aligned (2 * n * n * n_cat * sizeof (double)), expo[20], pi[20], sum, t[3] = {0., 0.3, 1e4};
+  evolution_model m = new_evolution_model (n_cat, n);
+
+  for (i = 0; i < n; i++) pi[i] = (double)(i + 1);
+  normalise_frequencies (pi, n);
+  init_evolution_model_parameters (m, 1., 1., 1., pi);
+  for (int k = 0; k < 3; k++) {
+    update_pmatrix_from_branch_length (m, t[k], P, NULL, expo);
+    for (cat = 0; cat < n_cat; cat++) for (s1 = 0; s1 < n; s1++) {
+      for (sum = 0., s2 = 0; s2 < n; s2++) {
+        sum += P[(cat * n + s2) * 2 * n + s1];
+        if (k == 0) ck_assert_double_eq_tol (P[(cat * n + s2) * 2 * n + s1], (double)(s1 == s2), 1e-12);
+        if (k == 2) ck_assert_double_eq_tol (P[(cat * n + s2) * 2 * n + s1], pi[s2], 1e-8);
+      }
+      ck_assert_double_eq_tol (sum, 1., 1e-12);
+    }
+  }
+  for (cat = 0; cat < n_cat; cat++) for (s1 = 0; s1 < n; s1++) { /* integrated Q must also be a transition matrix */
+    for (sum = 0., s2 = 0; s2 < n; s2++) sum += m->Q[cat][s1][s2];
+    ck_assert_double_eq_tol (sum, 1., 1e-12);
+  }
+  del_evolution_model (m);
+  free (P);
+}
+END_TEST
+
+START_TEST(codon_likelihood)
+{
+  int i, j, c, ntax = 12, n_pat = 50, n_cat = 2, n = 61;
+  double lnL, pi[61];
+  phylogeny cphy = new_phylogeny (ntax, n_cat, n_pat, n, 1);
+  topology ctree = new_topology (ntax);
+
+  biomcmc_random_number_init (20203);
+  for (i = 0; i < n; i++) pi[i] = 1./(double) n;
+  init_evolution_model_parameters (cphy->model, 1., 1., 1., pi);
+  for (i = 0; i < n_pat; i++) cphy->weight[i] = 1.;
+  for (i = 0; i < ntax; i++) for (j = 0; j < n_pat; j++) { /* leaves observe a random codon, except for column zero */
+    c = (j ? biomcmc_rng_unif_int (n) : 0);
+    for (int k = 0; k < n_cat * n; k++) cphy->l[i]->d[0]->lk[j * n_cat * n + k] = (double)(k % n == c);
+    for (int k = 0; k < n_cat; k++) cphy->l[i]->d[0]->scale[j * n_cat + k] = 0;
+  }
+  randomise_topology (ctree);
+  set_likelihood_kernel (LK_KERNEL_scalar);
+  ln_likelihood (cphy, ctree);
+  lnL = cphy->lk_proposal;
+  ck_assert (isfinite (lnL) && (lnL < 0.));
+  ck_assert (cphy->pat_lnLk[0] > cphy->pat_lnLk[1]); /* constant column is more likely */
+  set_likelihood_kernel (LK_KERNEL_avx512);
+  ln_likelihood (cphy, ctree);
+  ck_assert_msg (lnL == cphy->lk_proposal, "SIMD lnL = %.17g but scalar lnL = %.17g", cphy->lk_proposal, lnL);
+  phylogeny_update_leaf_site_repeats (cphy);
+  ln_likelihood (cphy, ctree);
+  ck_assert_msg (lnL == cphy->lk_proposal, "site repeats lnL = %.17g but scalar lnL = %.17g", cphy->lk_proposal, lnL);
+
+  del_topology (ctree);
+  del_phylogeny (cphy);
+  biomcmc_random_number_finalize ();
+}
+END_TEST
+
+START_TEST(deep_tree_scaling)
+{ /* likelihood of each pattern is much smaller than DBL_MIN, and leaf vectors x 2 must give lnL + ntax x ln(2) */
+  int i, j, c, ntax = 1200, n_pat = 16, n_cat = 2, n = 4;
+  double lnL, pi[4] = {0.25, 0.25, 0.25, 0.25};
+  phylogeny dphy = new_phylogeny (ntax, n_cat, n_pat, n, 1);
+  topology dtree = new_topology (ntax);
+
+  biomcmc_random_number_init (20204);
+  init_evolution_model_parameters (dphy->model, 1., 1., 1., pi);
+  for (i = 0; i < n_pat; i++) dphy->weight[i] = 1.;
+  for (i = 0; i < ntax; i++) for (j = 0; j < n_pat; j++) {
+    c = biomcmc_rng_unif_int (n);
+    for (int k = 0; k < n_cat * n; k++) dphy->l[i]->d[0]->lk[j * n_cat * n + k] = (double)(k % n == c);
+    for (int k = 0; k < n_cat; k++) dphy->l[i]->d[0]->scale[j * n_cat + k] = 0;
+  }
+  randomise_topology (dtree);
+  ln_likelihood (dphy, dtree);
+  lnL = dphy->lk_proposal;
+  for (i = 0; i < n_pat; i++) 
+    ck_assert_msg (isfinite (dphy->pat_lnLk[i]) && (dphy->pat_lnLk[i] < log (DBL_MIN)), "pattern %d: lnL = %g", i, dphy->pat_lnLk[i]);
+
+  for (i = 0; i < ntax; i++) for (j = 0; j < n_pat * n_cat * n; j++) dphy->l[i]->d[0]->lk[j] *= 2.;
+  ln_likelihood (dphy, dtree);
+  ck_assert_double_eq_tol (dphy->lk_proposal, lnL + (double)(ntax * n_pat) * M_LN2, 1e-12 * fabs (lnL));
+
+  del_topology (dtree);
+  del_phylogeny (dphy);
+  biomcmc_random_number_finalize ();
+}
+END_TEST
+
+START_TEST(thread_slices_bitwise)
+{
+  int i, n_threads[] = {3, 7, 10000};
+  double lnL, *pat_lnLk = (double*) biomcmc_malloc (phy->npat * sizeof (double));
+
+  phylogeny_set_threads (phy, 1);
+  ln_likelihood (phy, tree);
+  lnL = phy->lk_proposal;
+  for (i = 0; i < phy->npat; i++) pat_lnLk[i] = phy->pat_lnLk[i];
+
+  for (int k = 0; k < 3; k++) {
+    phylogeny_set_threads (phy, n_threads[k]);
+    ck_assert_int_le (phy->n_threads, (phy->npat + LikPatternBlock - 1) / LikPatternBlock);
+    ck_assert_int_eq (phy->slice[phy->n_threads], (phy->npat + LikPatternBlock - 1) / LikPatternBlock);
+    ln_likelihood (phy, tree);
+    for (i = 0; i < phy->npat; i++) 
+      if (pat_lnLk[i] != phy->pat_lnLk[i]) ck_abort_msg ("%d threads differ from one thread at pattern %d", phy->n_threads, i);
+    ck_assert_msg (lnL == phy->lk_proposal, "%d threads: lnL = %.17g but one thread lnL = %.17g", phy->n_threads, phy->lk_proposal, lnL);
+  }
+  free (pat_lnLk);
+}
+END_TEST
+
+START_TEST(site_repeats_bitwise)
+{
+  int i, j, n_repeats = 0;
+  double lnL, *pat_lnLk = (double*) biomcmc_malloc (phy->npat * sizeof (double));
+
+  ln_likelihood (phy, tree);
+  accept_likelihood (phy, tree);
+  for (i = 0; i < 20; i++) {
+    topology_apply_spr (tree, true);
+    ln_likelihood_moved_branches (phy, tree); /* repeats are updated only for nodes below the SPR */
+    lnL = phy->lk_proposal;
+    if (i % 2) { 
+      accept_likelihood_moved_branches (phy, tree);
+      /* scaling may differ from full calculation (node levels change), thus moved branches are not bitwise identical */
+      phy->site_repeats = false;
+      ln_likelihood (phy, tree);
+      ck_assert_double_eq_tol (lnL, phy->lk_proposal, 1e-8);
+      for (j = 0; j < phy->npat; j++) pat_lnLk[j] = phy->pat_lnLk[j];
+      phy->site_repeats = true;
+      ln_likelihood (phy, tree);
+      for (j = 0; j < phy->npat; j++) 
+        if (pat_lnLk[j] != phy->pat_lnLk[j]) ck_abort_msg ("site repeats change likelihood at pattern %d, iteration %d", j, i);
+    }
+    else topology_undo_random_move (tree, true);
+  }
+  for (j = tree->nleaves; j < tree->nnodes; j++) for (i = 0; i < phy->npat; i++) 
+    n_repeats += (phy->l[j]->d_current->next->rep[i] != i % LikPatternBlock);
+  ck_assert_msg (n_repeats > 0, "no site repeats found");
+  free (pat_lnLk);
+}
+END_TEST
+
+START_TEST(spr_candidates_equal_full_likelihood)
+{
+  int i, j, n = 0, *prune = (int*) biomcmc_malloc (2 * tree->nnodes * tree->nnodes * sizeof (int)), *regraft = prune + tree->nnodes * tree->nnodes;
+  double *lnLk = (double*) biomcmc_malloc (2 * tree->nnodes * tree->nnodes * sizeof (double)), *lnLk_threads = lnLk + tree->nnodes * tree->nnodes;
+  topol_node p, r;
+
+  ln_likelihood (phy, tree);
+  accept_likelihood (phy, tree);
+  for (i = 0; i < tree->nnodes; i++) for (j = 0; j < tree->nnodes; j++) { /* all SPR neighbours, including reroots */
+    p = tree->nodelist[i]; r = tree->nodelist[j];
+    if ((r == p) || (r->up == p) || ((p != tree->root) && ((r == p->up) || (r == p->sister)))) continue;
+    prune[n] = i; regraft[n++] = j;
+  }
+  phylogeny_set_threads (phy, 1);
+  ln_likelihood_spr_candidates (phy, tree, prune, regraft, n, lnLk);
+  phylogeny_set_threads (phy, 5);
+  ln_likelihood_spr_candidates (phy, tree, prune, regraft, n, lnLk_threads);
+
+  for (i = 0; i < n; i++) {
+    ck_assert_msg (lnLk[i] == lnLk_threads[i], "candidate %d: lnL depends on number of threads", i);
+    apply_spr_at_nodes (tree, tree->nodelist[prune[i]], tree->nodelist[regraft[i]], false);
+    update_topology_traversal (tree);
+    ln_likelihood (phy, tree);
+    ck_assert_double_eq_tol (lnLk[i], phy->lk_proposal, 1e-6);
+    topology_undo_random_move (tree, false);
+    update_topology_traversal (tree);
+  }
+  free (prune);
+  free (lnLk);
+}
+END_TEST
+
+START_TEST(branch_length_optimisation)
+{
+  int i, k;
+  double lnL, lnL0, t, h = 1e-4, *blen = (double*) biomcmc_malloc (2 * tree->nnodes * sizeof (double));
+  topol_node node = tree->root->left->left ? tree->root->left->left : tree->root->right->left; /* not child of root */
+
+  for (i = 0; i < tree->nnodes; i++) blen[i] = tree->blength[i] = 0.01 + 0.1 * biomcmc_rng_unif ();
+  phylogeny_use_branch_lengths (phy, true);
+  ln_likelihood (phy, tree);
+  accept_likelihood (phy, tree);
+  lnL0 = phy->lk_current;
+
+  lnL = ln_likelihood_optimise_branch_length (phy, tree, node);
+  ck_assert (lnL >= lnL0);
+  ln_likelihood (phy, tree); /* optimiser keeps current partial likelihoods up to date */
+  ck_assert_double_eq_tol (lnL, phy->lk_proposal, 1e-6);
+  t = tree->blength[node->id];
+  for (k = -1; k < 2; k += 2) if (t + k * h > 0.) { /* local maximum (or at lower bound) */
+    tree->blength[node->id] = t + k * h;
+    ln_likelihood (phy, tree);
+    ck_assert_msg (phy->lk_proposal < lnL + 1e-8, "branch length %g is not a maximum (%.12g < %.12g)", t, lnL, phy->lk_proposal);
+  }
+  tree->blength[node->id] = t;
+
+  for (k = 0; k < 2; k++) { /* result doesn't depend on number of threads */
+    for (i = 0; i < tree->nnodes; i++) tree->blength[i] = blen[i];
+    phylogeny_set_threads (phy, 1 + 4 * k);
+    ln_likelihood (phy, tree);
+    accept_likelihood (phy, tree);
+    lnL = ln_likelihood_optimise_branch_lengths (phy, tree, 20, 1e-6);
+    ck_assert (lnL > lnL0);
+    ln_likelihood (phy, tree);
+    ck_assert_double_eq_tol (lnL, phy->lk_proposal, 1e-6);
+    if (!k) for (i = 0; i < tree->nnodes; i++) blen[tree->nnodes + i] = tree->blength[i];
+    else for (i = 0; i < tree->nnodes; i++) ck_assert_msg (blen[tree->nnodes + i] == tree->blength[i], "branch %d depends on threads", i);
+  }
+  free (blen);
+}
+END_TEST
+
+START_TEST(rell_bootstrap_replicates)
+{
+  int i, j, rep, n_rep = 100, n_cand = 4;
+  double lnLk, sum, support[5], *pat_lnLk = (double*) biomcmc_malloc (n_cand * phy->npat * sizeof (double));
+  rell_bootstrap rell = new_rell_bootstrap (phy, n_rep);
+
+  for (rep = 0; rep < n_rep; rep++) { /* each replicate resamples all sites */
+    for (sum = 0., i = 0; i < phy->npat; i++) sum += rell->weight[i * n_rep + rep];
+    ck_assert_double_eq (sum, (double) align->nchar);
+  }
+  ln_likelihood (phy, tree);
+  for (i = 0; i < phy->npat; i++) pat_lnLk[i] = phy->pat_lnLk[i];
+  for (i = 1; i < n_cand; i++) { /* other candidates are SPR neighbours of tree */
+    topology_apply_spr (tree, false);
+    ln_likelihood (phy, tree);
+    for (j = 0; j < phy->npat; j++) pat_lnLk[i * phy->npat + j] = phy->pat_lnLk[j];
+    topology_undo_random_move (tree, false);
+  }
+  for (i = 0; i < n_cand; i++) ck_assert_int_eq (i, rell_bootstrap_add_candidate (rell, pat_lnLk + i * phy->npat));
+  ck_assert_int_eq (rell_bootstrap_add_candidate (rell, pat_lnLk), n_cand); // duplicate of first, thus never best
+  for (i = 0; i < n_cand; i++) for (rep = 0; rep < n_rep; rep++) {
+    for (lnLk = 0., j = 0; j < phy->npat; j++) lnLk += rell->weight[j * n_rep + rep] * pat_lnLk[i * phy->npat + j];
+    ck_assert_double_eq_tol (lnLk, rell->lnLk[i * n_rep + rep], 1e-9 * fabs (lnLk));
+  }
+  rell_bootstrap_support (rell, support);
+  for (sum = 0., i = 0; i < n_cand; i++) sum += support[i];
+  ck_assert_double_eq_tol (sum, 1., 1e-12);
+  ck_assert (support[n_cand] == 0.);
+  ck_assert_double_eq (rell->lnLk[n_cand * n_rep], rell->lnLk[0]);
+  del_rell_bootstrap (rell);
+  free (pat_lnLk);
+}
+END_TEST
+
+Suite * likelihood_suite(void)
+{
+  Suite *s;
+  TCase *tc_case;
+
+  s = suite_create("Likelihood");
+  tc_case = tcase_create("simd_kernels");
+  tcase_add_checked_fixture(tc_case, random_alignment_setup, random_alignment_teardown);
+  tcase_add_loop_test (tc_case, simd_kernels_bitwise_loop, LK_KERNEL_sse2, LK_KERNEL_avx512 + 1); // loops, using index _i
+  tcase_add_test(tc_case, tip_kernels_bitwise);
+  tcase_add_test(tc_case, moved_branches_equal_full_likelihood);
+  tcase_add_test(tc_case, checkpoints_equal_full_storage);
+  tcase_add_test(tc_case, thread_slices_bitwise);
+  tcase_add_test(tc_case, site_repeats_bitwise);
+  tcase_add_test(tc_case, spr_candidates_equal_full_likelihood);
+  tcase_add_test(tc_case, rell_bootstrap_replicates);
+  tcase_add_test(tc_case, single_precision_close_to_double);
+  tcase_add_test(tc_case, partitions_sum_to_full_likelihood);
+  suite_add_tcase(s, tc_case);
+  tc_case = tcase_create("branch_lengths");
+  tcase_add_checked_fixture(tc_case, random_alignment_setup, random_alignment_teardown);
+  tcase_add_test(tc_case, pmatrix_from_branch_length);
+  tcase_add_test(tc_case, branch_lengths_cached);
+  tcase_add_test(tc_case, branch_lengths_model_change);
+  tcase_add_test(tc_case, branch_length_optimisation);
+  suite_add_tcase(s, tc_case);
+  tc_case = tcase_create("state_spaces");
+  tcase_add_test(tc_case, nstate_kernels_bitwise);
+  tcase_add_test(tc_case, equal_input_pmatrix);
+  tcase_add_test(tc_case, codon_likelihood);
+  tcase_add_test(tc_case, deep_tree_scaling);
+  suite_add_tcase(s, tc_case);
+  return s;
+}
+
+int main(void)
+{
+  int number_failed;
+  SRunner *sr;
+
+  sr = srunner_create (likelihood_suite());
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed > 0) ? TEST_FAILURE:TEST_SUCCESS;
+}
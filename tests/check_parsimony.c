@@ -0,0 +1,307 @@
+#include <biomcmc.h>
+#include <check.h>
+
+#define TEST_SUCCESS 0
+#define TEST_FAILURE 1
+#define TEST_SKIPPED 77
+#define TEST_HARDERROR 99
+
+binary_parsimony pars;
+topology sptree;
+int n_species = 40;
+alignment align;
+dna_parsimony dpars;
+topology tree;
+
+void
+random_gene_trees_setup (void)
+{ /* gene trees have random topologies over random subsets of species */
+  int i, j, k, n_genes = 120, *map, *species;
+  topology gtree;
+
+  biomcmc_random_number_init (20211);
+  species = (int*) biomcmc_malloc (n_species * sizeof (int));
+  map = (int*) biomcmc_malloc (n_species * sizeof (int));
+  for (i = 0; i < n_species; i++) species[i] = i;
+  pars = new_binary_parsimony (n_species);
+  for (i = 0; i < n_genes; i++) {
+    gtree = new_topology (4 + biomcmc_rng_unif_int (n_species - 3));
+    randomise_topology (gtree);
+    for (j = 0; j < gtree->nleaves; j++) { // partial Fisher-Yates shuffle
+      k = j + biomcmc_rng_unif_int (n_species - j);
+      map[j] = species[k]; species[k] = species[j]; species[j] = map[j];
+    }
+    update_binary_parsimony_from_topology (pars, gtree, map, gtree->nleaves);
+    if (i % 3) update_binary_parsimony_from_topology (pars, gtree, map, gtree->nleaves); // duplicate columns
+    del_topology (gtree);
+  }
+  sptree = new_topology (n_species);
+  free (species);
+  free (map);
+}
+
+void
+random_gene_trees_teardown (void)
+{
+  del_topology (sptree);
+  del_binary_parsimony (pars);
+  biomcmc_random_number_finalize ();
+}
+
+void
+random_alignment_setup (void)
+{ /* sequences drift away from a common ancestor, with ambiguous sites and gaps; tree is random */
+  int i, j, ntax = 24, nchar = 3000;
+  char_vector label, seq;
+  char *s, name[16], dna[] = "ACGTACGTACGTRYN-";
+
+  biomcmc_random_number_init (20212);
+  label = new_char_vector (ntax);
+  seq   = new_char_vector (ntax);
+  s = (char*) biomcmc_malloc ((nchar + 1) * sizeof (char));
+  for (j = 0; j < nchar; j++) s[j] = dna[ biomcmc_rng_unif_int (4) ];
+  s[nchar] = '\0';
+  for (i = 0; i < ntax; i++) {
+    for (j = 0; j < nchar; j++) if (biomcmc_rng_unif () < 0.02 * (double)(i+1)) s[j] = dna[ biomcmc_rng_unif_int (16) ];
+    sprintf (name, "seq%d", i);
+    char_vector_add_string (label, name);
+    char_vector_add_string (seq, s);
+  }
+  free (s);
+  align = new_alignment_from_taxlabel_and_character_vectors (label, seq, "random.fasta", true);
+  dpars = new_dna_parsimony_from_alignment (align);
+  tree = new_topology (ntax);
+  randomise_topology (tree);
+}
+
+void
+random_alignment_teardown (void)
+{
+  del_topology (tree);
+  del_dna_parsimony (dpars);
+  del_alignment (align);
+  biomcmc_random_number_finalize ();
+}
+
+int
+bytewise_fitch_score (binary_parsimony pars, topology t, double *costs)
+{ /* reference implementation, one column at a time over 2-bit states */
+  int i, j, pars_score = 0, incompatible = 0, score, nl = t->nleaves;
+  bool s1, s2, *state = (bool*) biomcmc_malloc (t->nnodes * sizeof (bool));
+  binary_parsimony_datamatrix mrp = pars->external;
+  topol_node node;
+
+  costs[2] = costs[3] = 0.;
+  for (i = 0; i < mrp->i; i++) {
+    for (j = 0; j < nl; j++) state[j] = mrp->s[j][i];
+    for (score = 0, j = 0; j < nl - 2; j++) {
+      node = t->postorder[j];
+      s1 = state[node->left->id];
+      s2 = state[node->right->id];
+      state[node->id] = s1 & s2;
+      if (!state[node->id]) { score++; state[node->id] = s1 | s2; }
+    }
+    pars_score += score * mrp->freq[i];
+    if (score > 1) incompatible += mrp->freq[i];
+    costs[2] += (double) (score * mrp->freq[i]) / (double) (mrp->occupancy[i]);
+    costs[3] += (double) (score * mrp->freq[i]) / (double) (mrp->ntax - mrp->occupancy[i] + 1);
+  }
+  costs[0] = pars_score;
+  costs[1] = incompatible;
+  free (state);
+  return pars_score;
+}
+
+int
+bytewise_fitch_unrooted_score (binary_parsimony pars, topology t)
+{ /* same as bytewise_fitch_score(), but also with the step at the root */
+  int i, j, pars_score = 0, score, nl = t->nleaves;
+  bool s1, s2, *state = (bool*) biomcmc_malloc (t->nnodes * sizeof (bool));
+  binary_parsimony_datamatrix mrp = pars->external;
+  topol_node node;
+
+  for (i = 0; i < mrp->i; i++) {
+    for (j = 0; j < nl; j++) state[j] = mrp->s[j][i];
+    for (score = 0, j = 0; j < nl - 1; j++) {
+      node = t->postorder[j];
+      s1 = state[node->left->id];
+      s2 = state[node->right->id];
+      state[node->id] = s1 & s2;
+      if (!state[node->id]) { score++; state[node->id] = s1 | s2; }
+    }
+    pars_score += score * mrp->freq[i];
+  }
+  free (state);
+  return pars_score;
+}
+
+START_TEST(bitsliced_fitch_equal_bytewise)
+{
+  int i, j, score;
+  double costs[4];
+
+  ck_assert_int_gt (pars->external->i, 64 * BinParsBlock); // more than one block of columns
+  for (i = 0; i < 20; i++) {
+    randomise_topology (sptree);
+    score = binary_parsimony_score_of_topology (pars, sptree);
+    ck_assert_int_gt (score, 0);
+    ck_assert_int_eq (score, bytewise_fitch_score (pars, sptree, costs));
+    for (j = 0; j < 4; j++) ck_assert_msg (costs[j] == pars->costs[j], "cost[%d] = %.17g but bytewise = %.17g", j, pars->costs[j], costs[j]);
+  }
+}
+END_TEST
+
+START_TEST(distinct_columns_hash_index)
+{
+  int i, j, k, n_freq = 0;
+  binary_parsimony_datamatrix mrp = pars->external;
+
+  for (i = 0; i < mrp->i; i++) n_freq += mrp->freq[i];
+  ck_assert_int_gt (n_freq, mrp->i); // some gene trees were included twice
+  for (i = 1; i < mrp->i; i++) for (j = 0; j < i; j++) if (mrp->occupancy[i] == mrp->occupancy[j]) {
+    for (k = 0; (k < mrp->ntax) && (mrp->s[k][i] == mrp->s[k][j]); k++);
+    if (k == mrp->ntax) ck_abort_msg ("columns %d and %d are identical", j, i);
+  }
+  for (k = 0, i = 0; i < mrp->index_size; i++) if (mrp->col_index[i] >= 0) k++; 
+  ck_assert_int_eq (k, mrp->i); // each column has one slot in the hash table
+}
+END_TEST
+
+START_TEST(moved_branches_equal_full_score)
+{
+  int i, j, score;
+  double costs[4];
+
+  randomise_topology (sptree);
+  binary_parsimony_score_of_topology (pars, sptree);
+  clear_topology_flags (sptree);
+  for (i = 0; i < 200; i++) {
+    if (i % 3) topology_apply_spr (sptree, true);
+    else       topology_apply_nni (sptree, true);
+    score = binary_parsimony_score_of_moved_branches (pars, sptree);
+    ck_assert_int_eq (score, bytewise_fitch_score (pars, sptree, costs));
+    ck_assert (costs[1] == pars->costs[1]);
+    for (j = 2; j < 4; j++) ck_assert_double_eq_tol (costs[j], pars->costs[j], 1e-9 * costs[j]);
+    if (i % 2) accept_binary_parsimony_moved_branches (pars, sptree);
+    else {
+      undo_binary_parsimony_moved_branches (pars);
+      topology_undo_random_move (sptree, true);
+    }
+  }
+  score = pars->costs[0];
+  ck_assert_int_eq (score, bytewise_fitch_score (pars, sptree, costs));
+  ck_assert_int_eq (score, binary_parsimony_score_of_topology (pars, sptree));
+}
+END_TEST
+
+START_TEST(spr_search_reaches_local_optimum)
+{
+  int i, score, previous;
+  double costs[4];
+
+  randomise_topology (sptree);
+  previous = binary_parsimony_unrooted_score_of_topology (pars, sptree);
+  ck_assert_int_eq (previous, bytewise_fitch_unrooted_score (pars, sptree));
+  for (i = 0; i < 500; i++) { // one move at a time: each must improve the (unrooted) score predicted by insertion costs
+    score = binary_parsimony_spr_hill_climbing (pars, sptree, 1);
+    ck_assert_int_eq (score, bytewise_fitch_unrooted_score (pars, sptree));
+    ck_assert_int_eq ((int) pars->costs[0], bytewise_fitch_score (pars, sptree, costs));
+    if (score == previous) break;
+    ck_assert_int_lt (score, previous);
+    previous = score;
+  }
+  ck_assert_int_gt (i, 0);
+  ck_assert_int_lt (i, 500);
+  clear_topology_flags (sptree);
+  for (i = 0; i < 200; i++) { // no SPR or NNI neighbour is better
+    if (i % 3) topology_apply_spr (sptree, true);
+    else       topology_apply_nni (sptree, true);
+    ck_assert_int_ge (binary_parsimony_unrooted_score_of_topology (pars, sptree), score);
+    topology_undo_random_move (sptree, true);
+  }
+  ck_assert_int_le (binary_parsimony_ratchet (pars, sptree, 5, 0.2), score);
+  ck_assert_int_eq ((int) pars->costs[0], bytewise_fitch_score (pars, sptree, costs));
+}
+END_TEST
+
+START_TEST(pairwise_distances_equal_bytewise)
+{ /* reference: one column at a time */
+  int i, j, k, idx, n_pairs = n_species * (n_species - 1) / 2, conflict, invalid;
+  double *dist[3], conflict_dbl;
+  binary_parsimony_datamatrix mrp = pars->external;
+
+  for (k = 0; k < 3; k++) dist[k] = (double*) biomcmc_malloc (n_pairs * sizeof (double));
+  pairwise_distances_from_binary_parsimony_datamatrix (mrp, dist, 2);
+  for (j = 1; j < n_species; j++) for (i = 0; i < j; i++) {
+    idx = (j * (j-1)) /2 + i;
+    conflict = invalid = 0; conflict_dbl = 0.;
+    for (k = 0; k < mrp->i; k++) {
+      if (((mrp->s[i][k] ^ mrp->s[j][k]) & 3U) == 3U) {
+        conflict += mrp->freq[k];
+        conflict_dbl += (double) (mrp->freq[k]) / biomcmc_log1p ((double) (mrp->occupancy[k]));
+      }
+      if ((mrp->s[i][k] + mrp->s[j][k]) == 6U) invalid += mrp->freq[k];
+    }
+    ck_assert_double_eq (dist[0][idx], (double) (conflict) / (double) (mrp->freq_sum));
+    ck_assert_double_eq_tol (dist[1][idx], conflict_dbl, 1e-12 * conflict_dbl);
+    ck_assert_double_eq (dist[2][idx], (double) (conflict) / ((double) (mrp->freq_sum - invalid) + 1));
+  }
+  for (k = 0; k < 3; k++) free (dist[k]);
+}
+END_TEST
+
+START_TEST(dna_fitch_equal_unit_sankoff)
+{
+  int i, score;
+  double w_score, cost[16];
+
+  ck_assert_int_lt (dpars->npat, align->nchar);
+  for (i = 0; i < 10; i++) {
+    randomise_topology (tree);
+    score = dna_parsimony_fitch_score_of_topology (dpars, tree);
+    ck_assert_int_gt (score, 0);
+    ck_assert_msg ((double) score == dna_parsimony_sankoff_score_of_topology (dpars, tree), "Fitch = %d", score);
+    topology_apply_rerooting (tree, true); // rooting does not change parsimony score
+    ck_assert_int_eq (score, dna_parsimony_fitch_score_of_topology (dpars, tree));
+  }
+  for (i = 0; i < 16; i++) cost[i] = (i / 4 == i % 4) ? 0. : (((i / 4) ^ (i % 4)) == 2 ? 1. : 2.); // A<->G and C<->T are transitions
+  dna_parsimony_set_sankoff_costs (dpars, cost);
+  w_score = dna_parsimony_sankoff_score_of_topology (dpars, tree);
+  ck_assert (w_score > (double) score && w_score < 2. * (double) score);
+  topology_apply_rerooting (tree, true); // symmetric costs 
+  ck_assert_double_eq_tol (w_score, dna_parsimony_sankoff_score_of_topology (dpars, tree), 1e-9);
+}
+END_TEST
+
+Suite * parsimony_suite(void)
+{
+  Suite *s;
+  TCase *tc_case;
+
+  s = suite_create("Parsimony");
+  tc_case = tcase_create("binary_parsimony");
+  tcase_add_checked_fixture(tc_case, random_gene_trees_setup, random_gene_trees_teardown);
+  tcase_add_test(tc_case, bitsliced_fitch_equal_bytewise);
+  tcase_add_test(tc_case, distinct_columns_hash_index);
+  tcase_add_test(tc_case, moved_branches_equal_full_score);
+  tcase_add_test(tc_case, spr_search_reaches_local_optimum);
+  tcase_add_test(tc_case, pairwise_distances_equal_bytewise);
+  suite_add_tcase(s, tc_case);
+  tc_case = tcase_create("dna_parsimony");
+  tcase_add_checked_fixture(tc_case, random_alignment_setup, random_alignment_teardown);
+  tcase_add_test(tc_case, dna_fitch_equal_unit_sankoff);
+  suite_add_tcase(s, tc_case);
+  return s;
+}
+
+int main(void)
+{
+  int number_failed;
+  SRunner *sr;
+
+  sr = srunner_create (parsimony_suite());
+  srunner_run_all(sr, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed > 0) ? TEST_FAILURE:TEST_SUCCESS;
+}
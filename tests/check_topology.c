@@ -88,6 +88,208 @@ START_TEST(new_speciestree_function)
 }
 END_TEST
 
+START_TEST(bipartition_arena_splits)
+{
+  int i, nleaves[] = {12, 150, 400}; /* splits stored within structs or in a separate block */
+  topology t1, t2;
+  bipartition leaf;
+
+  biomcmc_random_number_init (20221);
+  t1 = new_topology (nleaves[_i]);
+  t2 = new_topology (nleaves[_i]);
+  ck_assert (t1->nodelist[t1->nnodes - 1]->split == t1->nodelist[0]->split + t1->nnodes - 1); /* contiguous */
+  randomise_topology (t1);
+  copy_topology_from_topology (t2, t1);
+  update_topology_traversal (t2);
+  ck_assert (topology_is_equal (t1, t2));
+  ck_assert_int_eq (t2->root->split->n_ones, nleaves[_i]);
+  for (i = 0; i < t2->nleaves; i++) { /* leaf splits shared, as in topology_space */
+    del_bipartition (t2->nodelist[i]->split);
+    t2->nodelist[i]->split = t1->nodelist[i]->split;
+    t1->nodelist[i]->split->ref_counter++;
+  }
+  leaf = t2->nodelist[nleaves[_i] - 1]->split;
+  del_topology (t1); /* t1 splits are kept while t2 uses them */
+  ck_assert (bipartition_is_bit_set (leaf, nleaves[_i] - 1) && (leaf->n_ones == 1));
+  update_topology_traversal (t2);
+  ck_assert_int_eq (t2->root->split->n_ones, nleaves[_i]);
+  del_topology (t2);
+  biomcmc_random_number_finalize ();
+}
+END_TEST
+
+START_TEST(bipartition_kernels_equal)
+{
+  int i, j, k, op, kernel, size[] = {64, 200, 333, 1000, 4097}, n_ones[5][5], order[5][2];
+  void (*bipop[5]) (bipartition, const bipartition, const bipartition, bool) = 
+    {&bipartition_AND, &bipartition_OR, &bipartition_ANDNOT, &bipartition_XOR, &bipartition_XORNOT};
+  bipartition b[4], res[5][5]; /* res[kernel][operation] */
+
+  biomcmc_random_number_init (20222);
+  for (i = 0; i < 5; i++) {
+    for (j = 0; j < 4; j++) b[j] = new_bipartition (size[i]);
+    for (j = 0; j < size[i]; j++) {
+      if (biomcmc_rng_unif_int (2)) bipartition_set (b[0], j);
+      if (biomcmc_rng_unif_int (3)) bipartition_set (b[1], j);
+    }
+    bipartition_copy (b[2], b[0]);
+    bipartition_copy (b[3], b[0]); /* differs from b[0] only at first (least significant) word */
+    if (bipartition_is_bit_set (b[3], 3)) bipartition_unset (b[3], 3);
+    else bipartition_set (b[3], 3);
+    for (kernel = BIP_KERNEL_scalar; kernel <= BIP_KERNEL_avx512; kernel++) {
+      k = set_bipartition_kernel (kernel);
+      for (op = 0; op < 5; op++) {
+        res[kernel][op] = new_bipartition (size[i]);
+        bipop[op] (res[kernel][op], b[0], b[1], true);
+        n_ones[kernel][op] = res[kernel][op]->n_ones;
+        ck_assert_int_eq (n_ones[kernel][op], bipartition_count_n_ones_pop0 (res[kernel][op]));
+      }
+      ck_assert (bipartition_is_equal (b[0], b[2]) && !bipartition_is_equal (b[0], b[3]));
+      order[kernel][0] = compare_bipartitions_increasing (&(b[0]), &(b[3]));
+      order[kernel][1] = (int) bipartition_is_larger (b[3], b[0]);
+      ck_assert_int_eq (compare_bipartitions_increasing (&(b[0]), &(b[2])), 0);
+      for (op = 0; op < 5; op++) { /* same results as scalar version */
+        ck_assert_int_eq (n_ones[kernel][op], n_ones[0][op]);
+        ck_assert (bipartition_is_equal (res[kernel][op], res[0][op]));
+      }
+      ck_assert_int_eq (order[kernel][0], order[0][0]);
+      ck_assert_int_eq (order[kernel][1], order[0][1]);
+      if (k < kernel) { kernel++; break; } /* CPU doesn't support faster kernels */
+    }
+    for (j = 0; j < kernel; j++) for (op = 0; op < 5; op++) del_bipartition (res[j][op]);
+    for (j = 0; j < 4; j++) del_bipartition (b[j]);
+  }
+  set_bipartition_kernel (BIP_KERNEL_avx512);
+  biomcmc_random_number_finalize ();
+}
+END_TEST
+
+START_TEST(topology_hash_incremental)
+{
+  int i, nleaves[] = {4, 9, 60, 300};
+  uint64_t h_rooted, h_unrooted;
+  topology t1, t2, t3;
+
+  biomcmc_random_number_init (20223);
+  t1 = new_topology (nleaves[_i]);
+  t2 = new_topology (nleaves[_i]);
+  t3 = new_topology (nleaves[_i]);
+  randomise_topology (t1);
+  update_topology_traversal (t1);
+  for (i = 0; i < 200; i++) {
+    copy_topology_from_topology (t2, t1); /* copy updates traversal of t1, thus hashes are calculated from scratch */
+    if (i % 2) topology_apply_spr (t1, false); /* SPR moves do not update traversal */
+    else       topology_apply_spr_unrooted (t1, false);
+    h_rooted = topology_hash_rooted (t1);
+    h_unrooted = topology_hash_unrooted (t1);
+    copy_topology_from_topology (t3, t1);
+    ck_assert (h_rooted   == topology_hash_rooted (t1));
+    ck_assert (h_unrooted == topology_hash_unrooted (t1));
+    if (h_rooted   == topology_hash_rooted (t2))   ck_assert (topology_is_equal (t1, t2));
+    if (h_unrooted == topology_hash_unrooted (t2)) ck_assert (topology_is_equal_unrooted (t1, t2, true));
+    if (i % 6) continue; /* only unrooted SPR is guaranteed to have changed the tree (and undo info) */
+    topology_undo_random_move (t1, false);
+    ck_assert (topology_hash_rooted (t1)   == topology_hash_rooted (t2));
+    ck_assert (topology_hash_unrooted (t1) == topology_hash_unrooted (t2));
+  }
+  copy_topology_from_topology (t2, t1);
+  for (i = 0; i < t1->nnodes; i++) if ((t1->nodelist[i]->up) && (t1->nodelist[i]->up != t1->root)) { /* rerooting */
+    apply_spr_at_nodes_LCAprune (t1, t1->root, t1->nodelist[i], false);
+    ck_assert (topology_hash_unrooted (t1) == topology_hash_unrooted (t2));
+  }
+  del_topology (t1);
+  del_topology (t2);
+  del_topology (t3);
+  biomcmc_random_number_finalize ();
+}
+END_TEST
+
+START_TEST(bip_hashtable_concurrent_count)
+{
+  int i, j, n_trees = 256, n_splits = 0;
+  topology *tree;
+  bip_hashtable serial, shared;
+
+  biomcmc_random_number_init (20224);
+  tree = (topology*) biomcmc_malloc (n_trees * sizeof (topology));
+  for (i = 0; i < n_trees; i++) {
+    tree[i] = new_topology (12); /* few leaves, thus many repeated splits */
+    randomise_topology (tree[i]);
+    update_topology_traversal (tree[i]);
+  }
+  serial = new_bip_hashtable (4);
+  shared = new_bip_hashtable (4); /* both tables must grow */
+  for (i = 0; i < n_trees; i++) for (j = 0; j < tree[i]->nleaves - 2; j++) bip_hashtable_insert (serial, tree[i]->postorder[j]->split);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(4) private(j)
+#endif
+  for (i = 0; i < n_trees; i++) for (j = 0; j < tree[i]->nleaves - 2; j++) bip_hashtable_insert (shared, tree[i]->postorder[j]->split);
+
+  ck_assert_int_eq (bip_hashtable_n_items (serial), bip_hashtable_n_items (shared));
+  for (i = 0; i < n_trees; i++) for (j = 0; j < tree[i]->nleaves - 2; j++) {
+    ck_assert_int_eq (bip_hashtable_get_count (serial, tree[i]->postorder[j]->split), bip_hashtable_get_count (shared, tree[i]->postorder[j]->split));
+    ck_assert (bip_hashtable_get_frequency (shared, tree[i]->postorder[j]->split) > 0.);
+    ck_assert (bip_hashtable_get_frequency (serial, tree[i]->postorder[j]->split) == bip_hashtable_get_frequency (shared, tree[i]->postorder[j]->split));
+    n_splits++;
+  }
+  ck_assert (bip_hashtable_n_items (shared) < n_splits);
+  ck_assert_int_eq (bip_hashtable_get_count (shared, tree[0]->root->split), 0); /* root split was not inserted */
+  del_bip_hashtable (serial);
+  del_bip_hashtable (shared);
+  for (i = 0; i < n_trees; i++) del_topology (tree[i]);
+  free (tree);
+  biomcmc_random_number_finalize ();
+}
+END_TEST
+
+START_TEST(topology_space_hash_index)
+{
+  int i, j, k, n_pool = 40, n_distinct = 0, n_trees = 1000, *used;
+  bool use_root = (bool) _i;
+  topology pool[40], topol;
+  topology_space tsp;
+
+  biomcmc_random_number_init (20225);
+  used = (int*) biomcmc_malloc (n_pool * sizeof (int));
+  for (i = 0; i < n_pool; i++) { /* small trees, thus the pool may have repeated topologies */
+    pool[i] = new_topology (6);
+    randomise_topology (pool[i]);
+    update_topology_traversal (pool[i]);
+    used[i] = 0;
+  }
+  tsp = new_topology_space ();
+  for (i = 0; i < n_trees; i++) {
+    j = biomcmc_rng_unif_int (n_pool);
+    used[j] = 1;
+    topol = new_topology (6);
+    copy_topology_from_topology (topol, pool[j]);
+    if ((!use_root) && (biomcmc_rng_unif_int (2))) { /* same unrooted tree, distinct root location */
+      do { k = biomcmc_rng_unif_int (topol->nnodes); } while ((!topol->nodelist[k]->up) || (topol->nodelist[k]->up == topol->root));
+      apply_spr_at_nodes_LCAprune (topol, topol->root, topol->nodelist[k], false);
+    }
+    add_topology_to_topology_space_if_distinct (topol, tsp, 1., use_root);
+  }
+  for (i = 0; i < n_pool; i++) if (used[i]) { /* brute force count of distinct topologies */
+    for (j = 0; j < i; j++) if (used[j]) {
+      if ((use_root) && (topology_is_equal (pool[i], pool[j]))) break;
+      if ((!use_root) && (topology_is_equal_unrooted (pool[i], pool[j], true))) break;
+    }
+    if (j == i) n_distinct++;
+  }
+  ck_assert_int_eq (tsp->ntrees, n_trees);
+  ck_assert_int_eq (tsp->ndistinct, n_distinct);
+  for (i = 0; i < n_trees; i++) { /* each tree points to a distinct topology that represents it */
+    ck_assert (tsp->tree[i] == tsp->distinct[ tsp->tree[i]->id ]);
+  }
+  for (i = 0, j = 0; i < tsp->ndistinct; i++) j += (int) tsp->freq[i];
+  ck_assert_int_eq (j, n_trees);
+  del_topology_space (tsp);
+  for (i = 0; i < n_pool; i++) del_topology (pool[i]);
+  free (used);
+  biomcmc_random_number_finalize ();
+}
+END_TEST
+
 Suite * topology_suite(void)
 {
   Suite *s;
@@ -97,6 +299,11 @@ Suite * topology_suite(void)
 
   tc_case = tcase_create("read_trees");
   tcase_add_test(tc_case, new_single_topology_from_newick_file_function);
+  tcase_add_loop_test (tc_case, bipartition_arena_splits, 0, 3);
+  tcase_add_test(tc_case, bipartition_kernels_equal);
+  tcase_add_loop_test (tc_case, topology_hash_incremental, 0, 4);
+  tcase_add_test(tc_case, bip_hashtable_concurrent_count);
+  tcase_add_loop_test (tc_case, topology_space_hash_index, 0, 2);
   suite_add_tcase(s, tc_case);
   tc_case = tcase_create("read_newick_space");
   tcase_add_checked_fixture(tc_case, newick_space_setup_ortho_nwk, del_trees_teardown); // unchecked -> once per case; checked -> per unit
@@ -0,0 +1,81 @@
+#include <biomcmc.h>
+
+#define TEST_SUCCESS 0
+#define TEST_FAILURE 1
+#define TEST_SKIPPED 77
+#define TEST_HARDERROR 99
+
+/* micro-benchmark of bipartition kernels: nanoseconds per bipartition, for each operation and instruction set
+ * usage: debug_bipartition <repetitions> (e.g. 100) */
+
+const char *kernel_name[] = {"scalar", "popcnt", "avx2", "avx512"};
+
+double
+nsecs_per_bipartition (clock_t time0, int n_rep, int n_bip)
+{
+  return 1.e9 * (double)(clock () - time0) / ((double) CLOCKS_PER_SEC * (double) n_rep * (double) n_bip);
+}
+
+int main(int argc, char **argv)
+{
+  int i, j, k, rep, n_rep = 100, n_bip, kernel, nleaves[] = {64, 128, 256, 1000, 10000, 100000};
+  volatile int sink = 0;
+  clock_t time0;
+  bipartition *b, *shuffled, *sorted, res;
+
+  if (argc == 1) return TEST_SKIPPED;
+  sscanf (argv[1], " %d ", &n_rep);
+  biomcmc_random_number_init (0ULL);
+
+  fprintf (stderr, "%7s %7s %10s %10s %10s %10s %10s\n", "leaves", "kernel", "AND+count", "XOR", "count", "is_equal", "qsort");
+  for (i = 0; i < 6; i++) {
+    n_bip = BIOMCMC_MAX (64, BIOMCMC_MIN (4096, (1 << 19) / (nleaves[i] / 64 + 1))); /* about 4MB of bitstrings */
+    b = (bipartition*) biomcmc_malloc (n_bip * sizeof (bipartition));
+    shuffled = (bipartition*) biomcmc_malloc (n_bip * sizeof (bipartition));
+    sorted = (bipartition*) biomcmc_malloc (n_bip * sizeof (bipartition));
+    for (j = 0; j < n_bip; j++) {
+      b[j] = new_bipartition (nleaves[i]);
+      if (j % 2) { bipartition_copy (b[j], b[j-1]); continue; } /* is_equal() must scan whole bitstrings */
+      for (k = 0; k < nleaves[i]; k++) if (biomcmc_rng_unif_int (2)) bipartition_set (b[j], k);
+    }
+    for (j = 0; j < n_bip; j++) shuffled[j] = b[j];
+    for (j = n_bip - 1; j > 0; j--) { /* Fisher-Yates, s.t. qsort starts from a random permutation */
+      k = biomcmc_rng_unif_int (j + 1);
+      res = shuffled[j]; shuffled[j] = shuffled[k]; shuffled[k] = res;
+    }
+    res = new_bipartition (nleaves[i]);
+
+    for (kernel = BIP_KERNEL_scalar; kernel <= BIP_KERNEL_avx512; kernel++) {
+      if (set_bipartition_kernel (kernel) != kernel) continue; /* not supported by CPU */
+      fprintf (stderr, "%7d %7s", nleaves[i], kernel_name[kernel]);
+      time0 = clock ();
+      for (rep = 0; rep < n_rep; rep++) for (j = 1; j < n_bip; j++) { bipartition_AND (res, b[j-1], b[j], true); sink += res->n_ones; }
+      fprintf (stderr, " %10.2lf", nsecs_per_bipartition (time0, n_rep, n_bip - 1));
+      time0 = clock ();
+      for (rep = 0; rep < n_rep; rep++) for (j = 1; j < n_bip; j++) bipartition_XOR (res, b[j-1], b[j], false);
+      fprintf (stderr, " %10.2lf", nsecs_per_bipartition (time0, n_rep, n_bip - 1));
+      time0 = clock ();
+      for (rep = 0; rep < n_rep; rep++) for (j = 0; j < n_bip; j++) sink += bipartition_count_n_ones (b[j]);
+      fprintf (stderr, " %10.2lf", nsecs_per_bipartition (time0, n_rep, n_bip));
+      time0 = clock ();
+      for (rep = 0; rep < n_rep; rep++) for (j = 1; j < n_bip; j++) sink += bipartition_is_equal (b[j-1], b[j]);
+      fprintf (stderr, " %10.2lf", nsecs_per_bipartition (time0, n_rep, n_bip - 1));
+      time0 = clock ();
+      for (rep = 0; rep < n_rep; rep++) {
+        memcpy (sorted, shuffled, n_bip * sizeof (bipartition));
+        qsort (sorted, n_bip, sizeof (bipartition), compare_bipartitions_increasing);
+      }
+      fprintf (stderr, " %10.2lf\n", nsecs_per_bipartition (time0, n_rep, n_bip));
+    }
+
+    del_bipartition (res);
+    for (j = n_bip - 1; j >= 0; j--) del_bipartition (b[j]);
+    free (shuffled);
+    free (sorted);
+    free (b);
+  }
+  (void) sink;
+
+  biomcmc_random_number_finalize();
+  return TEST_SKIPPED;
+}